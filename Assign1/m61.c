@@ -1,131 +1,637 @@
+#define _GNU_SOURCE     1    // for mremap
 #define M61_DISABLE     1
+#define M61_INTERNAL    1    // declare m61.c internal functions
 #define ALIGN_SZ        8    // assignment seems suggest to use size 8 align
-#define HHITTER_ARR_SZ  5    // size of heavy hitter tracking array
+#define TABLE_INIT_SZ   1024 // initial # slots in address hash tables
+#define TABLE_TOMBSTONE 1    // key marking a removed hash table slot
+#define PAGE_SZ         4096 // page size used by the page-to-block index
+#ifndef M61_SLAB
+#define M61_SLAB        1    // serve small blocks from size-class slabs
+#endif
+#define SLAB_SZ         65536   // size of a slab, slabs are SLAB_SZ aligned
+#define ARENA_NSLABS    64      // # slabs carved from each mmap'd arena
+#define SLAB_NCLASSES   19      // # slab size classes
+#define SLAB_MAX_OBJ    2048    // largest slab object slot
+#define NSTRIPES_BITS   6       // log2 of # lock stripes in live index
+#define NSTRIPES        (1 << NSTRIPES_BITS)
+#define SLABMAP_L1_BITS 11      // slab radix map bits, root level
+#define SLABMAP_L2_BITS 10      // slab radix map bits, middle level
+#define SLABMAP_L3_BITS 10      // slab radix map bits, leaf level
+#define MMAP_MIN_SZ     131072  // heap blocks this big are mmap'd
+#define TRACE_NSITES    65536   // max # distinct sites in a trace
+#define TRACE_FLUSH_NS  5000000 // max ns a trace record waits for flush
 #include "m61.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
 
-// global stats struct
-static struct m61_statistics gstats = {
-    0, 0, 0, 0, 0, 0, NULL, NULL
+// per-thread caches of stats and heavy hitters, merged when reported
+static __thread m61_tcache* my_tcache = NULL;
+static m61_tcache* tcache_list = NULL;  // caches of all threads, ever
+static pthread_mutex_t tcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tcache_key;        // retires cache at thread exit
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+// heap bounds, shared by all threads and only ever widened
+static char* heap_min = NULL;           // smallest allocated addr
+static char* heap_max = NULL;           // largest allocated addr
+
+// live allocations index, striped by page so each block needs one lock
+static m61_stripe stripes[NSTRIPES] = {
+    [0 ... NSTRIPES - 1] = {PTHREAD_MUTEX_INITIALIZER, 
+        {NULL, 0, 0, 0}, {NULL, 0, 0, 0}}
 };
+static size_t max_payload_sz = 0; // largest payload allocated so far
 
-// arrays tracking, heavist and most frequent allocators
-m61_hhitter heavy_alloc[HHITTER_ARR_SZ] = {
-    {0, 0, NULL}
+// object slot sizes of the slab size classes, (payload + boundary check)
+static const size_t slab_class_sz[SLAB_NCLASSES] = {
+    16, 32, 48, 64, 80, 96, 128, 160, 192, 256,
+    320, 384, 512, 640, 768, 1024, 1280, 1536, 2048
 };
-m61_hhitter heavy_freq[HHITTER_ARR_SZ] = {
-    {0, 0, NULL}
+static unsigned char slab_class_of[SLAB_MAX_OBJ / 16 + 1]; // (sz/16) -> class
+static pthread_once_t slab_classes_once = PTHREAD_ONCE_INIT;
+// slabs with free slots, and the lock for each class and its slabs
+static m61_slab* slab_partial[SLAB_NCLASSES];
+static pthread_mutex_t slab_class_lock[SLAB_NCLASSES] = {
+    [0 ... SLAB_NCLASSES - 1] = PTHREAD_MUTEX_INITIALIZER
 };
+// slab_lock protects the empty list, slab list, arena and slab map writes
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static m61_slab* slab_empty = NULL;           // wholly free slabs, any class
+static m61_slab* slab_all = NULL;             // every slab, newest first
+// radix map from slab number to slab, read without locks
+static void** slabmap[1 << SLABMAP_L1_BITS];
+static char* arena_next = NULL;  // next unused slab in current arena
+static char* arena_end = NULL;   // end of current arena
 
-int alloc_neg_bias = 0; // negative bias for FREQUENT algorithm
-int freq_neg_bias = 0;  // negative bias for FREQUENT algorithm
-char* first_alloc = NULL; // first allocated address
-char* curr_alloc = NULL;  // last allocated address
+// trace state; records are queued in per-thread rings, written by flusher
+static int trace_on = 0;                // trace is being recorded
+static int trace_fd = -1;               // trace file
+static uint64_t trace_start_ns;         // time trace began
+static pthread_t trace_flusher;         // drains rings to trace_fd
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_wake = PTHREAD_COND_INITIALIZER;
+static m61_tring* trace_ring_list = NULL;   // rings of all threads, ever
+static unsigned int trace_nrings = 0;
+static m61_tsite trace_sites[TRACE_NSITES]; // interned sites, by hash
+static uint32_t trace_nsites = 0;           // # sites, ids start at 1
 
 /** @brief Allocates @sz bytes of memory and return a pointer to the 
     dynamically allocated memory. @file and @line refer to the filename
     and line in the code where malloc is called. */
 void* m61_malloc(size_t sz, const char* file, int line) {
+    void* ptr = blockalloc(sz, file, line);
+    tracerecord(M61_TRACE_MALLOC, ptr, NULL, sz, file, line);
+    return ptr;
+}
+
+/** @brief Frees a single block of memory previously allocated by malloc,
+    at address pointed to by @ptr. @file and @line refer to the filename
+    and line in the code where free is called. */
+void m61_free(void *ptr, const char *file, int line) {
+    // record first, a later malloc may reuse the address
+    tracerecord(M61_TRACE_FREE, NULL, ptr, 0, file, line);
+    blockfree(ptr, file, line);
+}
+
+/** @brief allocates, frees, or resizes memory depending on its arguments.
+    If @sz is specified, the space is malloc of that size.
+    If @ptr is specified, that space is freed. 
+    If both are specified, then, data in @ptr is resized into new ptr.
+    @file and @line refer to the filename and line in the code where realloc
+    is called.*/
+void* m61_realloc(void* ptr, size_t sz, const char* file, int line) {
+    // reserve first, like free, since @ptr may be freed and reused
+    m61_trec* rec = tracereserve(M61_TRACE_REALLOC, ptr, sz, file, line);
+    void* new_ptr = blockrealloc(ptr, sz, file, line);
+    tracecommit(rec, new_ptr);
+    return new_ptr;
+}
+
+/** @brief allocates memory of size @nmemb * @sz and clears it to zero. 
+    @file and @line refer to the filename and line in the code where calloc
+    is called.*/
+void* m61_calloc(size_t nmemb, size_t sz, const char* file, int line) {   
+    void* ptr = NULL;
+    if (nmemb == 0 || (SIZE_MAX / nmemb) > sz) {
+        ptr = blockalloc(nmemb * sz, file, line);
+        if (ptr) {
+            memset(ptr, 0, nmemb * sz);
+        }
+    } else {
+        TCACHE_ADD(gettcache()->nfail, 1);
+    }
+    tracerecord(M61_TRACE_CALLOC, ptr, NULL, nmemb * sz, file, line);
+    return ptr;
+}
+
+/** @brief allocates @sz bytes for m61_malloc and records stats. */
+static void* blockalloc(size_t sz, const char* file, int line) {
     (void) file, (void) line;   // avoid uninitialized variable warnings
     
     void* new_ptr = NULL;    // default ptr to NULL
     
-    // align size of malloced block, (including boundary check element)
-    size_t aligned_sz = sz + sizeof(uintptr_t);
-    if (sz % ALIGN_SZ != 0) {
-        aligned_sz = sz + (ALIGN_SZ - (sz % ALIGN_SZ));
+    if (M61_SLAB && sz <= SLAB_MAX_OBJ - sizeof(uintptr_t)) {
+        // small block, carved from a size-class slab
+        new_ptr = slaballoc(sz, file, line);
+    } else {
+        new_ptr = heapalloc(sz, file, line);
     }
-    
-    if ((sz < (SIZE_MAX - sizeof(m61_mdata))) &&  
-        (new_ptr = malloc(aligned_sz + sizeof(m61_mdata))) != NULL) {
 
-        ++gstats.ntotal;
-        ++gstats.nactive;
-        gstats.total_size += sz;  // sz cnt doesn't include metadata or padding
-        gstats.active_size += sz;
-        
-        if (first_alloc == NULL) {
-            first_alloc = new_ptr; // allocs linked via ptrs to metadata
-        }
-        // setting metadata header
-        m61_mdata meta_d = {sz, line, file, curr_alloc, NULL,
-            (uintptr_t)(new_ptr + sizeof(m61_mdata))};
-        memcpy(new_ptr, &meta_d, sizeof(m61_mdata));
-        // set previous node's next_addr, if not at start of list
-        if (curr_alloc != NULL) {
-            m61_mdata *prev_m_data = (m61_mdata *)(curr_alloc);
-            prev_m_data->next_addr = new_ptr;
-        }
-        curr_alloc = new_ptr;
-        new_ptr = new_ptr + sizeof(m61_mdata); // set return ptr to payld addr
+    m61_tcache* tc = gettcache();
+    if (new_ptr != NULL) {
+        TCACHE_ADD(tc->ntotal, 1);
+        TCACHE_ADD(tc->nactive, 1);
+        // sz cnt doesn't include metadata or padding
+        TCACHE_ADD(tc->total_size, sz);
+        TCACHE_ADD(tc->active_size, sz);
         
         // inserting end boundary check
         uintptr_t bcheck = (uintptr_t)(new_ptr);
         memcpy(new_ptr + sz, &bcheck, sizeof(uintptr_t));       
         
         // adding to statistics 
-        if (gstats.heap_min == NULL 
-            || gstats.heap_min > (char *)(new_ptr - sizeof(m61_mdata))) {
-            gstats.heap_min = (char *)(new_ptr - sizeof(m61_mdata));
-        } 
-        if (gstats.heap_max == NULL || 
-            gstats.heap_max < (char *)(new_ptr + sz)) {
-            gstats.heap_max = (char *)(new_ptr + sz);
-        }
+        updateheapbounds((char *)new_ptr, (char *)(new_ptr + sz));
 
         // track heaviest byte allocators, sz is passed as byte amount
-        trackheavyhitters(heavy_alloc, &alloc_neg_bias, sz, file, line);
+        uint32_t hash = sitehash(file, line);
+        trackheavyhitters(&tc->heavy_alloc, hash, sz, file, line);
         // track most frequent allocators, sz is passed as 1,(a single alloc)
-        trackheavyhitters(heavy_freq, &freq_neg_bias, 1, file, line);
+        trackheavyhitters(&tc->heavy_freq, hash, 1, file, line);
     } else {
         // allocation failed
-        ++gstats.nfail;
-        gstats.fail_size += sz;
+        TCACHE_ADD(tc->nfail, 1);
+        TCACHE_ADD(tc->fail_size, sz);
     }
     return new_ptr;
 }
 
-/** @brief Frees a single block of memory previously allocated by malloc,
-    at address pointed to by @ptr. @file and @line refer to the filename
-    and line in the code where free is called. */
-void m61_free(void *ptr, const char *file, int line) {
+/** @brief returns the calling thread's stats cache, setting one up on the
+    thread's first call. A cache retired by an exited thread is reused
+    before a new one is allocated; its counts are kept either way. */
+static m61_tcache* gettcache(void) {
+    m61_tcache* tc = my_tcache;
+    if (tc != NULL) {
+        return tc;
+    }
+    pthread_once(&tcache_once, tcacheinitkey);
+    pthread_mutex_lock(&tcache_lock);
+    for (tc = tcache_list; tc != NULL; tc = tc->next) {
+        if (tc->retired) {
+            tc->retired = 0;
+            break;
+        }
+    }
+    if (tc == NULL) {
+        tc = calloc(1, sizeof(m61_tcache));
+        if (tc == NULL) {
+            printf("MEMORY BUG: out of memory for m61 thread cache\n");
+            abort();
+        }
+        tc->next = tcache_list;
+        tcache_list = tc;
+    }
+    pthread_mutex_unlock(&tcache_lock);
+    my_tcache = tc;
+    pthread_setspecific(tcache_key, tc);
+    return tc;
+}
+
+/** @brief creates the key whose destructor retires a thread's cache. */
+static void tcacheinitkey(void) {
+    pthread_key_create(&tcache_key, tcacheretire);
+}
+
+/** @brief marks cache @arg of an exiting thread as free for reuse. */
+static void tcacheretire(void* arg) {
+    m61_tcache* tc = arg;
+    pthread_mutex_lock(&tcache_lock);
+    tc->retired = 1;
+    pthread_mutex_unlock(&tcache_lock);
+}
+
+/** @brief widens the shared heap bounds to include [@lo, @hi]. */
+static void updateheapbounds(char* lo, char* hi) {
+    char* cur = __atomic_load_n(&heap_min, __ATOMIC_RELAXED);
+    while ((cur == NULL || cur > lo) && !__atomic_compare_exchange_n(
+        &heap_min, &cur, lo, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    cur = __atomic_load_n(&heap_max, __ATOMIC_RELAXED);
+    while ((cur == NULL || cur < hi) && !__atomic_compare_exchange_n(
+        &heap_max, &cur, hi, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/** @brief allocates a block of @sz bytes from the libc heap, with the
+    metadata in a header before the payload. @file and @line are recorded
+    in the header. Returns ptr to the payload, or NULL on failure. */
+static void* heapalloc(size_t sz, const char* file, int line) {
+    if (sz >= SIZE_MAX - sizeof(m61_mdata) - sizeof(uintptr_t) - ALIGN_SZ) {
+        return NULL;
+    }
+    // align size of malloced block, (including boundary check element)
+    size_t aligned_sz = sz + sizeof(uintptr_t);
+    if (aligned_sz % ALIGN_SZ != 0) {
+        aligned_sz += ALIGN_SZ - (aligned_sz % ALIGN_SZ);
+    }
+
+    // large blocks get their own mapping, so realloc can mremap them
+    char* new_ptr;
+    size_t map_sz = 0;
+    if (aligned_sz >= MMAP_MIN_SZ) {
+        map_sz = (aligned_sz + sizeof(m61_mdata) + PAGE_SZ - 1) 
+            & ~(size_t)(PAGE_SZ - 1);
+        new_ptr = mmap(NULL, map_sz, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (new_ptr == MAP_FAILED) {
+            return NULL;
+        }
+    } else if ((new_ptr = malloc(aligned_sz + sizeof(m61_mdata))) == NULL) {
+        return NULL;
+    }
+    // setting metadata header
+    m61_mdata meta_d = {{sz, line, file}, NULL, NULL,
+        (uintptr_t)(new_ptr + sizeof(m61_mdata)), map_sz};
+    memcpy(new_ptr, &meta_d, sizeof(m61_mdata));
+    // index the block so free can find it without a list walk
+    if (trackalloc((m61_mdata *)new_ptr) == -1) {
+        heaprelease((m61_mdata *)new_ptr);
+        return NULL;
+    }
+    return new_ptr + sizeof(m61_mdata); // return ptr to payld addr
+}
+
+/** @brief returns the memory of heap block @meta_d to where it came from. */
+static void heaprelease(m61_mdata* meta_d) {
+    if (meta_d->map_sz != 0) {
+        munmap(meta_d, meta_d->map_sz);
+    } else {
+        free(meta_d);
+    }
+}
+
+/** @brief resizes heap block @blk to @sz bytes, without copying if possible.
+    A block stays put if its libc chunk or mapping has room for @sz and the 
+    boundary check. Else a libc block is grown with realloc, if it stays
+    under MMAP_MIN_SZ, and a mapped block with mremap, which moves pages 
+    rather than copying them. @blk is updated. Returns the new payload ptr,
+    or NULL if the block must be moved by the caller. */
+static void* heapresize(m61_bref* blk, size_t sz) {
+    m61_mdata* meta_d = blk->meta_d;
+    if (sz >= SIZE_MAX - sizeof(m61_mdata) - sizeof(uintptr_t) - PAGE_SZ) {
+        return NULL;
+    }
+    size_t need_sz = sizeof(m61_mdata) + sz + sizeof(uintptr_t);
+    size_t have_sz = meta_d->map_sz;
+    if (have_sz == 0) {
+        have_sz = malloc_usable_size(meta_d);
+    }
+    if (need_sz <= have_sz && (meta_d->map_sz == 0 || need_sz > have_sz / 2)) {
+        m61_stripe *stripe = stripeof(meta_d->payload_addr);
+        pthread_mutex_lock(&stripe->lock);
+        meta_d->rec.payload_size = sz;
+        pthread_mutex_unlock(&stripe->lock);
+        updatemaxpayload(sz);
+        return (void *)meta_d->payload_addr;
+    }
+    if ((meta_d->map_sz == 0) != (need_sz < MMAP_MIN_SZ)) {
+        // crossing between the libc heap and mappings
+        return NULL;
+    }
+
+    // the block may move, so take it out of the index while it is resized
+    if (untrackalloc(meta_d) == -1) {
+        return NULL;
+    }
+    m61_mdata* new_meta_d;
+    if (meta_d->map_sz != 0) {
+        size_t map_sz = (need_sz + PAGE_SZ - 1) & ~(size_t)(PAGE_SZ - 1);
+        new_meta_d = mremap(meta_d, meta_d->map_sz, map_sz, MREMAP_MAYMOVE);
+        if (new_meta_d == MAP_FAILED) {
+            new_meta_d = NULL;
+        } else {
+            new_meta_d->map_sz = map_sz;
+        }
+    } else {
+        new_meta_d = realloc(meta_d, need_sz);
+    }
+    if (new_meta_d == NULL) {
+        // old block is untouched
+        new_meta_d = meta_d;
+        if (trackalloc(new_meta_d) == -1) {
+            printf("MEMORY BUG: out of memory for m61 live index\n");
+            abort();
+        }
+        return NULL;
+    }
+    new_meta_d->payload_addr = (uintptr_t)new_meta_d + sizeof(m61_mdata);
+    new_meta_d->rec.payload_size = sz;
+    if (trackalloc(new_meta_d) == -1) {
+        printf("MEMORY BUG: out of memory for m61 live index\n");
+        abort();
+    }
+    blk->rec = &new_meta_d->rec;
+    blk->payload_addr = new_meta_d->payload_addr;
+    blk->meta_d = new_meta_d;
+    return (void *)new_meta_d->payload_addr;
+}
+
+/** @brief allocates a block of @sz bytes from a slab of the smallest size
+    class that fits it, and its boundary check. @file and @line are 
+    recorded in the slab's side table. Returns ptr to the payload, or NULL
+    on failure. */
+static void* slaballoc(size_t sz, const char* file, int line) {
+    if (sz > SLAB_MAX_OBJ - sizeof(uintptr_t)) {
+        return NULL;
+    }
+    pthread_once(&slab_classes_once, slabinitclasses);
+    int class_idx = slab_class_of[(sz + sizeof(uintptr_t) + 15) / 16];
+    pthread_mutex_lock(&slab_class_lock[class_idx]);
+    m61_slab* slab = slab_partial[class_idx];
+    if (slab == NULL && (slab = slabnew(class_idx)) == NULL) {
+        pthread_mutex_unlock(&slab_class_lock[class_idx]);
+        return NULL;
+    }
+
+    // take a freed slot if any, else the next never used slot
+    char* obj;
+    unsigned int slot;
+    if (slab->freelist != NULL) {
+        obj = slab->freelist;
+        memcpy(&slab->freelist, obj, sizeof(void *));
+        slot = (obj - slab->objects) / slab->slot_sz;
+    } else {
+        slot = slab->nbumped++;
+        obj = slab->objects + slot * slab->slot_sz;
+    }
+    slab->inuse[slot / 64] |= (uint64_t)1 << (slot % 64);
+    slab->recs[slot].payload_size = sz;
+    slab->recs[slot].line_num = line;
+    slab->recs[slot].filename = file;
+
+    // full slabs leave the class list until a slot is freed
+    if (--slab->nfree == 0) {
+        slab_partial[class_idx] = slab->next;
+        if (slab->next != NULL) {
+            slab->next->prev = NULL;
+        }
+        slab->next = NULL;
+    }
+    pthread_mutex_unlock(&slab_class_lock[class_idx]);
+    return obj;
+}
+
+/** @brief returns the slot of block @blk to its slab. A slab left wholly
+    free is moved to the empty list, unless it is its class's only slab.
+    Returns 0 on success, -1 if the slot was already freed. */
+static int slabfree(m61_bref* blk) {
+    m61_slab* slab = blk->slab;
+    int class_idx = slablockclass(slab);
+    char* obj = (char *)blk->payload_addr;
+    unsigned int slot = (obj - slab->objects) / slab->slot_sz;
+    if (!slabslotinuse(slab, slot)) {
+        // lost a race with another free of the same block
+        pthread_mutex_unlock(&slab_class_lock[class_idx]);
+        return -1;
+    }
+    slab->inuse[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+    memcpy(obj, &slab->freelist, sizeof(void *));
+    slab->freelist = obj;
+
+    m61_slab** class_head = &slab_partial[class_idx];
+    if (slab->nfree++ == 0) {
+        // slab was full, so rejoin the class list
+        slab->prev = NULL;
+        slab->next = *class_head;
+        if (*class_head != NULL) {
+            (*class_head)->prev = slab;
+        }
+        *class_head = slab;
+    }
+    if (slab->nfree == slab->nslots 
+        && (slab->prev != NULL || slab->next != NULL)) {
+        if (slab->prev != NULL) {
+            slab->prev->next = slab->next;
+        } else {
+            *class_head = slab->next;
+        }
+        if (slab->next != NULL) {
+            slab->next->prev = slab->prev;
+        }
+        pthread_mutex_lock(&slab_lock);
+        slab->prev = NULL;
+        slab->next = slab_empty;
+        slab_empty = slab;
+        pthread_mutex_unlock(&slab_lock);
+    }
+    pthread_mutex_unlock(&slab_class_lock[class_idx]);
+    return 0;
+}
+
+/** @brief locks the size class of @slab and returns its index. The class
+    of a slab only changes while it is empty, so recheck after locking. */
+static int slablockclass(m61_slab* slab) {
+    while (1) {
+        int class_idx = __atomic_load_n(&slab->class_idx, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&slab_class_lock[class_idx]);
+        if (__atomic_load_n(&slab->class_idx, __ATOMIC_RELAXED) == class_idx) {
+            return class_idx;
+        }
+        pthread_mutex_unlock(&slab_class_lock[class_idx]);
+    }
+}
+
+/** @brief returns whether @slot of @slab is allocated. */
+static int slabslotinuse(m61_slab* slab, unsigned int slot) {
+    return (slab->inuse[slot / 64] & ((uint64_t)1 << (slot % 64))) != 0;
+}
+
+/** @brief sets up a slab for size class @class_idx, reusing an empty slab
+    or carving a new one from an arena, and adds it to the class list. The
+    class lock must be held. Returns the slab, or NULL if out of memory. */
+static m61_slab* slabnew(int class_idx) {
+    pthread_mutex_lock(&slab_lock);
+    m61_slab* slab = slab_empty;
+    if (slab != NULL) {
+        slab_empty = slab->next;
+    } else {
+        char* slab_addr = arenacarve();
+        if (slab_addr == NULL) {
+            pthread_mutex_unlock(&slab_lock);
+            return NULL;
+        }
+        slab = (m61_slab *)slab_addr;
+        slab->class_idx = class_idx;
+        if (slabmapinsert(slab) == -1) {
+            // retry with the slab next time
+            arena_next = slab_addr;
+            pthread_mutex_unlock(&slab_lock);
+            return NULL;
+        }
+        slab->all_next = slab_all;
+        slab_all = slab;
+    }
+    __atomic_store_n(&slab->class_idx, class_idx, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&slab_lock);
+
+    // header, then side table of recs, then the object slots
+    size_t slot_sz = slab_class_sz[class_idx];
+    unsigned int nslots = (SLAB_SZ - sizeof(m61_slab)) 
+        / (slot_sz + sizeof(m61_arec));
+    size_t obj_off;
+    while (1) {
+        obj_off = sizeof(m61_slab) + nslots * sizeof(m61_arec);
+        obj_off = (obj_off + 15) & ~(size_t)15;
+        if (obj_off + nslots * slot_sz <= SLAB_SZ) {
+            break;
+        }
+        --nslots;
+    }
+    memset(slab->inuse, 0, sizeof(slab->inuse));
+    slab->freelist = NULL;
+    slab->objects = (char *)slab + obj_off;
+    slab->recs = (m61_arec *)((char *)slab + sizeof(m61_slab));
+    slab->slot_sz = slot_sz;
+    slab->nslots = nslots;
+    slab->nbumped = 0;
+    slab->nfree = nslots;
+
+    slab->prev = NULL;
+    slab->next = slab_partial[class_idx];
+    if (slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    slab_partial[class_idx] = slab;
+    return slab;
+}
+
+/** @brief resizes slab block @blk to @sz bytes, if its slot holds @sz and
+    the boundary check, and @sz doesn't waste over half the slot. Returns 0
+    on success, -1 if the block must be moved by the caller. */
+static int slabresize(m61_bref* blk, size_t sz) {
+    m61_slab* slab = blk->slab;
+    if (sz + sizeof(uintptr_t) > slab->slot_sz 
+        || (slab->class_idx != 0 
+            && 2 * (sz + sizeof(uintptr_t)) <= slab->slot_sz)) {
+        return -1;
+    }
+    int class_idx = slablockclass(slab);
+    blk->rec->payload_size = sz;
+    pthread_mutex_unlock(&slab_class_lock[class_idx]);
+    return 0;
+}
+
+/** @brief returns the address of a new SLAB_SZ aligned slab, mapping a new
+    arena of ARENA_NSLABS slabs when the current one is used up. slab_lock 
+    must be held. Returns NULL if out of memory. */
+static char* arenacarve(void) {
+    if (arena_next == arena_end) {
+        size_t arena_sz = (size_t)SLAB_SZ * ARENA_NSLABS;
+        // over-allocate by a slab, then trim so slabs are aligned
+        char* map = mmap(NULL, arena_sz + SLAB_SZ, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            return NULL;
+        }
+        char* start = (char *)(((uintptr_t)map + SLAB_SZ - 1) 
+            & ~(uintptr_t)(SLAB_SZ - 1));
+        if (start != map) {
+            munmap(map, start - map);
+        }
+        if (start + arena_sz != map + arena_sz + SLAB_SZ) {
+            munmap(start + arena_sz, (map + SLAB_SZ) - start);
+        }
+        arena_next = start;
+        arena_end = start + arena_sz;
+    }
+    char* slab_addr = arena_next;
+    arena_next += SLAB_SZ;
+    return slab_addr;
+}
+
+/** @brief adds @slab to the slab radix map, allocating map levels as 
+    needed. slab_lock must be held; readers do not lock. Returns 0 on 
+    success, -1 if out of memory. */
+static int slabmapinsert(m61_slab* slab) {
+    uintptr_t slab_num = (uintptr_t)slab / SLAB_SZ;
+    size_t l1_idx = slab_num >> (SLABMAP_L2_BITS + SLABMAP_L3_BITS);
+    size_t l2_idx = (slab_num >> SLABMAP_L3_BITS) 
+        & ((1 << SLABMAP_L2_BITS) - 1);
+    size_t l3_idx = slab_num & ((1 << SLABMAP_L3_BITS) - 1);
+
+    void** l2 = slabmap[l1_idx];
+    if (l2 == NULL) {
+        l2 = calloc(1 << SLABMAP_L2_BITS, sizeof(void *));
+        if (l2 == NULL) {
+            return -1;
+        }
+        __atomic_store_n(&slabmap[l1_idx], l2, __ATOMIC_RELEASE);
+    }
+    m61_slab** l3 = l2[l2_idx];
+    if (l3 == NULL) {
+        l3 = calloc(1 << SLABMAP_L3_BITS, sizeof(m61_slab *));
+        if (l3 == NULL) {
+            return -1;
+        }
+        __atomic_store_n(&l2[l2_idx], l3, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&l3[l3_idx], slab, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/** @brief fills the table mapping a slot size (in 16 byte units) to the
+    smallest size class that holds it. */
+static void slabinitclasses(void) {
+    int class_idx = 0;
+    for (size_t i = 0; i <= SLAB_MAX_OBJ / 16; i++) {
+        while (slab_class_sz[class_idx] < i * 16) {
+            ++class_idx;
+        }
+        slab_class_of[i] = class_idx;
+    }
+}
+
+/** @brief frees block @ptr for m61_free, after validating it. */
+static void blockfree(void *ptr, const char *file, int line) {
     (void) file, (void) line;   // avoid uninitialized variable warnings
     // no need to free if already NULL
     if (ptr != NULL) {
         // validate that free is ok to do
         validateinheap(ptr, file, line);
-        validateisallocated(ptr, file, line);
-        validateboundarycheck(ptr, file, line);
+        m61_bref blk;
+        validateisallocated(ptr, file, line, &blk);
+        validateboundarycheck(&blk, file, line);
         
         // All validation passed successfully
-        m61_mdata *meta_d = (m61_mdata *)(ptr - sizeof(m61_mdata));
-        
-        // adjust stats accounting for free
-        --gstats.nactive;
-        gstats.active_size -= meta_d->payload_size;
-
-        // Block is marked as freed by setting metadata payload_addr to 0
-        meta_d->payload_addr = 0;
-        
-        // set next allocated block to point to previous block
-        m61_mdata *prev_meta_d = (m61_mdata *)meta_d->prev_addr;
-        m61_mdata *next_meta_d = (m61_mdata *)meta_d->next_addr;
-        if (prev_meta_d != NULL) {
-            prev_meta_d->next_addr = meta_d->next_addr;
-        } else {
-            first_alloc = meta_d->next_addr;
-        }
-        
-        if (next_meta_d != NULL) {
-            next_meta_d->prev_addr = meta_d->prev_addr;
+        size_t payload_size = blk.rec->payload_size;
+        if (blk.slab != NULL) {
+            if (slabfree(&blk) == -1) {
+                // freed by another thread since validation
+                validateisallocated(ptr, file, line, &blk);
+            }
         } else {
-            curr_alloc = meta_d->prev_addr;
+            // remove from the live tables, so a double free is caught
+            if (untrackalloc(blk.meta_d) == -1) {
+                validateisallocated(ptr, file, line, &blk);
+            }
+            // Block is marked as freed by setting metadata payload_addr to 0
+            blk.meta_d->payload_addr = 0;
+            heaprelease(blk.meta_d);
         }
-        
-        free(ptr - sizeof(m61_mdata));
+
+        // adjust stats accounting for free
+        m61_tcache* tc = gettcache();
+        TCACHE_ADD(tc->nactive, -1);
+        TCACHE_ADD(tc->active_size, -(long long)payload_size);
     }
 }
 
@@ -133,53 +639,341 @@ void m61_free(void *ptr, const char *file, int line) {
     the filename and line in the code where free is called. */
 static void validateinheap(void* ptr, const char* file, int line) {
     // check for trying to free ptr outside heap
-    if ((uintptr_t)ptr < (uintptr_t)(gstats.heap_min - sizeof(m61_mdata)) 
-        || (uintptr_t)ptr > (uintptr_t)gstats.heap_max) {
+    char* min = __atomic_load_n(&heap_min, __ATOMIC_RELAXED);
+    char* max = __atomic_load_n(&heap_max, __ATOMIC_RELAXED);
+    if ((uintptr_t)ptr < (uintptr_t)(min - sizeof(m61_mdata)) 
+        || (uintptr_t)ptr > (uintptr_t)max) {
         printf("MEMORY BUG: %s:%d: invalid free of pointer %p, not in heap\n",
             file, line, ptr);
         abort();
     }
 }
 
-/** @brief validates whether @ptr is allocated. @file and @line refer to
-    the filename and line in the code where free is called. */
-static void validateisallocated(void* ptr, const char* file, int line) {
-    int valid = 0;
-    m61_mdata *itr_m_data = (m61_mdata *)first_alloc;
-    while (itr_m_data != NULL) {
-        if ((uintptr_t)itr_m_data == (uintptr_t)(ptr - sizeof(m61_mdata))) {
-            // found pointer in list, so valid
-            valid = 1;
+/** @brief validates whether @ptr is allocated, and fills @blk with a 
+    reference to its block. @file and @line refer to the filename and line
+    in the code where free is called. */
+static void validateisallocated(void* ptr, const char* file, int line,
+    m61_bref* blk) {
+    if (findallocated((uintptr_t)ptr, blk) == 0) {
+        // found pointer in slab or live table, so valid
+        return;
+    }
+
+    printf("MEMORY BUG: %s:%d: invalid free of pointer %p, not allocated\n",
+        file, line, ptr);
+    m61_bref inside;
+    if (findcontainingblock((uintptr_t)ptr, &inside) == 0) {
+        // requested ptr is inside an allocated block
+        int byt_inside = (uintptr_t)ptr - inside.payload_addr;
+        printf("  %s:%d: %p is %d bytes inside a %d byte region allocated here\n",
+            inside.rec->filename, inside.rec->line_num, ptr, 
+            byt_inside, inside.rec->payload_size);
+    }
+    abort();
+}
+
+/** @brief returns the slab holding @addr, or NULL if @addr is not in a 
+    slab. Reads the slab radix map without locking. */
+static m61_slab* slabof(uintptr_t addr) {
+    uintptr_t slab_num = addr / SLAB_SZ;
+    if (slab_num >> (SLABMAP_L1_BITS + SLABMAP_L2_BITS + SLABMAP_L3_BITS)) {
+        return NULL;
+    }
+    void** l2 = __atomic_load_n(
+        &slabmap[slab_num >> (SLABMAP_L2_BITS + SLABMAP_L3_BITS)], 
+        __ATOMIC_ACQUIRE);
+    if (l2 == NULL) {
+        return NULL;
+    }
+    m61_slab** l3 = __atomic_load_n(
+        &l2[(slab_num >> SLABMAP_L3_BITS) & ((1 << SLABMAP_L2_BITS) - 1)],
+        __ATOMIC_ACQUIRE);
+    if (l3 == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&l3[slab_num & ((1 << SLABMAP_L3_BITS) - 1)],
+        __ATOMIC_ACQUIRE);
+}
+
+/** @brief returns the lock stripe of the live index covering @addr. */
+static m61_stripe* stripeof(uintptr_t addr) {
+    uint64_t page_num = addr / PAGE_SZ;
+    return &stripes[(page_num * 0x9e3779b97f4a7c15ULL) >> (64 - NSTRIPES_BITS)];
+}
+
+/** @brief fills @blk with a reference to @slot of @slab. */
+static void slabref(m61_slab* slab, unsigned int slot, m61_bref* blk) {
+    blk->rec = &slab->recs[slot];
+    blk->payload_addr = (uintptr_t)slab->objects + slot * slab->slot_sz;
+    blk->meta_d = NULL;
+    blk->slab = slab;
+}
+
+/** @brief fills @blk with a reference to heap block @meta_d. */
+static void heapref(m61_mdata* meta_d, m61_bref* blk) {
+    blk->rec = &meta_d->rec;
+    blk->payload_addr = meta_d->payload_addr;
+    blk->meta_d = meta_d;
+    blk->slab = NULL;
+}
+
+/** @brief fills @blk with a reference to the block whose payload starts at
+    @addr. Returns 0 on success, -1 if no allocated block starts at @addr. */
+static int findallocated(uintptr_t addr, m61_bref* blk) {
+    int ret = -1;
+    m61_slab *slab = slabof(addr);
+    if (slab != NULL) {
+        // allocated iff @addr is the start of an in use slot
+        int class_idx = slablockclass(slab);
+        if (addr >= (uintptr_t)slab->objects) {
+            uintptr_t offset = addr - (uintptr_t)slab->objects;
+            unsigned int slot = offset / slab->slot_sz;
+            if (offset % slab->slot_sz == 0 && slot < slab->nslots
+                && slabslotinuse(slab, slot)) {
+                slabref(slab, slot, blk);
+                ret = 0;
+            }
+        }
+        pthread_mutex_unlock(&slab_class_lock[class_idx]);
+        return ret;
+    }
+
+    m61_stripe *stripe = stripeof(addr);
+    pthread_mutex_lock(&stripe->lock);
+    m61_mdata *meta_d = tablelookup(&stripe->live_table, addr);
+    if (meta_d != NULL) {
+        heapref(meta_d, blk);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return ret;
+}
+
+/** @brief finds the allocated block whose payload contains @addr, and fills
+    @blk with a reference to it. Slab blocks are found from the slab layout.
+    Heap blocks are found by searching the page-to-block index backwards 
+    from the page holding @addr, only as far as a block of the largest size
+    seen could start. Returns 0 on success, -1 if @addr is not inside any 
+    allocated block. */
+static int findcontainingblock(uintptr_t addr, m61_bref* blk) {
+    int ret = -1;
+    m61_slab *slab = slabof(addr);
+    if (slab != NULL) {
+        int class_idx = slablockclass(slab);
+        if (addr >= (uintptr_t)slab->objects) {
+            unsigned int slot = (addr - (uintptr_t)slab->objects) 
+                / slab->slot_sz;
+            if (slot < slab->nslots && slabslotinuse(slab, slot)) {
+                slabref(slab, slot, blk);
+                ret = addr < blk->payload_addr + blk->rec->payload_size
+                    ? 0 : -1;
+            }
+        }
+        pthread_mutex_unlock(&slab_class_lock[class_idx]);
+        return ret;
+    }
+
+    uintptr_t lowest = 0;
+    size_t max_sz = __atomic_load_n(&max_payload_sz, __ATOMIC_RELAXED);
+    if (addr > max_sz) {
+        lowest = addr - max_sz;
+    }
+    uintptr_t page = addr - (addr % PAGE_SZ);
+    while (ret == -1) {
+        m61_stripe *stripe = stripeof(page);
+        pthread_mutex_lock(&stripe->lock);
+        m61_mdata *itr_m_data = tablelookup(&stripe->page_table, page);
+        while (itr_m_data != NULL) {
+            if (addr >= itr_m_data->payload_addr && addr 
+                < itr_m_data->payload_addr + itr_m_data->rec.payload_size) {
+                heapref(itr_m_data, blk);
+                ret = 0;
+                break;
+            }
+            itr_m_data = itr_m_data->page_next;
+        }
+        pthread_mutex_unlock(&stripe->lock);
+        if (page < PAGE_SZ || page - PAGE_SZ < lowest - (lowest % PAGE_SZ)) {
             break;
-        } else if (((uintptr_t)ptr > (uintptr_t)itr_m_data) &&
-            (uintptr_t)ptr < (uintptr_t)(itr_m_data->payload_addr 
-                + itr_m_data->payload_size)) {
-            // requested ptr is inside an allocated block
-            printf("MEMORY BUG: %s:%d: invalid free of pointer %p, not allocated\n",
-                file, line, ptr);
-            int byt_inside = (uintptr_t)ptr - (uintptr_t)(itr_m_data->payload_addr);
-            printf("  %s:%d: %p is %d bytes inside a %d byte region allocated here\n",
-                itr_m_data->filename, itr_m_data->line_num, ptr, 
-                byt_inside, itr_m_data->payload_size);
-            abort();
-        }        
-        itr_m_data = (m61_mdata *)itr_m_data->next_addr;
+        }
+        page -= PAGE_SZ;
     }
-    
-    if (!valid) {
-        printf("MEMORY BUG: %s:%d: invalid free of pointer %p, not allocated\n",
-                file, line, ptr);
-        abort();
+    return ret;
+}
+
+/** @brief adds block @meta_d to the live table and to the chain of its
+    payload's page. Returns 0 on success, -1 if the tables could not grow. */
+static int trackalloc(m61_mdata* meta_d) {
+    uintptr_t page = meta_d->payload_addr - (meta_d->payload_addr % PAGE_SZ);
+    m61_stripe *stripe = stripeof(page);
+    pthread_mutex_lock(&stripe->lock);
+    m61_mdata *head = tablelookup(&stripe->page_table, page);
+    if (tableinsert(&stripe->page_table, page, meta_d) == -1) {
+        pthread_mutex_unlock(&stripe->lock);
+        return -1;
+    }
+    if (tableinsert(&stripe->live_table, meta_d->payload_addr, meta_d) == -1) {
+        // undo page chain insert
+        if (head != NULL) {
+            tableinsert(&stripe->page_table, page, head);
+        } else {
+            tableremove(&stripe->page_table, page);
+        }
+        pthread_mutex_unlock(&stripe->lock);
+        return -1;
+    }
+    meta_d->page_prev = NULL;
+    meta_d->page_next = head;
+    if (head != NULL) {
+        head->page_prev = meta_d;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    updatemaxpayload(meta_d->rec.payload_size);
+    return 0;
+}
+
+/** @brief widens the largest payload size seen to include @sz. */
+static void updatemaxpayload(size_t sz) {
+    size_t max_sz = __atomic_load_n(&max_payload_sz, __ATOMIC_RELAXED);
+    while (sz > max_sz && !__atomic_compare_exchange_n(&max_payload_sz, 
+        &max_sz, sz, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
     }
 }
 
+/** @brief removes block @meta_d from the live table and its page chain.
+    Returns 0 on success, -1 if the block was already removed. */
+static int untrackalloc(m61_mdata* meta_d) {
+    uintptr_t page = meta_d->payload_addr - (meta_d->payload_addr % PAGE_SZ);
+    m61_stripe *stripe = stripeof(page);
+    pthread_mutex_lock(&stripe->lock);
+    if (tableremove(&stripe->live_table, meta_d->payload_addr) == NULL) {
+        pthread_mutex_unlock(&stripe->lock);
+        return -1;
+    }
+    if (meta_d->page_next != NULL) {
+        meta_d->page_next->page_prev = meta_d->page_prev;
+    }
+    if (meta_d->page_prev != NULL) {
+        meta_d->page_prev->page_next = meta_d->page_next;
+    } else if (meta_d->page_next != NULL) {
+        // block was head of its page chain
+        tableinsert(&stripe->page_table, page, meta_d->page_next);
+    } else {
+        tableremove(&stripe->page_table, page);
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return 0;
+}
+
+/** @brief returns the slot index of a hash for address @key, in a table
+    of @cap slots. */
+static size_t tablehash(uintptr_t key, size_t cap) {
+    uint64_t h = (uint64_t)key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h & (cap - 1);
+}
+
+/** @brief returns the value stored for @key in @tbl, or NULL if none. */
+static void* tablelookup(m61_table* tbl, uintptr_t key) {
+    if (tbl->cap == 0) {
+        return NULL;
+    }
+    size_t i = tablehash(key, tbl->cap);
+    while (tbl->slots[i].key != 0) {
+        if (tbl->slots[i].key == key) {
+            return tbl->slots[i].val;
+        }
+        i = (i + 1) & (tbl->cap - 1);
+    }
+    return NULL;
+}
+
+/** @brief resizes @tbl to @new_cap slots, dropping any tombstones.
+    Returns 0 on success, -1 if out of memory. */
+static int tableresize(m61_table* tbl, size_t new_cap) {
+    m61_tslot *new_slots = calloc(new_cap, sizeof(m61_tslot));
+    if (new_slots == NULL) {
+        return -1;
+    }
+    for (size_t j = 0; j < tbl->cap; j++) {
+        if (tbl->slots[j].key > TABLE_TOMBSTONE) {
+            size_t i = tablehash(tbl->slots[j].key, new_cap);
+            while (new_slots[i].key != 0) {
+                i = (i + 1) & (new_cap - 1);
+            }
+            new_slots[i] = tbl->slots[j];
+        }
+    }
+    free(tbl->slots);
+    tbl->slots = new_slots;
+    tbl->cap = new_cap;
+    tbl->nused = tbl->nlive;
+    return 0;
+}
+
+/** @brief stores @val for @key in @tbl, replacing any existing value.
+    Returns 0 on success, -1 if the table could not grow. */
+static int tableinsert(m61_table* tbl, uintptr_t key, void* val) {
+    // keep load (including tombstones) under 3/4
+    if ((tbl->nused + 1) * 4 > tbl->cap * 3) {
+        size_t new_cap = tbl->cap ? tbl->cap : TABLE_INIT_SZ;
+        while ((tbl->nlive + 1) * 2 > new_cap) {
+            new_cap *= 2;
+        }
+        if (tableresize(tbl, new_cap) == -1) {
+            return -1;
+        }
+    }
+    size_t i = tablehash(key, tbl->cap);
+    size_t reuse = tbl->cap;    // first tombstone seen, if any
+    while (tbl->slots[i].key != 0) {
+        if (tbl->slots[i].key == key) {
+            tbl->slots[i].val = val;
+            return 0;
+        } else if (tbl->slots[i].key == TABLE_TOMBSTONE && reuse == tbl->cap) {
+            reuse = i;
+        }
+        i = (i + 1) & (tbl->cap - 1);
+    }
+    if (reuse != tbl->cap) {
+        i = reuse;
+    } else {
+        ++tbl->nused;
+    }
+    tbl->slots[i].key = key;
+    tbl->slots[i].val = val;
+    ++tbl->nlive;
+    return 0;
+}
+
+/** @brief removes @key from @tbl, returning its value or NULL if none. */
+static void* tableremove(m61_table* tbl, uintptr_t key) {
+    if (tbl->cap == 0) {
+        return NULL;
+    }
+    size_t i = tablehash(key, tbl->cap);
+    while (tbl->slots[i].key != 0) {
+        if (tbl->slots[i].key == key) {
+            void* val = tbl->slots[i].val;
+            tbl->slots[i].key = TABLE_TOMBSTONE;
+            tbl->slots[i].val = NULL;
+            --tbl->nlive;
+            return val;
+        }
+        i = (i + 1) & (tbl->cap - 1);
+    }
+    return NULL;
+}
+
 /** @brief checks for wild writes after payload by validating boundary check
-    element has not been altered. @ptr is addr of freed block. @file and @line 
+    element has not been altered. @blk is the freed block. @file and @line
     refer to the filename and line in the code where free is called. */
-static void validateboundarycheck(void* ptr, const char* file, int line) {
-    m61_mdata *meta_d = (m61_mdata *)(ptr - sizeof(m61_mdata));
+static void validateboundarycheck(m61_bref* blk, const char* file, int line) {
+    void* ptr = (void *)blk->payload_addr;
     uintptr_t bcheck_addr;
-    memcpy(&bcheck_addr, ptr + meta_d->payload_size, sizeof(uintptr_t));
+    memcpy(&bcheck_addr, ptr + blk->rec->payload_size, sizeof(uintptr_t));
 
     if ((uintptr_t)ptr != bcheck_addr) {
         // ptr does not match boundary write validation check
@@ -189,49 +983,75 @@ static void validateboundarycheck(void* ptr, const char* file, int line) {
     }
 }
 
-/** @brief allocates, frees, or resizes memory depending on its arguments.
-    If @sz is specified, the space is malloc of that size.
-    If @ptr is specified, that space is freed. 
-    If both are specified, then, data in @ptr is resized into new ptr.
-    @file and @line refer to the filename and line in the code where realloc
-    is called.*/
-void* m61_realloc(void* ptr, size_t sz, const char* file, int line) {
+/** @brief resizes block @ptr for m61_realloc, in place if possible. */
+static void* blockrealloc(void* ptr, size_t sz, const char* file, int line) {
     void* new_ptr = NULL;
+    m61_bref blk;
+    if (ptr && sz && findallocated((uintptr_t)ptr, &blk) == 0) {
+        // try resizing in place, or moving without a copy
+        validateboundarycheck(&blk, file, line);
+        size_t old_sz = blk.rec->payload_size;
+        if (blk.slab != NULL) {
+            new_ptr = slabresize(&blk, sz) == 0 ? ptr : NULL;
+        } else {
+            new_ptr = heapresize(&blk, sz);
+        }
+        if (new_ptr != NULL) {
+            blk.rec->line_num = line;
+            blk.rec->filename = file;
+            uintptr_t bcheck = (uintptr_t)new_ptr;
+            memcpy((char *)new_ptr + sz, &bcheck, sizeof(uintptr_t));
+            updateheapbounds((char *)new_ptr, (char *)new_ptr + sz);
+
+            // charge only the growth, not a whole new allocation
+            m61_tcache* tc = gettcache();
+            TCACHE_ADD(tc->active_size, (long long)sz - (long long)old_sz);
+            if (sz > old_sz) {
+                TCACHE_ADD(tc->total_size, sz - old_sz);
+                trackheavyhitters(&tc->heavy_alloc, sitehash(file, line), 
+                    sz - old_sz, file, line);
+            }
+            return new_ptr;
+        }
+    }
+
     if (sz) {
-        new_ptr = m61_malloc(sz, file, line);
+        new_ptr = blockalloc(sz, file, line);
     }
-    if (ptr && new_ptr) {
+    // invalid ptrs are not copied from, and reported by blockfree below
+    if (ptr && new_ptr && findallocated((uintptr_t)ptr, &blk) == 0) {
         // Copy the data from `ptr` into `new_ptr`.
-        m61_mdata *meta_d = (m61_mdata *)(ptr - sizeof(m61_mdata));
-        if (meta_d->payload_size < sz) {
-            memcpy(new_ptr, ptr, meta_d->payload_size);
+        if (blk.rec->payload_size < sz) {
+            memcpy(new_ptr, ptr, blk.rec->payload_size);
         } else {
             memcpy(new_ptr, ptr, sz);
         }
     }
-    m61_free(ptr, file, line);
+    blockfree(ptr, file, line);
     return new_ptr;
 }
 
-/** @brief allocates memory of size @nmemb * @sz and clears it to zero. 
-    @file and @line refer to the filename and line in the code where calloc
-    is called.*/
-void* m61_calloc(size_t nmemb, size_t sz, const char* file, int line) {   
-    void* ptr = NULL;
-    if ((SIZE_MAX / nmemb) > sz) {
-        ptr = m61_malloc(nmemb * sz, file, line);
-        if (ptr) {
-            memset(ptr, 0, nmemb * sz);
-        }
-    } else {
-        ++gstats.nfail;
-    }
-    return ptr;
-}
-
-/** @brief populates @stats with the statistics about allocations. */
+/** @brief populates @stats with the statistics about allocations, merged
+    from the caches of all threads. */
 void m61_getstatistics(struct m61_statistics* stats) {
-    *stats = gstats;
+    long long nactive = 0, active_size = 0;
+    memset(stats, 0, sizeof(struct m61_statistics));
+    pthread_mutex_lock(&tcache_lock);
+    for (m61_tcache* tc = tcache_list; tc != NULL; tc = tc->next) {
+        nactive += __atomic_load_n(&tc->nactive, __ATOMIC_RELAXED);
+        active_size += __atomic_load_n(&tc->active_size, __ATOMIC_RELAXED);
+        stats->ntotal += __atomic_load_n(&tc->ntotal, __ATOMIC_RELAXED);
+        stats->total_size += __atomic_load_n(&tc->total_size, 
+            __ATOMIC_RELAXED);
+        stats->nfail += __atomic_load_n(&tc->nfail, __ATOMIC_RELAXED);
+        stats->fail_size += __atomic_load_n(&tc->fail_size, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&tcache_lock);
+    // a thread's counts go negative when it frees others' blocks
+    stats->nactive = nactive;
+    stats->active_size = active_size;
+    stats->heap_min = __atomic_load_n(&heap_min, __ATOMIC_RELAXED);
+    stats->heap_max = __atomic_load_n(&heap_max, __ATOMIC_RELAXED);
 }
 
 /** @brief prints statistics about allocations. */
@@ -245,107 +1065,604 @@ void m61_printstatistics(void) {
            stats.active_size, stats.total_size, stats.fail_size);
 }
 
+/** @brief compares two block refs by payload address, for qsort. */
+static int comparepayloadaddr(const void* a, const void* b) {
+    uintptr_t addr_a = ((const m61_bref *)a)->payload_addr;
+    uintptr_t addr_b = ((const m61_bref *)b)->payload_addr;
+    return (addr_a > addr_b) - (addr_a < addr_b);
+}
+
+/** @brief locks all slabs and stripes, so no block is allocated or freed
+    until thawblocks. */
+static void freezeblocks(void) {
+    for (int i = 0; i < SLAB_NCLASSES; i++) {
+        pthread_mutex_lock(&slab_class_lock[i]);
+    }
+    pthread_mutex_lock(&slab_lock);
+    for (int i = 0; i < NSTRIPES; i++) {
+        pthread_mutex_lock(&stripes[i].lock);
+    }
+}
+
+/** @brief unlocks what freezeblocks locked. */
+static void thawblocks(void) {
+    for (int i = NSTRIPES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&stripes[i].lock);
+    }
+    pthread_mutex_unlock(&slab_lock);
+    for (int i = SLAB_NCLASSES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&slab_class_lock[i]);
+    }
+}
+
 /** @brief prints details about any allocations that have not been freed. */
 void m61_printleakreport(void) {
-    // iterating through the allocated ptr list
-    m61_mdata *itr_m_data = (m61_mdata *)first_alloc;
-    while (itr_m_data != NULL) {
+    // freeze all slabs and stripes, then collect live blocks
+    freezeblocks();
+
+    size_t nleaks = 0, max_leaks = 0;
+    for (int i = 0; i < NSTRIPES; i++) {
+        max_leaks += stripes[i].live_table.nlive;
+    }
+    for (m61_slab* slab = slab_all; slab != NULL; slab = slab->all_next) {
+        max_leaks += slab->nslots - slab->nfree;
+    }
+    m61_bref *leaks = malloc((max_leaks + 1) * sizeof(m61_bref));
+    for (int i = 0; leaks != NULL && i < NSTRIPES; i++) {
+        m61_table *live_table = &stripes[i].live_table;
+        for (size_t j = 0; j < live_table->cap; j++) {
+            if (live_table->slots[j].key > TABLE_TOMBSTONE) {
+                heapref(live_table->slots[j].val, &leaks[nleaks++]);
+            }
+        }
+    }
+    for (m61_slab* slab = slab_all; leaks != NULL && slab != NULL; 
+        slab = slab->all_next) {
+        for (unsigned int slot = 0; slot < slab->nbumped; slot++) {
+            if (slabslotinuse(slab, slot)) {
+                slabref(slab, slot, &leaks[nleaks++]);
+            }
+        }
+    }
+
+    thawblocks();
+    if (leaks == NULL) {
+        return;
+    }
+
+    // report in address order
+    qsort(leaks, nleaks, sizeof(m61_bref), comparepayloadaddr);
+    for (size_t i = 0; i < nleaks; i++) {
         printf("LEAK CHECK: %s:%d: allocated object %p with size %d\n",
-            itr_m_data->filename, itr_m_data->line_num, 
-            (void *)itr_m_data->payload_addr, itr_m_data->payload_size);
-        itr_m_data = (m61_mdata *)itr_m_data->next_addr;
+            leaks[i].rec->filename, leaks[i].rec->line_num, 
+            (void *)leaks[i].payload_addr, leaks[i].rec->payload_size);
+    }
+    free(leaks);
+}
+
+/** @brief returns the # bytes m61 uses for live blocks beyond their 
+    payloads: for heap blocks the header, boundary check and the rest of
+    the libc chunk or mapping; for slab blocks the rest of the slot, which
+    holds the boundary check, and the header and side table of each slab
+    holding a live block. Free slab slots are not counted. */
+unsigned long long m61_getoverhead(void) {
+    unsigned long long overhead = 0;
+    freezeblocks();
+    for (int i = 0; i < NSTRIPES; i++) {
+        m61_table *live_table = &stripes[i].live_table;
+        for (size_t j = 0; j < live_table->cap; j++) {
+            if (live_table->slots[j].key > TABLE_TOMBSTONE) {
+                m61_mdata* meta_d = live_table->slots[j].val;
+                size_t have_sz = meta_d->map_sz;
+                if (have_sz == 0) {
+                    have_sz = malloc_usable_size(meta_d);
+                }
+                overhead += have_sz - meta_d->rec.payload_size;
+            }
+        }
     }
+    for (m61_slab* slab = slab_all; slab != NULL; slab = slab->all_next) {
+        if (slab->nfree == slab->nslots) {
+            continue;
+        }
+        overhead += slab->objects - (char *)slab;
+        for (unsigned int slot = 0; slot < slab->nbumped; slot++) {
+            if (slabslotinuse(slab, slot)) {
+                overhead += slab->slot_sz - slab->recs[slot].payload_size;
+            }
+        }
+    }
+    thawblocks();
+    return overhead;
+}
+
+/** @brief merges the heavy hitter summaries of all threads' caches into a
+    new array returned in @sites, sorted by descending weight. @by_count
+    selects the summary, 0 for bytes and 1 for allocation counts. Counts
+    for the same site are summed. Returns # sites, @sites is NULL if none. */
+static size_t mergeheavyhitters(struct m61_site** sites, int by_count) {
+    pthread_mutex_lock(&tcache_lock);
+    size_t ncaches = 0;
+    for (m61_tcache* tc = tcache_list; tc != NULL; tc = tc->next) {
+        ++ncaches;
+    }
+    struct m61_site *all = malloc((ncaches * M61_HHITTER_K + 1) 
+        * sizeof(struct m61_site));
+    size_t nall = 0;
+    for (m61_tcache* tc = tcache_list; all != NULL && tc != NULL; 
+        tc = tc->next) {
+        m61_hhsummary *hhs = by_count ? &tc->heavy_freq : &tc->heavy_alloc;
+        for (int i = 0; i < hhs->ncounters; i++) {
+            m61_hhitter *c = &hhs->counters[i];
+            // a file's name may have different ptrs in different objects
+            size_t j = 0;
+            while (j < nall && (all[j].line_num != c->line_num 
+                || strcmp(all[j].filename, c->filename) != 0)) {
+                ++j;
+            }
+            if (j == nall) {
+                all[nall].filename = c->filename;
+                all[nall].line_num = c->line_num;
+                all[nall].weight = 0;
+                all[nall].error = 0;
+                ++nall;
+            }
+            all[j].weight += c->weight;
+            all[j].error += c->error;
+        }
+    }
+    pthread_mutex_unlock(&tcache_lock);
+    if (all != NULL) {
+        qsort(all, nall, sizeof(struct m61_site), comparesiteweight);
+    }
+    *sites = all;
+    return nall;
+}
+
+/** @brief compares two sites by descending weight, for qsort. */
+static int comparesiteweight(const void* a, const void* b) {
+    unsigned long long weight_a = ((const struct m61_site *)a)->weight;
+    unsigned long long weight_b = ((const struct m61_site *)b)->weight;
+    return (weight_a < weight_b) - (weight_a > weight_b);
+}
+
+/** @brief fills @sites with up to @k of the heaviest allocation sites so
+    far, sorted by descending weight. Sites are weighed by # allocations if
+    @by_count, else by # bytes allocated. Each thread tracks its heaviest 
+    M61_HHITTER_K sites, so other sites are missed and weights may be
+    overestimated by up to each site's error. Returns # sites filled. */
+size_t m61_getheavyhitters(struct m61_site* sites, size_t k, int by_count) {
+    struct m61_site *all;
+    size_t nall = mergeheavyhitters(&all, by_count);
+    if (all == NULL) {
+        return 0;
+    }
+    if (nall > k) {
+        nall = k;
+    }
+    memcpy(sites, all, nall * sizeof(struct m61_site));
+    free(all);
+    return nall;
 }
 
 /** @brief prints details about which allocations that are the heaviest, and 
     which are the most frequent. */
 void m61_printheavyhitters(void) {
-    // sort tracking arrays in decesending order
-    sortheavyhitters(heavy_alloc);
-    sortheavyhitters(heavy_freq);
+    // merged thread summaries, sorted in decesending order
+    struct m61_site heavy_alloc[M61_HHITTER_K];
+    struct m61_site heavy_freq[M61_HHITTER_K];
+    size_t nalloc = m61_getheavyhitters(heavy_alloc, M61_HHITTER_K, 0);
+    size_t nfreq = m61_getheavyhitters(heavy_freq, M61_HHITTER_K, 1);
+    struct m61_statistics gstats;
+    m61_getstatistics(&gstats);
 
-    float largest_pcent = ((float)heavy_alloc[0].total_pload_size
+    float largest_pcent = nalloc == 0 ? 0 : ((float)heavy_alloc[0].weight
                 / gstats.total_size) * 100;
     if (largest_pcent > 20) {
         printf("\nMOST ALLOCATED BYTES:\n");
-        for (int i = 0; i < HHITTER_ARR_SZ; i++) {
-            float tot_percent = ((float)heavy_alloc[i].total_pload_size
+        for (size_t i = 0; i < nalloc; i++) {
+            float tot_percent = ((float)heavy_alloc[i].weight
                 / gstats.total_size) * 100;
             // only printing if an element is higher than 20%
             if (tot_percent > 10) {
             printf("HEAVY HITTER: %s:%d %llu bytes (~%.1f%%)\n",
                 heavy_alloc[i].filename, heavy_alloc[i].line_num, 
-                heavy_alloc[i].total_pload_size, tot_percent);
+                heavy_alloc[i].weight, tot_percent);
             }
         }
     }
-    largest_pcent = ((float)heavy_freq[0].total_pload_size
+    largest_pcent = nfreq == 0 ? 0 : ((float)heavy_freq[0].weight
         / gstats.ntotal) * 100;
     if (largest_pcent > 20) {
         printf("\nMOST FREQUNTLY ALLOCATED:\n");
-        for (int i = 0; i < HHITTER_ARR_SZ; i++) {
-            float tot_percent = ((float)heavy_freq[i].total_pload_size
+        for (size_t i = 0; i < nfreq; i++) {
+            float tot_percent = ((float)heavy_freq[i].weight
                 / gstats.ntotal) * 100;
             // only printing if an element is higher than 20%
             if (tot_percent > 10) {
             printf("HEAVY FREQ: %s:%d allocated %llu times (~%.1f%%)\n", 
                 heavy_freq[i].filename, heavy_freq[i].line_num, 
-                heavy_freq[i].total_pload_size, tot_percent);
+                heavy_freq[i].weight, tot_percent);
             }
         } 
     }
 }
 
-/** @brief sorts @hhitters array in descending order. */
-static void sortheavyhitters(m61_hhitter* hhitters) {
-    // sort output in descending order
-    m61_hhitter temp;
-    for (int i = 0; i < HHITTER_ARR_SZ; i++) {
-        for (int j = i; j < HHITTER_ARR_SZ; j++) {
-            if (hhitters[i].total_pload_size < hhitters[j].total_pload_size) {
-                temp = hhitters[i];
-                hhitters[i] = hhitters[j];
-                hhitters[j] = temp;
-            }
+/** @brief returns the hash of allocation site @file:@line. The filename
+    ptr is hashed, not the string, since a file's __FILE__ ptr is fixed. */
+static uint32_t sitehash(const char* file, int line) {
+    uint64_t h = (uintptr_t)file ^ ((uint64_t)line << 40);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+/** @brief adds @sz to the weight of site @file:@line in summary @hhs, with
+    the Space-Saving algorithm. A site that isn't tracked replaces the
+    lightest tracked site, taking over its weight as its error. @hash is 
+    sitehash(@file, @line). Cost is O(log k), not O(k), in the worst case. */
+static void trackheavyhitters(m61_hhsummary* hhs, uint32_t hash, 
+    size_t sz, const char* file, int line) {
+    // look up the site in the index, comparing ptrs, not strings
+    size_t mask = M61_HHITTER_NIDX - 1;
+    for (size_t i = hash & mask; hhs->index[i] != 0; i = (i + 1) & mask) {
+        int idx = hhs->index[i] - 1;
+        m61_hhitter *c = &hhs->counters[idx];
+        if (c->hash == hash && c->line_num == line && c->filename == file) {
+            c->weight += sz;
+            hhsiftdown(hhs, hhs->heap_pos[idx]);
+            return;
         }
     }
+
+    int idx;
+    if (hhs->ncounters < M61_HHITTER_K) {
+        // free counter, so the site's weight is exact
+        idx = hhs->ncounters++;
+        hhs->heap[idx] = idx;
+        hhs->heap_pos[idx] = idx;
+        hhs->counters[idx].weight = 0;
+        hhs->counters[idx].error = 0;
+    } else {
+        // evict the lightest site
+        idx = hhs->heap[0];
+        hhindexremove(hhs, idx);
+        hhs->counters[idx].error = hhs->counters[idx].weight;
+    }
+    m61_hhitter *c = &hhs->counters[idx];
+    c->filename = file;
+    c->line_num = line;
+    c->hash = hash;
+    c->weight += sz;
+    hhindexinsert(hhs, idx);
+    hhsiftup(hhs, hhs->heap_pos[idx]);
+    hhsiftdown(hhs, hhs->heap_pos[idx]);
+}
+
+/** @brief moves the counter at heap position @pos of @hhs down until no
+    child is lighter. */
+static void hhsiftdown(m61_hhsummary* hhs, int pos) {
+    while (1) {
+        int min = pos;
+        int left = 2 * pos + 1, right = 2 * pos + 2;
+        if (left < hhs->ncounters && hhs->counters[hhs->heap[left]].weight
+            < hhs->counters[hhs->heap[min]].weight) {
+            min = left;
+        }
+        if (right < hhs->ncounters && hhs->counters[hhs->heap[right]].weight
+            < hhs->counters[hhs->heap[min]].weight) {
+            min = right;
+        }
+        if (min == pos) {
+            return;
+        }
+        hhswap(hhs, pos, min);
+        pos = min;
+    }
+}
+
+/** @brief moves the counter at heap position @pos of @hhs up until its
+    parent is no heavier. */
+static void hhsiftup(m61_hhsummary* hhs, int pos) {
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (hhs->counters[hhs->heap[parent]].weight 
+            <= hhs->counters[hhs->heap[pos]].weight) {
+            return;
+        }
+        hhswap(hhs, pos, parent);
+        pos = parent;
+    }
+}
+
+/** @brief swaps heap positions @a and @b of @hhs. */
+static void hhswap(m61_hhsummary* hhs, int a, int b) {
+    unsigned short temp = hhs->heap[a];
+    hhs->heap[a] = hhs->heap[b];
+    hhs->heap[b] = temp;
+    hhs->heap_pos[hhs->heap[a]] = a;
+    hhs->heap_pos[hhs->heap[b]] = b;
+}
+
+/** @brief adds counter @idx of @hhs to the index, by its hash. */
+static void hhindexinsert(m61_hhsummary* hhs, int idx) {
+    size_t mask = M61_HHITTER_NIDX - 1;
+    size_t i = hhs->counters[idx].hash & mask;
+    while (hhs->index[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    hhs->index[i] = idx + 1;
 }
 
-/** @brief adds to heavy hitter tracking array based on the "FREQUENT"
-    algorithm. @hhitters is array being tracked. @neg_bias is overall
-    negative bias for the algo.    @sz, @file and @line refer to the size of the
-    malloc, the filenameand line in the code where the malloc is called.*/
-static void trackheavyhitters(m61_hhitter* hhitters, int* neg_bias, size_t sz,
+/** @brief removes counter @idx of @hhs from the index. Later entries of 
+    the probe run are shifted back into the hole, so no tombstones. */
+static void hhindexremove(m61_hhsummary* hhs, int idx) {
+    size_t mask = M61_HHITTER_NIDX - 1;
+    size_t hole = hhs->counters[idx].hash & mask;
+    while (hhs->index[hole] != idx + 1) {
+        hole = (hole + 1) & mask;
+    }
+    size_t i = hole;
+    while (1) {
+        i = (i + 1) & mask;
+        if (hhs->index[i] == 0) {
+            break;
+        }
+        // move entry back unless its home lies cyclically in (hole, i]
+        size_t home = hhs->counters[hhs->index[i] - 1].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            hhs->index[hole] = hhs->index[i];
+            hole = i;
+        }
+    }
+    hhs->index[hole] = 0;
+}
+
+/** @brief starts recording a trace of all m61 calls to file @path, which is
+    truncated. Records go to a ring per thread, and a flusher thread writes
+    them out. Returns 0 on success, -1 on error or if already tracing. */
+int m61_tracebegin(const char* path) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd != -1) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    m61_thdr hdr = {M61_TRACE_MAGIC, M61_TRACE_VERSION, 0, 0};
+    if (trace_fd == -1 || tracewrite(&hdr, sizeof(hdr)) == -1) {
+        goto fail;
+    }
+    // drop records left in rings from an earlier trace
+    for (m61_tring* ring = trace_ring_list; ring != NULL; ring = ring->next) {
+        ring->tail = ring->head;
+    }
+    trace_start_ns = tracenow();
+    __atomic_store_n(&trace_on, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&trace_flusher, NULL, traceflusher, NULL) != 0) {
+        __atomic_store_n(&trace_on, 0, __ATOMIC_RELEASE);
+        goto fail;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+
+fail:
+    if (trace_fd != -1) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return -1;
+}
+
+/** @brief stops recording the trace, writes out all queued records and the
+    site table, and closes the trace file. Calls still running in other
+    threads when m61_traceend is called may be left out of the trace. */
+void m61_traceend(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd == -1) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    __atomic_store_n(&trace_on, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&trace_wake);
+    pthread_mutex_unlock(&trace_lock);
+    pthread_join(trace_flusher, NULL);
+
+    pthread_mutex_lock(&trace_lock);
+    traceflush();
+    // site table goes after the records, found from the header
+    m61_thdr hdr = {M61_TRACE_MAGIC, M61_TRACE_VERSION, 
+        lseek(trace_fd, 0, SEEK_CUR), 0};
+    for (size_t i = 0; i < TRACE_NSITES; i++) {
+        m61_tsite* site = &trace_sites[i];
+        if (site->filename == NULL) {
+            continue;
+        }
+        m61_tsiterec srec = {site->id, site->line_num, 
+            strlen(site->filename)};
+        tracewrite(&srec, sizeof(srec));
+        tracewrite(site->filename, srec.namelen);
+        ++hdr.nsites;
+    }
+    if (pwrite(trace_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        printf("m61: trace header write failed\n");
+    }
+    close(trace_fd);
+    trace_fd = -1;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/** @brief records a call of op @op at site @file:@line to the calling
+    thread's ring, if tracing. @addr is the block returned, @old_addr the 
+    block passed in, @sz the size asked for. Waits for the flusher if the 
+    ring is full. */
+static void tracerecord(int op, void* addr, void* old_addr, size_t sz,
+    const char* file, int line) {
+    m61_trec* rec = tracereserve(op, old_addr, sz, file, line);
+    tracecommit(rec, addr);
+}
+
+/** @brief reserves and timestamps the calling thread's next trace record,
+    for a call of op @op like tracerecord, without its returned block.
+    Returns NULL if not tracing. The record is written out only once
+    tracecommit fills in the block, and the thread may not record any
+    other call in between. */
+static m61_trec* tracereserve(int op, void* old_addr, size_t sz,
     const char* file, int line) {
-    int empty_c = -1;
-    int added_existing = 0;
-  
-    for (int i = 0; i < HHITTER_ARR_SZ; i++) {
-        /* Using variation on FREQUENT algorithm. Instead of decrementing all
-        elements of the array the bytes are added to the "negative bias", 
-        which is then considered at the if check against zero */
-        if (hhitters[i].total_pload_size - *neg_bias <= 0) {
-            if (empty_c == -1) {
-                empty_c = i;
+    if (!__atomic_load_n(&trace_on, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    m61_tring* ring = gettracering();
+    size_t head = ring->head;
+    while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) 
+        == M61_TRACE_RING_SZ) {
+        pthread_cond_signal(&trace_wake);
+        sched_yield();
+        if (!__atomic_load_n(&trace_on, __ATOMIC_RELAXED)) {
+            return NULL;
+        }
+    }
+    m61_trec* rec = &ring->recs[head % M61_TRACE_RING_SZ];
+    rec->time_ns = tracenow() - trace_start_ns;
+    rec->seq = head;
+    rec->old_addr = (uintptr_t)old_addr;
+    rec->size = sz;
+    rec->site = tracesite(file, line);
+    rec->tid = ring->tid;
+    rec->op = op;
+    return rec;
+}
+
+/** @brief sets the block returned of reserved record @rec to @addr and
+    queues it for the flusher. Does nothing if @rec is NULL. */
+static void tracecommit(m61_trec* rec, void* addr) {
+    if (rec == NULL) {
+        return;
+    }
+    rec->addr = (uintptr_t)addr;
+    m61_tring* ring = gettracering();
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/** @brief returns the calling thread's trace ring, kept with its cache. */
+static m61_tring* gettracering(void) {
+    m61_tcache* tc = gettcache();
+    if (tc->trace_ring != NULL) {
+        return tc->trace_ring;
+    }
+    m61_tring* ring = calloc(1, sizeof(m61_tring));
+    if (ring == NULL) {
+        printf("MEMORY BUG: out of memory for m61 trace ring\n");
+        abort();
+    }
+    pthread_mutex_lock(&trace_lock);
+    ring->tid = trace_nrings++;
+    ring->next = trace_ring_list;
+    __atomic_store_n(&trace_ring_list, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+    tc->trace_ring = ring;
+    return ring;
+}
+
+/** @brief returns the trace id of site @file:@line, interning it on first
+    use. Lookups don't lock. Returns 0 if the site table is full. */
+static uint32_t tracesite(const char* file, int line) {
+    size_t mask = TRACE_NSITES - 1;
+    size_t i = sitehash(file, line) & mask;
+    for (size_t n = 0; n < TRACE_NSITES; n++, i = (i + 1) & mask) {
+        m61_tsite* site = &trace_sites[i];
+        const char* site_file = __atomic_load_n(&site->filename, 
+            __ATOMIC_ACQUIRE);
+        if (site_file == NULL) {
+            // claim the slot, unless another thread just did
+            pthread_mutex_lock(&trace_lock);
+            if (site->filename == NULL) {
+                site->line_num = line;
+                site->id = ++trace_nsites;
+                __atomic_store_n(&site->filename, file, __ATOMIC_RELEASE);
             }
+            pthread_mutex_unlock(&trace_lock);
+            site_file = site->filename;
         }
-        // if found element, then add sz to that element
-        if (hhitters[i].line_num == line 
-            && strcmp(file, hhitters[i].filename) == 0) {
-            hhitters[i].total_pload_size += sz;
-            added_existing = 1;
+        if (site_file == file && site->line_num == line) {
+            return site->id;
         }
     }
-   
-    // if found empty element, then add sz to that element
-    if (added_existing != 1) {
-        if (empty_c != -1) {
-            hhitters[empty_c].total_pload_size = sz;
-            hhitters[empty_c].line_num = line;
-            hhitters[empty_c].filename = file;
-        } else {
-            // else add sz to the overall negative bias
-            *neg_bias += sz;
+    return 0;
+}
+
+/** @brief returns the monotonic clock time in ns. */
+static uint64_t tracenow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** @brief body of the flusher thread, which writes out queued records 
+    until the trace ends, waking at least every TRACE_FLUSH_NS. trace_lock
+    is held only to sleep, so writes never stall threads interning sites. */
+static void* traceflusher(void* arg) {
+    (void) arg;
+    while (__atomic_load_n(&trace_on, __ATOMIC_ACQUIRE)) {
+        if (traceflush() == 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += TRACE_FLUSH_NS;
+            if (ts.tv_nsec >= 1000000000) {
+                ++ts.tv_sec;
+                ts.tv_nsec -= 1000000000;
+            }
+            // m61_traceend clears trace_on under the lock, then signals
+            pthread_mutex_lock(&trace_lock);
+            if (__atomic_load_n(&trace_on, __ATOMIC_ACQUIRE)) {
+                pthread_cond_timedwait(&trace_wake, &trace_lock, &ts);
+            }
+            pthread_mutex_unlock(&trace_lock);
+        }
+    }
+    return NULL;
+}
+
+/** @brief writes out every queued record of all rings. Called only by the
+    flusher, or once it has exited, so needs no lock: only the flusher
+    moves a ring's tail, and rings are only ever added to the list's head.
+    Returns # records written. */
+static size_t traceflush(void) {
+    size_t nrecs = 0;
+    for (m61_tring* ring = __atomic_load_n(&trace_ring_list, 
+            __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        size_t tail = ring->tail;
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head) {
+            // write up to the end of the ring in one go
+            size_t start = tail % M61_TRACE_RING_SZ;
+            size_t n = head - tail;
+            if (n > M61_TRACE_RING_SZ - start) {
+                n = M61_TRACE_RING_SZ - start;
+            }
+            tracewrite(&ring->recs[start], n * sizeof(m61_trec));
+            tail += n;
+            nrecs += n;
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        }
+    }
+    return nrecs;
+}
+
+/** @brief writes @sz bytes at @buf to the trace file, retrying short
+    writes. Returns 0 on success, -1 on error. */
+static int tracewrite(const void* buf, size_t sz) {
+    const char* p = buf;
+    while (sz > 0) {
+        ssize_t n = write(trace_fd, p, sz);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
         }
+        p += n;
+        sz -= n;
     }
+    return 0;
 }
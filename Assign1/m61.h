@@ -2,6 +2,16 @@
 #define M61_H 1
 #include <stdlib.h>
 #include <inttypes.h>
+#include <pthread.h>
+#ifndef M61_TRACE_RING_SZ
+#define M61_TRACE_RING_SZ 4096 // # records per thread's trace ring
+#endif
+#ifndef M61_HHITTER_K
+#define M61_HHITTER_K   32   // # sites tracked per heavy hitter summary
+#endif
+#if M61_HHITTER_K < 1 || M61_HHITTER_K > 32767
+#error "M61_HHITTER_K must be in [1, 32767]"
+#endif
 
 void* m61_malloc(size_t sz, const char* file, int line);
 void m61_free(void* ptr, const char* file, int line);
@@ -20,33 +30,256 @@ struct m61_statistics {
     char* heap_max;                     // largest allocated addr
 };
 
-// struct for metadata of allocated block
-typedef struct m61_metadata {
+// struct for allocation record of a block, common to all backends
+typedef struct m61_allocrec {
     unsigned int payload_size;          // # bytes in payload
     unsigned int line_num;              // line num
     const char* filename;               // ptr to filename
-    char* prev_addr;                    // previous allocated block
-    char* next_addr;                    // next allocated block
+} m61_arec;
+
+// struct for metadata header of block allocated from the libc heap
+typedef struct m61_metadata {
+    m61_arec rec;                       // allocation record
+    struct m61_metadata* page_prev;     // previous block starting in page
+    struct m61_metadata* page_next;     // next block starting in page
     uintptr_t payload_addr;             // ptr to payload as int
+    size_t map_sz;                      // # bytes mmap'd, 0 if libc block
 } m61_mdata;
 
-// struct for elements in hhitter tracking array
-typedef struct m61_heavyhitter {
-    long long total_pload_size;         // # bytes in payload
+// struct for header of a slab, holding objects of a single size class.
+// The side table of allocation records follows the header, then objects.
+typedef struct m61_slab {
+    struct m61_slab* prev;              // previous slab in class/free list
+    struct m61_slab* next;              // next slab in class/free list
+    char* objects;                      // address of first object slot
+    void* freelist;                     // freed object slots
+    m61_arec* recs;                     // side table, one rec per slot
+    size_t slot_sz;                     // # bytes per object slot
+    unsigned int nslots;                // # object slots in slab
+    unsigned int nbumped;               // # slots ever handed out
+    unsigned int nfree;                 // # slots not allocated
+    int class_idx;                      // size class index
+    struct m61_slab* all_next;          // next slab in list of all slabs
+    uint64_t inuse[64];                 // bitmap of allocated slots
+} m61_slab;
+
+// struct referencing a live block, whichever backend allocated it
+typedef struct m61_blockref {
+    m61_arec* rec;                      // allocation record
+    uintptr_t payload_addr;             // ptr to payload as int
+    m61_mdata* meta_d;                  // header, for heap blocks
+    m61_slab* slab;                     // slab, for slab blocks
+} m61_bref;
+
+// struct for a slot in an open-addressing hash table
+typedef struct m61_tblslot {
+    uintptr_t key;                      // address key, 0 empty, 1 tombstone
+    void* val;                          // value stored for key
+} m61_tslot;
+
+// struct for open-addressing hash table keyed by address
+typedef struct m61_table {
+    m61_tslot* slots;                   // slot array
+    size_t cap;                         // # slots, always a power of 2
+    size_t nused;                       // # live + tombstoned slots
+    size_t nlive;                       // # live slots
+} m61_table;
+
+// struct for a lock stripe of the live allocation index, covering the 
+// pages that hash to it. Cache line aligned so stripes don't false share.
+typedef struct m61_stripe {
+    pthread_mutex_t lock;               // protects both tables
+    m61_table live_table;               // payload addr -> m61_mdata
+    m61_table page_table;               // page -> chain of m61_mdata
+} __attribute__((aligned(64))) m61_stripe;
+
+// struct for an allocation site reported by m61_getheavyhitters
+struct m61_site {
+    const char* filename;               // ptr to filename
     int line_num;                       // line num
+    unsigned long long weight;          // # bytes or # allocations
+    unsigned long long error;           // weight may be overestimated by this
+};
+
+// struct for a site counter in a heavy hitter summary. Sites are keyed by
+// filename pointer and line, so no strings are compared when tracking.
+typedef struct m61_heavyhitter {
     const char* filename;               // ptr to filename
+    int line_num;                       // line num
+    uint32_t hash;                      // hash of (filename, line_num)
+    unsigned long long weight;          // # bytes or # allocations
+    unsigned long long error;           // weight of evicted site replaced
 } m61_hhitter;
 
+// # index slots: the least power of two >= 2 * M61_HHITTER_K, so a hash
+// can be masked to a slot whatever M61_HHITTER_K is.
+#define M61_HHITTER_I0  (2 * M61_HHITTER_K - 1)
+#define M61_HHITTER_I1  (M61_HHITTER_I0 | M61_HHITTER_I0 >> 1)
+#define M61_HHITTER_I2  (M61_HHITTER_I1 | M61_HHITTER_I1 >> 2)
+#define M61_HHITTER_I3  (M61_HHITTER_I2 | M61_HHITTER_I2 >> 4)
+#define M61_HHITTER_NIDX ((M61_HHITTER_I3 | M61_HHITTER_I3 >> 8) + 1)
+
+// struct for a Space-Saving summary of the M61_HHITTER_K heaviest sites.
+// A min-heap on weight finds the site to evict, and an open-addressing
+// index from site hash to counter finds a tracked site in O(1).
+typedef struct m61_hhsummary {
+    m61_hhitter counters[M61_HHITTER_K];    // site counters
+    unsigned short heap[M61_HHITTER_K];     // counter idxs, min weight first
+    unsigned short heap_pos[M61_HHITTER_K]; // counter idx -> heap position
+    unsigned short index[M61_HHITTER_NIDX]; // counter idx + 1, 0 empty
+    int ncounters;                          // # counters in use
+} m61_hhsummary;
+
+// struct for a thread's cache of stats and heavy hitters. Only the owning
+// thread writes it; readers merge all caches under the cache list lock.
+// Active counts are signed, since a thread may free others' blocks.
+typedef struct m61_threadcache {
+    long long nactive;                  // # active allocations
+    long long active_size;              // # bytes in active allocations
+    unsigned long long ntotal;          // # total allocations
+    unsigned long long total_size;      // # bytes in total allocations
+    unsigned long long nfail;           // # failed allocation attempts
+    unsigned long long fail_size;       // # bytes in failed alloc attempts
+    m61_hhsummary heavy_alloc;          // heaviest allocators
+    m61_hhsummary heavy_freq;           // most frequent allocators
+    int retired;                        // owning thread has exited
+    struct m61_tracering* trace_ring;   // trace ring, once thread traced
+    struct m61_threadcache* next;       // next cache in list of all caches
+} m61_tcache;
+
+// trace file format: a m61_thdr header, then m61_trec records in order
+// of flush, not time (sort by time_ns, tid, seq), then the site table at
+// sites_off. Each site is a m61_tsiterec followed by its filename, without
+// a nul.
+#define M61_TRACE_MAGIC     0x5431364d  // "M61T"
+#define M61_TRACE_VERSION   2
+#define M61_TRACE_MALLOC    1
+#define M61_TRACE_FREE      2
+#define M61_TRACE_REALLOC   3
+#define M61_TRACE_CALLOC    4
+
+// struct for header of a trace file
+typedef struct m61_traceheader {
+    uint32_t magic;                     // M61_TRACE_MAGIC
+    uint32_t version;                   // M61_TRACE_VERSION
+    uint64_t sites_off;                 // file offset of site table
+    uint64_t nsites;                    // # sites in site table
+} m61_thdr;
+
+// struct for a trace record of one m61 call
+typedef struct m61_tracerec {
+    uint64_t time_ns;                   // ns since trace began
+    uint64_t seq;                       // # earlier records of its thread
+    uint64_t addr;                      // block returned, 0 if none
+    uint64_t old_addr;                  // block passed to free or realloc
+    uint64_t size;                      // # bytes asked for
+    uint32_t site;                      // site id, 0 if unknown
+    uint16_t tid;                       // id of calling thread's ring
+    uint16_t op;                        // M61_TRACE_ op code
+} m61_trec;
+
+// struct for a site table entry of a trace file
+typedef struct m61_tracesiterec {
+    uint32_t id;                        // site id used by records
+    uint32_t line_num;                  // line num
+    uint32_t namelen;                   // # bytes in filename that follows
+} m61_tsiterec;
+
+// struct for an interned site of the trace being recorded
+typedef struct m61_tracesite {
+    const char* filename;               // ptr to filename, NULL if free
+    int line_num;                       // line num
+    uint32_t id;                        // site id used by records
+} m61_tsite;
+
+// struct for a thread's ring of trace records. Only the owning thread
+// advances head, only the flusher advances tail.
+typedef struct m61_tracering {
+    m61_trec recs[M61_TRACE_RING_SZ];   // records, at index mod ring size
+    size_t head;                        // # records ever queued
+    size_t tail;                        // # records ever written out
+    unsigned int tid;                   // ring id, recorded as thread id
+    struct m61_tracering* next;         // next ring in list of all rings
+} m61_tring;
+
+// adds @v to counter @f of the calling thread's cache. Single writer, so a
+// relaxed store is enough for concurrent readers to see whole values.
+#define TCACHE_ADD(f, v) \
+    __atomic_store_n(&(f), (f) + (v), __ATOMIC_RELAXED)
+
 void m61_getstatistics(struct m61_statistics* stats);
 void m61_printstatistics(void);
 void m61_printleakreport(void);
+unsigned long long m61_getoverhead(void);
 void m61_printheavyhitters(void);
+size_t m61_getheavyhitters(struct m61_site* sites, size_t k, int by_count);
+int m61_tracebegin(const char* path);
+void m61_traceend(void);
+
+// internal functions of m61.c
+#ifdef M61_INTERNAL
+static void* blockalloc(size_t sz, const char* file, int line);
+static void blockfree(void* ptr, const char* file, int line);
+static void* blockrealloc(void* ptr, size_t sz, const char* file, int line);
 static void validateinheap(void* ptr, const char* file, int line);
-static void validateisallocated(void* ptr, const char* file, int line);
-static void validateboundarycheck(void* ptr, const char* file, int line);
-static void sortheavyhitters(m61_hhitter* hhitters);
-static void trackheavyhitters(m61_hhitter* hhitters, int* neg_bias, 
+static void validateisallocated(void* ptr, const char* file, int line,
+    m61_bref* blk);
+static void validateboundarycheck(m61_bref* blk, const char* file, int line);
+static m61_tcache* gettcache(void);
+static void tcacheinitkey(void);
+static void tcacheretire(void* arg);
+static void updateheapbounds(char* lo, char* hi);
+static m61_slab* slabof(uintptr_t addr);
+static m61_stripe* stripeof(uintptr_t addr);
+static void slabref(m61_slab* slab, unsigned int slot, m61_bref* blk);
+static void heapref(m61_mdata* meta_d, m61_bref* blk);
+static void freezeblocks(void);
+static void thawblocks(void);
+static int findallocated(uintptr_t addr, m61_bref* blk);
+static int findcontainingblock(uintptr_t addr, m61_bref* blk);
+static void* heapalloc(size_t sz, const char* file, int line);
+static void heaprelease(m61_mdata* meta_d);
+static void* heapresize(m61_bref* blk, size_t sz);
+static void* slaballoc(size_t sz, const char* file, int line);
+static int slabresize(m61_bref* blk, size_t sz);
+static int slabfree(m61_bref* blk);
+static int slablockclass(m61_slab* slab);
+static int slabslotinuse(m61_slab* slab, unsigned int slot);
+static m61_slab* slabnew(int class_idx);
+static char* arenacarve(void);
+static int slabmapinsert(m61_slab* slab);
+static void slabinitclasses(void);
+static int trackalloc(m61_mdata* meta_d);
+static int untrackalloc(m61_mdata* meta_d);
+static void updatemaxpayload(size_t sz);
+static size_t tablehash(uintptr_t key, size_t cap);
+static void* tablelookup(m61_table* tbl, uintptr_t key);
+static int tableresize(m61_table* tbl, size_t new_cap);
+static int tableinsert(m61_table* tbl, uintptr_t key, void* val);
+static void* tableremove(m61_table* tbl, uintptr_t key);
+static int comparepayloadaddr(const void* a, const void* b);
+static size_t mergeheavyhitters(struct m61_site** sites, int by_count);
+static int comparesiteweight(const void* a, const void* b);
+static uint32_t sitehash(const char* file, int line);
+static void trackheavyhitters(m61_hhsummary* hhs, uint32_t hash, 
     size_t sz, const char* file, int line);
+static void hhsiftdown(m61_hhsummary* hhs, int pos);
+static void hhsiftup(m61_hhsummary* hhs, int pos);
+static void hhswap(m61_hhsummary* hhs, int a, int b);
+static void hhindexinsert(m61_hhsummary* hhs, int idx);
+static void hhindexremove(m61_hhsummary* hhs, int idx);
+static void tracerecord(int op, void* addr, void* old_addr, size_t sz,
+    const char* file, int line);
+static struct m61_tracerec* tracereserve(int op, void* old_addr, size_t sz,
+    const char* file, int line);
+static void tracecommit(struct m61_tracerec* rec, void* addr);
+static struct m61_tracering* gettracering(void);
+static uint32_t tracesite(const char* file, int line);
+static uint64_t tracenow(void);
+static void* traceflusher(void* arg);
+static size_t traceflush(void);
+static int tracewrite(const void* buf, size_t sz);
+#endif
 
 #if !M61_DISABLE
 #define malloc(sz)              m61_malloc((sz), __FILE__, __LINE__)
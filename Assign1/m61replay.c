@@ -0,0 +1,331 @@
+#define _GNU_SOURCE     1
+#define M61_DISABLE     1    // libc replay calls plain malloc
+#include "m61.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// m61replay [-n REPEAT] [-m m61|libc] TRACE
+//    Replays TRACE, recorded by m61_tracebegin/m61_traceend, against m61
+//    and against plain libc, each in its own child process, and reports
+//    ops/sec, peak RSS growth and the bytes m61 adds to the live blocks
+//    when the trace's live bytes peak. Threads' records are merged by time
+//    and replayed by a single thread.
+
+// struct for an op of the trace, with blocks renamed to dense slots
+typedef struct replay_op {
+    int op;                             // M61_TRACE_ op code
+    long slot;                          // slot of block returned, or -1
+    long old_slot;                      // slot of block passed in, or -1
+    size_t size;                        // # bytes asked for
+    uint32_t site;                      // site id
+} replay_op;
+
+// struct for a slot of the table from trace address to block slot
+typedef struct replay_mslot {
+    uint64_t addr;                      // trace address, 0 empty, 1 removed
+    long slot;                          // block slot
+} replay_mslot;
+
+static replay_op* ops;
+static size_t nops;
+static size_t nslots;
+static const char** site_names;         // site id -> filename
+static int* site_lines;                 // site id -> line num
+static size_t max_site;
+static size_t peak_nlive, peak_live_size;
+static size_t peak_op;                  // index of op reaching peak bytes
+
+static replay_mslot* amap;
+static size_t amap_cap;
+
+/** @brief compares two trace records by time, then thread, then order
+    within the thread, for qsort. */
+static int comparerectime(const void* a, const void* b) {
+    const m61_trec* rec_a = a;
+    const m61_trec* rec_b = b;
+    if (rec_a->time_ns != rec_b->time_ns) {
+        return rec_a->time_ns < rec_b->time_ns ? -1 : 1;
+    } else if (rec_a->tid != rec_b->tid) {
+        return rec_a->tid < rec_b->tid ? -1 : 1;
+    }
+    return (rec_a->seq > rec_b->seq) - (rec_a->seq < rec_b->seq);
+}
+
+/** @brief returns the address map slot for @addr, or where it would go. */
+static replay_mslot* amapfind(uint64_t addr, int for_insert) {
+    size_t i = ((addr * 0x9e3779b97f4a7c15ULL) >> 20) & (amap_cap - 1);
+    replay_mslot* removed = NULL;
+    while (amap[i].addr != 0 && amap[i].addr != addr) {
+        if (amap[i].addr == 1 && removed == NULL) {
+            removed = &amap[i];
+        }
+        i = (i + 1) & (amap_cap - 1);
+    }
+    if (for_insert && amap[i].addr == 0 && removed != NULL) {
+        return removed;
+    }
+    return &amap[i];
+}
+
+/** @brief removes @addr from the address map. Returns its slot, or -1 if
+    @addr was allocated before the trace began. */
+static long amaptake(uint64_t addr) {
+    if (addr == 0) {
+        return -1;
+    }
+    replay_mslot* m = amapfind(addr, 0);
+    if (m->addr != addr) {
+        return -1;
+    }
+    m->addr = 1;
+    return m->slot;
+}
+
+/** @brief maps @addr to a new block slot of @sz bytes, and updates the
+    peak live counts. @live_size is the live byte count so far. */
+static long amapput(uint64_t addr, size_t sz, size_t* sizes, size_t* nlive,
+    size_t* live_size) {
+    replay_mslot* m = amapfind(addr, 1);
+    m->addr = addr;
+    m->slot = nslots;
+    sizes[nslots] = sz;
+    ++*nlive;
+    *live_size += sz;
+    if (*nlive > peak_nlive) {
+        peak_nlive = *nlive;
+    }
+    if (*live_size > peak_live_size) {
+        peak_live_size = *live_size;
+        peak_op = nops;
+    }
+    return nslots++;
+}
+
+/** @brief loads the trace at @path into the op array. Exits on error. */
+static void loadtrace(const char* path) {
+    FILE* f = fopen(path, "r");
+    m61_thdr hdr;
+    if (f == NULL || fread(&hdr, sizeof(hdr), 1, f) != 1
+        || hdr.magic != M61_TRACE_MAGIC || hdr.version != M61_TRACE_VERSION) {
+        fprintf(stderr, "%s: not a m61 trace\n", path);
+        exit(1);
+    }
+    if (hdr.sites_off == 0) {
+        // trace was not ended, take the records written
+        fseek(f, 0, SEEK_END);
+        hdr.sites_off = ftell(f);
+    }
+    size_t nrecs = (hdr.sites_off - sizeof(hdr)) / sizeof(m61_trec);
+    m61_trec* recs = malloc((nrecs + 1) * sizeof(m61_trec));
+    fseek(f, sizeof(hdr), SEEK_SET);
+    if (recs == NULL || fread(recs, sizeof(m61_trec), nrecs, f) != nrecs) {
+        fprintf(stderr, "%s: truncated trace\n", path);
+        exit(1);
+    }
+
+    // site table, ids are dense from 1
+    max_site = hdr.nsites;
+    site_names = calloc(max_site + 1, sizeof(char *));
+    site_lines = calloc(max_site + 1, sizeof(int));
+    for (uint64_t i = 0; i < hdr.nsites; i++) {
+        m61_tsiterec srec;
+        if (fread(&srec, sizeof(srec), 1, f) != 1 || srec.id > max_site) {
+            fprintf(stderr, "%s: bad site table\n", path);
+            exit(1);
+        }
+        char* name = calloc(srec.namelen + 1, 1);
+        if (fread(name, 1, srec.namelen, f) != srec.namelen) {
+            fprintf(stderr, "%s: bad site table\n", path);
+            exit(1);
+        }
+        site_names[srec.id] = name;
+        site_lines[srec.id] = srec.line_num;
+    }
+    fclose(f);
+    for (size_t i = 0; i <= max_site; i++) {
+        if (site_names[i] == NULL) {
+            site_names[i] = "?";
+        }
+    }
+
+    // rename addresses to slots, following reuse of addresses over time
+    qsort(recs, nrecs, sizeof(m61_trec), comparerectime);
+    amap_cap = 1024;
+    while (amap_cap < 2 * nrecs) {
+        amap_cap *= 2;
+    }
+    amap = calloc(amap_cap, sizeof(replay_mslot));
+    ops = malloc((nrecs + 1) * sizeof(replay_op));
+    size_t* sizes = malloc((nrecs + 1) * sizeof(size_t));
+    size_t nlive = 0, live_size = 0;
+    for (size_t i = 0; i < nrecs; i++) {
+        m61_trec* rec = &recs[i];
+        replay_op* op = &ops[nops];
+        op->op = rec->op;
+        op->size = rec->size;
+        op->site = rec->site <= max_site ? rec->site : 0;
+        op->slot = op->old_slot = -1;
+        if (rec->op == M61_TRACE_FREE || rec->op == M61_TRACE_REALLOC) {
+            if (rec->op == M61_TRACE_REALLOC && rec->addr == 0
+                && rec->size != 0) {
+                // failed realloc left the block alone
+                continue;
+            }
+            op->old_slot = amaptake(rec->old_addr);
+            if (op->old_slot == -1 && rec->old_addr != 0) {
+                // block from before the trace; realloc becomes a malloc
+                if (rec->op == M61_TRACE_FREE) {
+                    continue;
+                }
+            } else if (op->old_slot != -1) {
+                --nlive;
+                live_size -= sizes[op->old_slot];
+            }
+        } else if (rec->addr == 0) {
+            // failed allocations are not replayed
+            continue;
+        }
+        if (rec->addr != 0) {
+            op->slot = amapput(rec->addr, rec->size, sizes, &nlive,
+                &live_size);
+        }
+        ++nops;
+    }
+    free(sizes);
+    free(amap);
+    free(recs);
+}
+
+/** @brief returns the monotonic clock time in seconds. */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** @brief replays the ops @repeat times with m61 if @use_m61, else libc,
+    and prints the results. Blocks left live are freed between repeats. */
+static void replay(int use_m61, int repeat) {
+    void** ptrs = calloc(nslots + 1, sizeof(void *));
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    long base_rss = ru.ru_maxrss;
+    unsigned long long overhead = 0;
+    double pause = 0;       // time spent measuring overhead, not replaying
+
+    double start = now();
+    for (int r = 0; r < repeat; r++) {
+        for (size_t i = 0; i < nops; i++) {
+            replay_op* op = &ops[i];
+            const char* file = site_names[op->site];
+            int line = site_lines[op->site];
+            void* old = op->old_slot == -1 ? NULL : ptrs[op->old_slot];
+            void* p = NULL;
+            switch (op->op) {
+            case M61_TRACE_MALLOC:
+                p = use_m61 ? m61_malloc(op->size, file, line)
+                    : malloc(op->size);
+                break;
+            case M61_TRACE_CALLOC:
+                p = use_m61 ? m61_calloc(1, op->size, file, line)
+                    : calloc(1, op->size);
+                break;
+            case M61_TRACE_REALLOC:
+                p = use_m61 ? m61_realloc(old, op->size, file, line)
+                    : realloc(old, op->size);
+                break;
+            case M61_TRACE_FREE:
+                use_m61 ? m61_free(old, file, line) : free(old);
+                break;
+            }
+            if (op->old_slot != -1) {
+                ptrs[op->old_slot] = NULL;
+            }
+            if (op->slot != -1) {
+                ptrs[op->slot] = p;
+                // touch the block, as the traced program did
+                if (p != NULL && op->size != 0) {
+                    *(char *)p = 0;
+                }
+            }
+            if (use_m61 && r == 0 && i == peak_op && peak_live_size != 0) {
+                double t = now();
+                overhead = m61_getoverhead();
+                pause += now() - t;
+            }
+        }
+        for (size_t i = 0; i < nslots; i++) {
+            if (ptrs[i] != NULL) {
+                use_m61 ? m61_free(ptrs[i], __FILE__, __LINE__)
+                    : free(ptrs[i]);
+                ptrs[i] = NULL;
+            }
+        }
+    }
+    double elapsed = now() - start - pause;
+
+    getrusage(RUSAGE_SELF, &ru);
+    printf("%-5s %12.0f ops/sec  %10ld KiB peak RSS growth\n",
+        use_m61 ? "m61" : "libc", nops * repeat / elapsed,
+        ru.ru_maxrss - base_rss);
+    if (use_m61) {
+        printf("m61 overhead at peak: %llu bytes (%.1f bytes/block, "
+            "+%.1f%%)\n", overhead,
+            peak_nlive ? (double)overhead / peak_nlive : 0,
+            peak_live_size ? 100.0 * overhead / peak_live_size : 0);
+    }
+    free(ptrs);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: m61replay [-n REPEAT] [-m m61|libc] TRACE\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    int repeat = 1, run_m61 = 1, run_libc = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+        if (opt == 'n') {
+            repeat = strtol(optarg, NULL, 0);
+        } else if (opt == 'm' && strcmp(optarg, "m61") == 0) {
+            run_libc = 0;
+        } else if (opt == 'm' && strcmp(optarg, "libc") == 0) {
+            run_m61 = 0;
+        } else {
+            usage();
+        }
+    }
+    if (optind != argc - 1 || repeat <= 0) {
+        usage();
+    }
+
+    loadtrace(argv[optind]);
+    printf("%zu ops, %zu blocks, peak %zu live blocks of %zu bytes\n",
+        nops, nslots, peak_nlive, peak_live_size);
+    fflush(stdout);
+
+    // each allocator in a fresh process, so RSS peaks are separate
+    for (int use_m61 = 1; use_m61 >= 0; use_m61--) {
+        if (!(use_m61 ? run_m61 : run_libc)) {
+            continue;
+        }
+        pid_t p = fork();
+        if (p == 0) {
+            replay(use_m61, repeat);
+            exit(0);
+        }
+        int status;
+        if (p == -1 || waitpid(p, &status, 0) != p || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "m61replay: %s replay failed\n",
+                use_m61 ? "m61" : "libc");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -4,69 +4,98 @@
 #include <sys/mman.h>
 #include <limits.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 // io61.c
 #define SBUF_SZ 4096          // buffer slot size
-
-// io61_file
-//    Data structure for io61 file wrappers. Add your own stuff.
-struct io61_file {
-    int fd;                   // file descriptor
-    int mode;                 // mode file is opened in
-};
-
-typedef struct cache {
+#define NSLOTS 8              // # read cache slots per file
+#define PREFETCH_NSLOTS 4     // max # slots filled by one read syscall
+#define WB_NBUFS 4            // # write-behind buffers per file
+
+// adds `n` to profile counter `field` of file `f`; atomic since the
+// write-behind thread counts too
+#define IO61_COUNT(f, field, n) \
+    __atomic_fetch_add(&(f)->stats.field, (n), __ATOMIC_RELAXED)
+
+// writebehind
+//    Write-behind state of a writable file. Full buffers are queued, and
+//    a background thread drains every queued buffer with one writev. The
+//    writer fills the buffer after the queued ones.
+typedef struct writebehind {
+    pthread_t thread;         // drains queued buffers
+    pthread_mutex_t lock;     // protects the fields below
+    pthread_cond_t cond;      // signaled when the queue changes
+    char* bufs[WB_NBUFS];     // ring of buffers
+    size_t lens[WB_NBUFS];    // # bytes in each queued buffer
+    int head;                 // first queued buffer
+    int nqueued;              // # queued buffers
+    int error;                // errno of a failed background write, or 0
+    int stop;                 // thread should exit once queue is empty
+} writebehind;
+
+// cacheslot
+//    A block of a non-mappable file in its read cache. Blocks of seekable
+//    files start at multiples of SBUF_SZ; blocks of pipes start where the
+//    previous read ended.
+typedef struct cacheslot {
     char cbuf[SBUF_SZ];
-    off_t localoffset;        // local offset from file offset
-    int fileoffsetmin;        // File offset, min
-    int fileoffsetmax;        // File offset, max
-} cachebuf;
-
-cachebuf readbuf;             // read buffer (for non-mappable files)
-cachebuf writebuf;            // output buffer
+    off_t tag;                // file offset of block, -1 if slot is empty
+    ssize_t len;              // # bytes in block, < SBUF_SZ at end of file
+    int ref;                  // referenced since CLOCK hand last passed
+} cacheslot;
 
-typedef struct memmap memmap;
-struct memmap {
+typedef struct memmap {
     char* mapped_file;        // mmap of file
     off_t filesize;           // filesize of mapped file
     off_t localoffset;        // offset within mmap
-    int fd;                   // file descriptor of mapped file
-    memmap* next;             // next mmap node in list
-    memmap* prev;             // previous mmap node in list
-};
+} memmap;
 
-// creating a list of memmaps, for case of multiple mapped files
-// mmap list operations - start
-memmap* mmaphead;              // head of mmap list
-
-void insert_first(memmap* n) {
-    n->next = mmaphead;
-    n->prev = NULL;
-    if (mmaphead)
-        mmaphead->prev = n;
-    mmaphead = n;
-}
+// io61_file
+//    Data structure for io61 file wrappers. Each file has its own cache,
+//    so any number of files can be read and written at once.
+struct io61_file {
+    int fd;                   // file descriptor
+    int mode;                 // mode file is opened in
+    memmap* map;              // mapping of readable file, NULL if unmapped
+    char* wbuf;               // output buffer being filled
+    size_t wbuf_sz;           // size of each output buffer
+    size_t wlen;              // # bytes in wbuf
+    writebehind* wb;          // write-behind state, NULL if synchronous
+    // read cache, for non-mappable readable files
+    cacheslot* slots;         // NSLOTS slots
+    cacheslot* cur;           // slot holding pos, or NULL
+    int hand;                 // CLOCK hand, next slot to consider evicting
+    off_t pos;                // read position
+    int seekable;             // can pread from fd at any offset
+    off_t stream_end;         // offset after last byte read, if !seekable
+    off_t last_miss;          // farthest block filled by last miss
+    int stride;               // block stride of last two misses, or 0
+    // profiling
+    io61_counters stats;      // counters since io61_profile_begin
+    io61_file* next;          // next open file
+    io61_file* prev;          // previous open file
+};
 
-void remove_mmap(memmap* n) {
-    if (n->next)
-        n->next->prev = n->prev;
-    if (n->prev)
-        n->prev->next = n->next;
-    else
-        mmaphead = n->next;
-}
+// registry of open files, so a profile covers every stream
+static io61_file* open_files;
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static io61_counters closed_stats;    // files closed since profile began
+static struct timeval profile_time;   // when profile began
+static struct rusage profile_usage;   // usage when profile began
 
-memmap* search_in_list(int fd) {
-    memmap *ptr = mmaphead;
-    while(ptr != NULL) {
-        if(ptr->fd == fd) {
-            return ptr;
-        }
-        ptr = ptr->next;
-    }
-    return NULL;
-}
-// mmap list operations - end
+static cacheslot* io61_getslot(io61_file* f, off_t pos);
+static cacheslot* io61_fillslots(io61_file* f, off_t block);
+static cacheslot* io61_victim(io61_file* f, unsigned claimed);
+static int io61_queuebuf(io61_file* f);
+static int io61_drain(io61_file* f);
+static void* io61_writebehind(void* arg);
+static int io61_writevall(io61_file* f, struct iovec* iov, int n);
+static void io61_addcounters(io61_counters* sum, const io61_counters* c);
+static void io61_printcounters(const io61_counters* c);
 
 
 // io61_fdopen(fd, mode)
@@ -75,39 +104,101 @@ memmap* search_in_list(int fd) {
 //    or O_WRONLY for a write-only file. You need not support read/write
 //    files.
 io61_file* io61_fdopen(int fd, int mode) {
-    assert(fd >= 0);
+    return io61_fdopen_buffered(fd, mode, SBUF_SZ, 0);
+}
+
+
+// io61_fdopen_buffered(fd, mode, bufsz, write_behind)
+//    Like io61_fdopen, but a writable file buffers `bufsz` bytes before
+//    writing. If `write_behind` is nonzero, full buffers are written by a
+//    background thread while the next ones fill, so writes rarely wait
+//    for the file. Errors of background writes are returned by later
+//    calls. Readable files ignore `bufsz` and `write_behind`, and are
+//    memory-mapped when possible unless `mode` includes IO61_NOMMAP.
+io61_file* io61_fdopen_buffered(int fd, int mode, size_t bufsz,
+                                int write_behind) {
+    assert(fd >= 0 && bufsz > 0);
+    int nommap = mode & IO61_NOMMAP;
+    mode &= ~IO61_NOMMAP;
     io61_file* f = (io61_file*) malloc(sizeof(io61_file));
     f->fd = fd;
     f->mode = mode;
-    (void) mode;
+    f->map = NULL;
+    f->wbuf = NULL;
+    f->wbuf_sz = bufsz;
+    f->wlen = 0;
+    f->wb = NULL;
+    f->slots = NULL;
+    memset(&f->stats, 0, sizeof(f->stats));
+    pthread_mutex_lock(&open_files_lock);
+    f->prev = NULL;
+    f->next = open_files;
+    if (open_files) {
+        open_files->prev = f;
+    }
+    open_files = f;
+    pthread_mutex_unlock(&open_files_lock);
+
+    // init file for writing
+    if (mode == O_WRONLY && write_behind) {
+        writebehind* wb = (writebehind*) malloc(sizeof(writebehind));
+        pthread_mutex_init(&wb->lock, NULL);
+        pthread_cond_init(&wb->cond, NULL);
+        for (int i = 0; i < WB_NBUFS; i++) {
+            wb->bufs[i] = (char*) malloc(bufsz);
+        }
+        wb->head = wb->nqueued = 0;
+        wb->error = wb->stop = 0;
+        f->wbuf = wb->bufs[0];
+        f->wb = wb;
+        if (pthread_create(&wb->thread, NULL, io61_writebehind, f) != 0) {
+            // write synchronously instead
+            for (int i = 1; i < WB_NBUFS; i++) {
+                free(wb->bufs[i]);
+            }
+            free(wb);
+            f->wb = NULL;
+        }
+    } else if (mode == O_WRONLY) {
+        f->wbuf = (char*) malloc(bufsz);
+    }
     
     // init file for reading
     if (mode == O_RDONLY) {
         // check is file mappable, by looking at filesize (-1 if pipe)
-        //memmap newmmap = {NULL, 0, 0, 0, NULL, NULL};
-        memmap *newmmap = (memmap*)malloc(sizeof(memmap));
-        newmmap->filesize = io61_filesize(f);
-        if (newmmap->filesize != -1) {
-            size_t fsize = (size_t)newmmap->filesize;
+        off_t filesize = io61_filesize(f);
+        if (filesize != -1 && !nommap) {
+            memmap *newmmap = (memmap*)malloc(sizeof(memmap));
+            newmmap->filesize = filesize;
             // map file using mmap
-            newmmap->mapped_file = mmap(NULL, fsize, PROT_READ, 
+            newmmap->mapped_file = mmap(NULL, (size_t)filesize, PROT_READ, 
                 MAP_SHARED, fd, 0);
             newmmap->localoffset = 0;
-            newmmap->fd = fd;
-            if (newmmap->mapped_file == MAP_FAILED) {
-                perror("mmap");
-                exit(1);
+            IO61_COUNT(f, nmmap, 1);
+            if (newmmap->mapped_file != MAP_FAILED) {
+                f->map = newmmap;
+                return f;
             }
-            insert_first(newmmap);
-        } else {
-            // for pipe init the readbuffer
-            readbuf.localoffset = 0;
-            readbuf.fileoffsetmin = 0;
-            readbuf.fileoffsetmax = -1;
+            // empty or unmappable file, use the read cache instead
+            free(newmmap);
         }
-    } else {
-        // init file for writing
-        writebuf.localoffset = 0;
+        f->slots = (cacheslot*) malloc(NSLOTS * sizeof(cacheslot));
+        for (int i = 0; i < NSLOTS; i++) {
+            f->slots[i].tag = -1;
+            f->slots[i].len = 0;
+            f->slots[i].ref = 0;
+        }
+        f->cur = NULL;
+        f->hand = 0;
+        f->pos = lseek(fd, 0, SEEK_CUR);
+        IO61_COUNT(f, nlseek, 1);
+        f->seekable = f->pos != -1;
+        if (!f->seekable) {
+            f->pos = 0;
+        }
+        f->stream_end = f->pos;
+        f->last_miss = -1;
+        f->stride = 0;
     }
     return f;
 }
@@ -118,18 +209,48 @@ io61_file* io61_fdopen(int fd, int mode) {
 //    any buffers.
 int io61_close(io61_file* f) {
     // only flush writable file...
+    int r = 0;
     if (f->mode == O_WRONLY) {
-        io61_flush(f);
+        r = io61_flush(f);
+    }
+    if (f->wb != NULL) {
+        writebehind* wb = f->wb;
+        pthread_mutex_lock(&wb->lock);
+        wb->stop = 1;
+        pthread_cond_broadcast(&wb->cond);
+        pthread_mutex_unlock(&wb->lock);
+        pthread_join(wb->thread, NULL);
+        pthread_mutex_destroy(&wb->lock);
+        pthread_cond_destroy(&wb->cond);
+        for (int i = 0; i < WB_NBUFS; i++) {
+            free(wb->bufs[i]);
+        }
+        free(wb);
+    } else {
+        free(f->wbuf);
     }
     // if file was using mmap, unmap it's accompanying mapping
-    if (mmaphead != NULL) {
-        memmap* mptr = search_in_list(f->fd);
-        munmap(mptr->mapped_file, mptr->filesize);
-        //remove from list
-        remove_mmap(mptr);
+    if (f->map != NULL) {
+        munmap(f->map->mapped_file, f->map->filesize);
+        free(f->map);
+    }
+    free(f->slots);
+
+    pthread_mutex_lock(&open_files_lock);
+    if (f->next) {
+        f->next->prev = f->prev;
     }
+    if (f->prev) {
+        f->prev->next = f->next;
+    } else {
+        open_files = f->next;
+    }
+    io61_addcounters(&closed_stats, &f->stats);
+    pthread_mutex_unlock(&open_files_lock);
     
-    int r = close(f->fd);
+    if (close(f->fd) == -1) {
+        r = -1;
+    }
     free(f);
     return r;
 }
@@ -138,39 +259,172 @@ int io61_close(io61_file* f) {
 //    Read a single (unsigned) character from `f` and return it. Returns EOF
 //    (which is -1) on error or end-of-file.
 int io61_readc(io61_file* f) {
-    if (mmaphead == NULL) {        // non-mapped files
-        off_t bytes_read = -1;
-        if ((readbuf.fileoffsetmin + readbuf.localoffset) 
-                >= readbuf.fileoffsetmax) {
-            // if not in buffer, then read next chunk into the buffer
-            bytes_read = io61_read(f, readbuf.cbuf, SBUF_SZ);
-            readbuf.fileoffsetmin = readbuf.fileoffsetmin + readbuf.localoffset;
-            readbuf.fileoffsetmax = readbuf.fileoffsetmin + bytes_read;
-            readbuf.localoffset = 0;
+    if (f->map == NULL) {        // non-mapped files
+        cacheslot* c = f->cur;
+        if (c == NULL || f->pos - c->tag >= c->len) {
+            // not in current slot, so find or read its block
+            c = io61_getslot(f, f->pos);
+            if (c == NULL) {
+                return EOF;
+            }
         }
-        
-        if (bytes_read != 0) {
-            unsigned char bufch[1];
-             bufch[0] = readbuf.cbuf[readbuf.localoffset];
-            ++readbuf.localoffset;
-            // read char from buffer and increament the localoffset
-            return bufch[0];
+        unsigned char ch = c->cbuf[f->pos - c->tag];
+        ++f->pos;
+        return ch;
+    } else {    // read char in mapped file, just take char from mmap
+        memmap* mptr = f->map;
+        if (mptr->localoffset < mptr->filesize) {
+            unsigned char ch = mptr->mapped_file[mptr->localoffset];
+            mptr->localoffset += 1;
+            return ch;
         } else {
-            // attempt to read into the buffer, but reached EOF instead
             return EOF;
         }
-    } else {    // read char in mapped file, just take char from mmap
-		memmap* mptr = search_in_list(f->fd);
-		if (mptr->localoffset < mptr->filesize) {
-			unsigned char bufch[1];
-			memcpy(bufch, &(mptr->mapped_file[mptr->localoffset]), 1);
-			mptr->localoffset += 1;
-			return bufch[0];
-		} else {
-			return EOF;
-		}
-    }
-    return -1;    // something went wrong while attemping read
+    }
+}
+
+
+// io61_getslot(f, pos)
+//    Return the read cache slot of `f` holding offset `pos`, reading its
+//    block on a miss, and make it the current slot. Returns NULL at
+//    end-of-file, or if `pos` can no longer be read from a pipe.
+static cacheslot* io61_getslot(io61_file* f, off_t pos) {
+    off_t block = pos - (pos % SBUF_SZ);
+    for (int i = 0; i < NSLOTS; i++) {
+        cacheslot* c = &f->slots[i];
+        if (c->tag != -1 && pos >= c->tag && pos < c->tag + c->len) {
+            c->ref = 1;
+            f->cur = c;
+            IO61_COUNT(f, hits, 1);
+            return c;
+        } else if (f->seekable && c->tag == block) {
+            // block cached, but ends before pos
+            return NULL;
+        }
+    }
+
+    IO61_COUNT(f, misses, 1);
+    cacheslot* c = io61_fillslots(f, f->seekable ? block : f->stream_end);
+    if (c == NULL || pos < c->tag || pos >= c->tag + c->len) {
+        return NULL;
+    }
+    f->cur = c;
+    return c;
+}
+
+
+// io61_fillslots(f, block)
+//    Read the block at offset `block` of `f` into a free or evicted slot,
+//    and return the slot. If the last two misses were to adjacent blocks,
+//    the next blocks in the same direction, forward or backward, are read
+//    by the same syscall. Returns NULL on end-of-file of a pipe.
+static cacheslot* io61_fillslots(io61_file* f, off_t block) {
+    if (!f->seekable) {
+        // pipes are read in order, a block at a time
+        if (block != f->stream_end) {
+            return NULL;
+        }
+        cacheslot* c = io61_victim(f, 0);
+        ssize_t nread;
+        do {
+            IO61_COUNT(f, nread, 1);
+            nread = read(f->fd, c->cbuf, SBUF_SZ);
+        } while (nread == -1 && errno == EINTR);
+        if (nread == -1) {
+            perror("read");
+            exit(1);
+        }
+        c->ref = 1;
+        c->tag = nread > 0 ? block : -1;
+        c->len = nread;
+        f->stream_end += nread;
+        return nread > 0 ? c : NULL;
+    }
+
+    // detect a run of misses to adjacent blocks
+    int dir = 0;
+    off_t stride = (block - f->last_miss) / SBUF_SZ;
+    if (f->last_miss != -1 && (stride == 1 || stride == -1)) {
+        if (stride == f->stride) {
+            dir = stride;
+        }
+        f->stride = stride;
+    } else {
+        f->stride = 0;
+    }
+
+    // blocks [start, start + n * SBUF_SZ) are read, stopping at cached
+    // blocks and the start of the file
+    int n = 1;
+    off_t start = block;
+    while (dir != 0 && n < PREFETCH_NSLOTS) {
+        off_t next = dir > 0 ? start + n * SBUF_SZ : start - SBUF_SZ;
+        int cached = next < 0;
+        for (int i = 0; !cached && i < NSLOTS; i++) {
+            cached = f->slots[i].tag == next;
+        }
+        if (cached) {
+            break;
+        }
+        if (dir < 0) {
+            start = next;
+        }
+        ++n;
+    }
+
+    cacheslot* victims[PREFETCH_NSLOTS];
+    struct iovec iov[PREFETCH_NSLOTS];
+    unsigned claimed = 0;
+    for (int i = 0; i < n; i++) {
+        victims[i] = io61_victim(f, claimed);
+        claimed |= 1U << (victims[i] - f->slots);
+        iov[i].iov_base = victims[i]->cbuf;
+        iov[i].iov_len = SBUF_SZ;
+    }
+    ssize_t nread;
+    do {
+        IO61_COUNT(f, nread, 1);
+        nread = preadv(f->fd, iov, n, start);
+    } while (nread == -1 && errno == EINTR);
+    IO61_COUNT(f, nprefetch, n - 1);
+    if (nread == -1) {
+        perror("read");
+        exit(1);
+    }
+
+    for (int i = 0; i < n; i++) {
+        ssize_t len = nread - (ssize_t) i * SBUF_SZ;
+        victims[i]->tag = start + (off_t) i * SBUF_SZ;
+        victims[i]->len = len < 0 ? 0 : (len > SBUF_SZ ? SBUF_SZ : len);
+        // prefetched blocks are not referenced until read
+        victims[i]->ref = victims[i]->tag == block;
+    }
+    f->last_miss = dir < 0 ? start : start + (off_t) (n - 1) * SBUF_SZ;
+    return victims[(block - start) / SBUF_SZ];
+}
+
+
+// io61_victim(f, claimed)
+//    Return the slot of `f` to fill next, by CLOCK: the hand skips and
+//    clears slots referenced since it last passed. Slots in the bitmask
+//    `claimed` are never returned.
+static cacheslot* io61_victim(io61_file* f, unsigned claimed) {
+    while (1) {
+        int i = f->hand;
+        f->hand = (f->hand + 1) % NSLOTS;
+        cacheslot* c = &f->slots[i];
+        if (claimed & (1U << i)) {
+            continue;
+        } else if (c->ref && c->tag != -1) {
+            c->ref = 0;
+        } else {
+            if (f->cur == c) {
+                f->cur = NULL;
+            }
+            c->tag = -1;
+            return c;
+        }
+    }
 }
 
 
@@ -181,29 +435,74 @@ int io61_readc(io61_file* f) {
 //    -1 an error occurred before any characters were read.
 ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
     ssize_t nread = 0;
-    if (mmaphead == NULL) {    // reading for non-mapped file
-        ssize_t nread = read(f->fd, buf, sz);
-        if (nread == -1) {
-            perror("read");
-            exit(1);
-        }
-        if (nread != 0 || sz == 0 || io61_eof(f)) {
-            return nread;
+    if (f->map == NULL) {    // reading for non-mapped file
+        while ((size_t) nread < sz) {
+            cacheslot* c = f->cur;
+            if (c == NULL || f->pos - c->tag >= c->len) {
+                c = io61_getslot(f, f->pos);
+                if (c == NULL) {
+                    break;
+                }
+            }
+            ssize_t avail = c->len - (f->pos - c->tag);
+            if (avail > (ssize_t) (sz - nread)) {
+                avail = sz - nread;
+            }
+            memcpy(buf + nread, &c->cbuf[f->pos - c->tag], avail);
+            f->pos += avail;
+            nread += avail;
         }
+        IO61_COUNT(f, ncopied, nread);
+        return nread;
     } else {    // read from mapped file
-		memmap* mptr = search_in_list(f->fd);
-		if ((mptr->localoffset + 
-			(ssize_t)sz) <= mptr->filesize) {
-			nread = sz;
-		} else {
-			// read everything left in file, if sz is not available
-			nread = mptr->filesize - mptr->localoffset;
-		}
-		memcpy(buf, &(mptr->mapped_file[mptr->localoffset]), nread);
-		mptr->localoffset += nread;
-		return nread;
-    }
-    return -1;    // an error was encountered during read
+        memmap* mptr = f->map;
+        if ((mptr->localoffset + (ssize_t)sz) <= mptr->filesize) {
+            nread = sz;
+        } else {
+            // read everything left in file, if sz is not available
+            nread = mptr->filesize - mptr->localoffset;
+        }
+        memcpy(buf, &(mptr->mapped_file[mptr->localoffset]), nread);
+        mptr->localoffset += nread;
+        IO61_COUNT(f, ncopied, nread);
+        return nread;
+    }
+}
+
+
+// io61_read_view(f, max, len)
+//    Read up to `max` characters from `f` without copying them. Returns a
+//    pointer to the characters, in the file's mapping or in its read 
+//    cache, and sets `*len` to how many there are. This may be fewer than
+//    are left in the file, even if `max` is larger. The pointer is valid 
+//    until the next operation on `f`. Returns NULL with `*len` 0 at 
+//    end-of-file.
+const char* io61_read_view(io61_file* f, size_t max, size_t* len) {
+    const char* view = NULL;
+    *len = 0;
+    if (f->map == NULL) {
+        cacheslot* c = f->cur;
+        if (c == NULL || f->pos - c->tag >= c->len) {
+            c = io61_getslot(f, f->pos);
+        }
+        if (c != NULL) {
+            // the rest of the current block
+            view = &c->cbuf[f->pos - c->tag];
+            *len = c->len - (f->pos - c->tag);
+        }
+    } else if (f->map->localoffset < f->map->filesize) {
+        view = &f->map->mapped_file[f->map->localoffset];
+        *len = f->map->filesize - f->map->localoffset;
+    }
+    if (*len > max) {
+        *len = max;
+    }
+    if (f->map == NULL) {
+        f->pos += *len;
+    } else {
+        f->map->localoffset += *len;
+    }
+    return *len ? view : NULL;
 }
 
 
@@ -211,19 +510,15 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 //    Write a single character `ch` to `f`. Returns 0 on success or
 //    -1 on error.
 int io61_writec(io61_file* f, int ch) {
-    int ret = 0;
     // if write buffer is not full just append to buffer
-    if (writebuf.localoffset < SBUF_SZ) {
-        writebuf.cbuf[writebuf.localoffset] = ch;
-        ++writebuf.localoffset;
-    }
+    f->wbuf[f->wlen] = ch;
+    ++f->wlen;
     
     // if write buffer is full then write it to the file
-    if (writebuf.localoffset == SBUF_SZ) {
-        ret = io61_write(f, writebuf.cbuf, writebuf.localoffset);
-        writebuf.localoffset = 0;
+    if (f->wlen == f->wbuf_sz) {
+        return io61_queuebuf(f);
     }
-    return ret;
+    return 0;
 }
 
 
@@ -232,26 +527,176 @@ int io61_writec(io61_file* f, int ch) {
 //    characters written on success; normally this is `sz`. Returns -1 if
 //    an error occurred before any characters were written.
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
+    if (f->wb == NULL && f->wlen + sz >= f->wbuf_sz) {
+        // won't fit, write straight from buf
+        return io61_write_from(f, buf, sz);
+    }
+    // copy into buffers, queueing each as it fills
     size_t nwritten = 0;
     while (nwritten < sz) {
-        ssize_t r = write(f->fd, buf, sz);
-        if (r == -1) {
-            perror("write");
-            exit(1);
-        } else {
-            nwritten += r;
-            if (r != (ssize_t) sz) {    // didn't write enough
-                perror("write");
-                exit(1);
-            }
+        size_t n = f->wbuf_sz - f->wlen;
+        if (n > sz - nwritten) {
+            n = sz - nwritten;
+        }
+        memcpy(&f->wbuf[f->wlen], buf + nwritten, n);
+        f->wlen += n;
+        nwritten += n;
+        if (f->wlen == f->wbuf_sz && io61_queuebuf(f) == -1) {
+            return -1;
         }
     }
+    IO61_COUNT(f, ncopied, nwritten);
+    return nwritten;
+}
 
-    if (nwritten != 0 || sz == 0) {
-        return nwritten;
-    } else {
+
+// io61_write_from(f, buf, sz)
+//    Write `sz` characters from `buf` to `f` right away, without copying
+//    them into the write buffer. Characters already buffered go out
+//    first, in the same `writev`. Meant for large writes and for views
+//    from io61_read_view. Returns `sz` on success, or -1 on error.
+ssize_t io61_write_from(io61_file* f, const char* buf, size_t sz) {
+    // write-behind buffers go out first, to keep order
+    if (f->wb != NULL && io61_drain(f) == -1) {
         return -1;
     }
+    struct iovec iov[2];
+    iov[0].iov_base = f->wbuf;
+    iov[0].iov_len = f->wlen;
+    iov[1].iov_base = (char*) buf;
+    iov[1].iov_len = sz;
+    int r = iov[0].iov_len ? io61_writevall(f, &iov[0], 2)
+        : io61_writevall(f, &iov[1], 1);
+    f->wlen = 0;
+    return r == -1 ? -1 : (ssize_t) sz;
+}
+
+
+// io61_queuebuf(f)
+//    Write out the output buffer of `f`. With write-behind, the buffer is
+//    queued for the background thread, and writing goes on in the next
+//    buffer, waiting only if every buffer is queued. Returns 0 on 
+//    success, -1 on error.
+static int io61_queuebuf(io61_file* f) {
+    writebehind* wb = f->wb;
+    if (wb == NULL) {
+        struct iovec iov = {f->wbuf, f->wlen};
+        f->wlen = 0;
+        return io61_writevall(f, &iov, 1);
+    }
+    if (f->wlen == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&wb->lock);
+    int fill = (wb->head + wb->nqueued) % WB_NBUFS;
+    wb->lens[fill] = f->wlen;
+    ++wb->nqueued;
+    pthread_cond_broadcast(&wb->cond);
+    while (wb->nqueued == WB_NBUFS && !wb->error) {
+        pthread_cond_wait(&wb->cond, &wb->lock);
+    }
+    int error = wb->error;
+    f->wbuf = wb->bufs[(wb->head + wb->nqueued) % WB_NBUFS];
+    pthread_mutex_unlock(&wb->lock);
+    f->wlen = 0;
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_drain(f)
+//    Wait until the write-behind queue of `f` is written out. Returns 0 on
+//    success, -1 if a background write failed.
+static int io61_drain(io61_file* f) {
+    writebehind* wb = f->wb;
+    pthread_mutex_lock(&wb->lock);
+    while (wb->nqueued != 0 && !wb->error) {
+        pthread_cond_wait(&wb->cond, &wb->lock);
+    }
+    int error = wb->error;
+    pthread_mutex_unlock(&wb->lock);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_writebehind(arg)
+//    Body of the background thread of file `arg`. Writes every queued
+//    buffer with one writev, until told to stop. After an error, queued
+//    buffers are dropped.
+static void* io61_writebehind(void* arg) {
+    io61_file* f = (io61_file*) arg;
+    writebehind* wb = f->wb;
+    pthread_mutex_lock(&wb->lock);
+    while (1) {
+        while (wb->nqueued == 0 && !wb->stop) {
+            pthread_cond_wait(&wb->cond, &wb->lock);
+        }
+        if (wb->nqueued == 0) {
+            break;
+        }
+        int n = wb->nqueued;
+        struct iovec iov[WB_NBUFS];
+        for (int i = 0; i < n; i++) {
+            int b = (wb->head + i) % WB_NBUFS;
+            iov[i].iov_base = wb->bufs[b];
+            iov[i].iov_len = wb->lens[b];
+        }
+        int error = wb->error;
+        pthread_mutex_unlock(&wb->lock);
+
+        // the writer only touches the buffer after the queued ones
+        if (!error && io61_writevall(f, iov, n) == -1) {
+            error = errno;
+        }
+
+        pthread_mutex_lock(&wb->lock);
+        wb->head = (wb->head + n) % WB_NBUFS;
+        wb->nqueued -= n;
+        wb->error = error;
+        pthread_cond_broadcast(&wb->cond);
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return NULL;
+}
+
+
+// io61_writevall(f, iov, n)
+//    Write all `n` buffers of `iov` to the fd of `f`. Retries after EINTR,
+//    waits for the fd to be writable after EAGAIN, and resumes short
+//    writes, changing `iov` as it goes. Returns 0 on success, -1 on error.
+static int io61_writevall(io61_file* f, struct iovec* iov, int n) {
+    int fd = f->fd;
+    while (n > 0) {
+        IO61_COUNT(f, nwrite, 1);
+        ssize_t r = writev(fd, iov, n);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        } else if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            poll(&pfd, 1, -1);
+            continue;
+        } else if (r == -1) {
+            return -1;
+        }
+        // skip what was written, resuming a short write
+        while (n > 0 && (size_t) r >= iov->iov_len) {
+            r -= iov->iov_len;
+            ++iov;
+            --n;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*) iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+    return 0;
 }
 
 
@@ -260,12 +705,14 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
 //    If `f` was opened read-only, io61_flush(f) may either drop all
 //    data buffered for reading, or do nothing.
 int io61_flush(io61_file* f) {
-    (void) f;
-    int ret = 0;
+    if (f->mode != O_WRONLY) {
+        return 0;
+    }
     // if anything left in the write buffer, then flush it out
-    ret = io61_write(f, writebuf.cbuf, writebuf.localoffset);
-    writebuf.localoffset = 0;
-    return ret;
+    if (io61_queuebuf(f) == -1) {
+        return -1;
+    }
+    return f->wb != NULL ? io61_drain(f) : 0;
 }
 
 
@@ -274,35 +721,37 @@ int io61_flush(io61_file* f) {
 //    Returns 0 on success and -1 on failure.
 int io61_seek(io61_file* f, off_t pos) {
     if (f->mode == O_RDONLY) {        // do seek in readable file
-        if (mmaphead == NULL) {       // seeking in non-mappable file
-            if (pos >= readbuf.fileoffsetmin && pos <= readbuf.fileoffsetmax) {
-                // found pos in buffer, so move localoffset instead of lseek
-                readbuf.localoffset = pos - readbuf.fileoffsetmin;
+        if (f->map == NULL) {         // seeking in non-mappable file
+            f->cur = NULL;
+            // reads pread the block they need, so just move pos
+            if (f->seekable && pos >= 0) {
+                f->pos = pos;
                 return 0;
-            } else {
-                readbuf.fileoffsetmin = pos - (pos%SBUF_SZ);
-                readbuf.localoffset = pos - readbuf.fileoffsetmin;
-                readbuf.fileoffsetmax = -1;
-                // not in buffer, so do lseek, and update read cache
-                off_t r = lseek(f->fd, (off_t) readbuf.fileoffsetmin, SEEK_SET);
-                if (r == (off_t) readbuf.fileoffsetmin) {
-                    off_t bytes_read = io61_read(f, readbuf.cbuf, SBUF_SZ);
-                    readbuf.fileoffsetmax = readbuf.fileoffsetmin + bytes_read;
+            }
+            // a pipe can only move within its cached blocks
+            for (int i = 0; i < NSLOTS; i++) {
+                cacheslot* c = &f->slots[i];
+                if (c->tag != -1 && pos >= c->tag && pos <= c->tag + c->len) {
+                    f->pos = pos;
                     return 0;
                 }
             }
+            if (pos == f->stream_end) {
+                f->pos = pos;
+                return 0;
+            }
         } else {    // seeking in a mapped file, just return mapped pos
-			memmap* mptr = search_in_list(f->fd);
-			if (pos < mptr->filesize) {
-				mptr->localoffset = pos;
-				return 0;
-			} else {
-				return -1;
-			}
+            if (pos <= f->map->filesize) {
+                f->map->localoffset = pos;
+                return 0;
+            } else {
+                return -1;
+            }
         }
     } else {            // do seek in writable file
         io61_flush(f);  // flush write buffer before moving elsewhere
         off_t r = lseek(f->fd, (off_t) pos, SEEK_SET);
+        IO61_COUNT(f, nlseek, 1);
         if (r == (off_t) pos) {
             return 0;
         }
@@ -311,6 +760,86 @@ int io61_seek(io61_file* f, off_t pos) {
 }
 
 
+// io61_profile_begin()
+//    Start a profile: zero the counters of every open file, and note the
+//    time and resource usage.
+void io61_profile_begin(void) {
+    pthread_mutex_lock(&open_files_lock);
+    for (io61_file* f = open_files; f != NULL; f = f->next) {
+        memset(&f->stats, 0, sizeof(f->stats));
+    }
+    memset(&closed_stats, 0, sizeof(closed_stats));
+    pthread_mutex_unlock(&open_files_lock);
+    getrusage(RUSAGE_SELF, &profile_usage);
+    gettimeofday(&profile_time, NULL);
+}
+
+
+// io61_profile_end()
+//    End a profile, printing elapsed, user and system time and the 
+//    counters of each open file and of files closed since the profile
+//    began to stderr, as JSON.
+void io61_profile_end(void) {
+    struct timeval now;
+    struct rusage usage;
+    gettimeofday(&now, NULL);
+    getrusage(RUSAGE_SELF, &usage);
+    timersub(&now, &profile_time, &now);
+    timersub(&usage.ru_utime, &profile_usage.ru_utime, &usage.ru_utime);
+    timersub(&usage.ru_stime, &profile_usage.ru_stime, &usage.ru_stime);
+    fprintf(stderr, "{\"time\":%ld.%06ld, \"utime\":%ld.%06ld, "
+            "\"stime\":%ld.%06ld, \"files\":[",
+            (long) now.tv_sec, (long) now.tv_usec,
+            (long) usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec,
+            (long) usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec);
+    pthread_mutex_lock(&open_files_lock);
+    for (io61_file* f = open_files; f != NULL; f = f->next) {
+        fprintf(stderr, "%s{\"fd\":%d, \"mode\":\"%s\", ",
+                f == open_files ? "" : ", ", f->fd,
+                f->mode == O_RDONLY ? "r" : "w");
+        io61_printcounters(&f->stats);
+        fprintf(stderr, "}");
+    }
+    fprintf(stderr, "], \"closed\":{");
+    io61_printcounters(&closed_stats);
+    fprintf(stderr, "}}\n");
+    pthread_mutex_unlock(&open_files_lock);
+}
+
+
+// io61_profile_counters(f, c)
+//    Copy the profile counters of `f` into `c`.
+void io61_profile_counters(io61_file* f, io61_counters* c) {
+    memset(c, 0, sizeof(*c));
+    io61_addcounters(c, &f->stats);
+}
+
+
+// io61_addcounters(sum, c)
+//    Add counters `c` to `sum`.
+static void io61_addcounters(io61_counters* sum, const io61_counters* c) {
+    sum->nread += __atomic_load_n(&c->nread, __ATOMIC_RELAXED);
+    sum->nwrite += __atomic_load_n(&c->nwrite, __ATOMIC_RELAXED);
+    sum->nlseek += __atomic_load_n(&c->nlseek, __ATOMIC_RELAXED);
+    sum->nmmap += __atomic_load_n(&c->nmmap, __ATOMIC_RELAXED);
+    sum->hits += __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+    sum->misses += __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+    sum->nprefetch += __atomic_load_n(&c->nprefetch, __ATOMIC_RELAXED);
+    sum->ncopied += __atomic_load_n(&c->ncopied, __ATOMIC_RELAXED);
+}
+
+
+// io61_printcounters(c)
+//    Print counters `c` to stderr as JSON members.
+static void io61_printcounters(const io61_counters* c) {
+    fprintf(stderr, "\"read\":%llu, \"write\":%llu, \"lseek\":%llu, "
+            "\"mmap\":%llu, \"hits\":%llu, \"misses\":%llu, "
+            "\"prefetch\":%llu, \"copied\":%llu",
+            c->nread, c->nwrite, c->nlseek, c->nmmap, c->hits, c->misses,
+            c->nprefetch, c->ncopied);
+}
+
+
 // You shouldn't need to change these functions.
 
 // io61_open_check(filename, mode)
@@ -9,7 +9,27 @@
 
 typedef struct io61_file io61_file;
 
+// IO61_NOMMAP
+//    Or this into the mode of a readable file to read it through the read
+//    cache even when it could be memory-mapped.
+#define IO61_NOMMAP 0x40000000
+
+// io61_counters
+//    Profile counters of an io61_file, or of several added together.
+typedef struct io61_counters {
+    unsigned long long nread;       // # read and preadv syscalls
+    unsigned long long nwrite;      // # writev syscalls
+    unsigned long long nlseek;      // # lseek syscalls
+    unsigned long long nmmap;       // # mmap syscalls
+    unsigned long long hits;        // # block lookups found in read cache
+    unsigned long long misses;      // # block lookups read from the file
+    unsigned long long nprefetch;   // # blocks read ahead of a miss
+    unsigned long long ncopied;     // # bytes copied to or from callers
+} io61_counters;
+
 io61_file* io61_fdopen(int fd, int mode);
+io61_file* io61_fdopen_buffered(int fd, int mode, size_t bufsz,
+                                int write_behind);
 io61_file* io61_open_check(const char* filename, int mode);
 int io61_close(io61_file* f);
 
@@ -23,10 +43,14 @@ int io61_writec(io61_file* f, int ch);
 ssize_t io61_read(io61_file* f, char* buf, size_t sz);
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz);
 
+const char* io61_read_view(io61_file* f, size_t max, size_t* len);
+ssize_t io61_write_from(io61_file* f, const char* buf, size_t sz);
+
 int io61_eof(io61_file* f);
 int io61_flush(io61_file* f);
 
 void io61_profile_begin(void);
 void io61_profile_end(void);
+void io61_profile_counters(io61_file* f, io61_counters* c);
 
 #endif
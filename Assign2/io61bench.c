@@ -0,0 +1,345 @@
+#include "io61.h"
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+// io61bench [-p] [-s MB] [-i INFILE] [-o OUTFILE]
+//    Run standard access patterns against io61 and stdio with several
+//    output buffer sizes, and print a table of throughput and, for io61,
+//    syscalls and cache behavior. Input streams use each library's own
+//    buffering, since io61 sizes its read cache itself; the block
+//    pattern reads in chunks of the output buffer size, and the -cache
+//    patterns seek through io61's read cache instead of mmap. With -p, each
+//    io61 run's profile is also printed to stderr. INFILE is created
+//    with SIZE MB of data if it does not exist.
+
+#define NRANDOM_SZ 512        // # bytes per random seek read
+
+static const size_t bufsizes[] = {4096, 65536, 1 << 20};
+#define NBUFSIZES (sizeof(bufsizes) / sizeof(bufsizes[0]))
+
+// bench_stream
+//    An input or output stream of either implementation.
+typedef struct bench_stream {
+    FILE* sf;                 // stdio stream, or NULL
+    io61_file* f;             // io61 file, or NULL
+    char* sbuf;               // stdio buffer
+} bench_stream;
+
+// bench_impl
+//    An implementation under test.
+typedef struct bench_impl {
+    const char* name;
+    int io61;                 // use io61, else stdio
+    int write_behind;         // io61 write-behind output
+} bench_impl;
+
+static const bench_impl impls[] = {
+    {"stdio", 0, 0}, {"io61", 1, 0}, {"io61-wb", 1, 1}
+};
+#define NIMPLS (sizeof(impls) / sizeof(impls[0]))
+
+
+// bench_open(impl, fd, mode, bufsz)
+//    Return a stream of `impl` on `fd`. An output stream buffers `bufsz`
+//    bytes; an input stream uses the library's default buffering.
+//    IO61_NOMMAP in `mode` is passed to io61 and ignored by stdio.
+static bench_stream bench_open(const bench_impl* impl, int fd, int mode,
+                               size_t bufsz) {
+    bench_stream s = {NULL, NULL, NULL};
+    int rdonly = (mode & O_ACCMODE) == O_RDONLY;
+    if (impl->io61 && rdonly) {
+        s.f = io61_fdopen(fd, mode);
+    } else if (impl->io61) {
+        s.f = io61_fdopen_buffered(fd, mode, bufsz, impl->write_behind);
+    } else if (rdonly) {
+        s.sf = fdopen(fd, "r");
+    } else {
+        s.sf = fdopen(fd, "w");
+        s.sbuf = (char*) malloc(bufsz);
+        setvbuf(s.sf, s.sbuf, _IOFBF, bufsz);
+    }
+    return s;
+}
+
+// bench_close(s)
+//    Close stream `s`.
+static void bench_close(bench_stream* s) {
+    if (s->f) {
+        io61_close(s->f);
+    } else {
+        fclose(s->sf);
+        free(s->sbuf);
+    }
+}
+
+static inline int bench_readc(bench_stream* s) {
+    return s->f ? io61_readc(s->f) : getc(s->sf);
+}
+
+static inline void bench_writec(bench_stream* s, int ch) {
+    if (s->f) {
+        io61_writec(s->f, ch);
+    } else {
+        putc(ch, s->sf);
+    }
+}
+
+static ssize_t bench_read(bench_stream* s, char* buf, size_t sz) {
+    return s->f ? io61_read(s->f, buf, sz)
+        : (ssize_t) fread(buf, 1, sz, s->sf);
+}
+
+static void bench_write(bench_stream* s, const char* buf, size_t sz) {
+    if (s->f) {
+        io61_write(s->f, buf, sz);
+    } else {
+        fwrite(buf, 1, sz, s->sf);
+    }
+}
+
+static void bench_seek(bench_stream* s, off_t pos) {
+    if (s->f) {
+        io61_seek(s->f, pos);
+    } else {
+        fseeko(s->sf, pos, SEEK_SET);
+    }
+}
+
+
+// pattern functions copy `in` to `out`, `insize` bytes long, in some
+// access order, and return the number of bytes copied
+
+static size_t pattern_byte(bench_stream* in, bench_stream* out,
+                           off_t insize, size_t bufsz) {
+    (void) insize, (void) bufsz;
+    size_t n = 0;
+    int ch;
+    while ((ch = bench_readc(in)) != EOF) {
+        bench_writec(out, ch);
+        ++n;
+    }
+    return n;
+}
+
+static size_t pattern_block(bench_stream* in, bench_stream* out,
+                            off_t insize, size_t bufsz) {
+    (void) insize;
+    char* buf = (char*) malloc(bufsz);
+    size_t n = 0;
+    ssize_t r;
+    while ((r = bench_read(in, buf, bufsz)) > 0) {
+        bench_write(out, buf, r);
+        n += r;
+    }
+    free(buf);
+    return n;
+}
+
+static size_t pattern_reverse(bench_stream* in, bench_stream* out,
+                              off_t insize, size_t bufsz) {
+    (void) bufsz;
+    for (off_t pos = insize - 1; pos >= 0; --pos) {
+        bench_seek(in, pos);
+        bench_writec(out, bench_readc(in));
+    }
+    return insize;
+}
+
+static size_t pattern_random(bench_stream* in, bench_stream* out,
+                             off_t insize, size_t bufsz) {
+    (void) bufsz;
+    char buf[NRANDOM_SZ];
+    size_t nblocks = insize / NRANDOM_SZ, n = 0;
+    unsigned seed = 61;
+    for (size_t i = 0; i < nblocks; ++i) {
+        seed = seed * 1103515245 + 12345;
+        bench_seek(in, (off_t) ((seed >> 4) % nblocks) * NRANDOM_SZ);
+        ssize_t r = bench_read(in, buf, NRANDOM_SZ);
+        if (r > 0) {
+            bench_write(out, buf, r);
+            n += r;
+        }
+    }
+    return n;
+}
+
+// bench_pattern
+//    An access pattern. Pipe patterns read the input through a pipe;
+//    nommap patterns read it through io61's read cache, not mmap.
+typedef struct bench_pattern {
+    const char* name;
+    size_t (*run)(bench_stream*, bench_stream*, off_t, size_t);
+    int pipe_input;
+    int nommap;
+} bench_pattern;
+
+static const bench_pattern patterns[] = {
+    {"byte", pattern_byte, 0, 0},
+    {"block", pattern_block, 0, 0},
+    {"reverse", pattern_reverse, 0, 0},
+    {"random", pattern_random, 0, 0},
+    {"reverse-cache", pattern_reverse, 0, 1},
+    {"random-cache", pattern_random, 0, 1},
+    {"pipe", pattern_byte, 1, 0}
+};
+#define NPATTERNS (sizeof(patterns) / sizeof(patterns[0]))
+
+
+// open_pipe_input(path)
+//    Return the read end of a pipe fed the contents of `path` by a child.
+static int open_pipe_input(const char* path, pid_t* child) {
+    int pfd[2];
+    if (pipe(pfd) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    *child = fork();
+    if (*child == 0) {
+        close(pfd[0]);
+        int fd = open(path, O_RDONLY);
+        char buf[65536];
+        ssize_t r;
+        while ((r = read(fd, buf, sizeof(buf))) > 0) {
+            if (write(pfd[1], buf, r) != r) {
+                _exit(1);
+            }
+        }
+        _exit(0);
+    }
+    close(pfd[1]);
+    return pfd[0];
+}
+
+// make_input(path, size)
+//    Create `path` with `size` bytes of text, unless it exists.
+static void make_input(const char* path, off_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd == -1 && errno == EEXIST) {
+        return;
+    } else if (fd == -1) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    char buf[65536];
+    unsigned seed = 1;
+    for (off_t n = 0; n < size; n += sizeof(buf)) {
+        for (size_t i = 0; i < sizeof(buf); ++i) {
+            seed = seed * 1103515245 + 12345;
+            buf[i] = (seed >> 16) % 27 ? 'a' + (seed >> 16) % 26 : '\n';
+        }
+        size_t sz = size - n < (off_t) sizeof(buf) ? (size_t) (size - n)
+            : sizeof(buf);
+        if (write(fd, buf, sz) != (ssize_t) sz) {
+            perror("write");
+            exit(1);
+        }
+    }
+    close(fd);
+}
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: io61bench [-p] [-s MB] [-i INFILE] [-o OUTFILE]\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    const char* inpath = "/tmp/io61bench.in";
+    const char* outpath = "/tmp/io61bench.out";
+    off_t size = 8 << 20;
+    int profile = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "ps:i:o:")) != -1) {
+        if (opt == 'p') {
+            profile = 1;
+        } else if (opt == 's') {
+            size = (off_t) strtol(optarg, NULL, 0) << 20;
+        } else if (opt == 'i') {
+            inpath = optarg;
+        } else if (opt == 'o') {
+            outpath = optarg;
+        } else {
+            usage();
+        }
+    }
+    if (optind != argc || size <= 0) {
+        usage();
+    }
+    make_input(inpath, size);
+
+    printf("%-13s %-8s %8s %9s %6s %8s %8s %8s %8s %8s\n", "pattern", "impl",
+           "outbuf", "MB/s", "mmaps", "reads", "writes", "lseeks", "hits",
+           "misses");
+    for (size_t p = 0; p < NPATTERNS; ++p) {
+        for (size_t b = 0; b < NBUFSIZES; ++b) {
+            for (size_t i = 0; i < NIMPLS; ++i) {
+                const bench_pattern* pat = &patterns[p];
+                if (impls[i].io61) {
+                    // count from before the streams are opened
+                    io61_profile_begin();
+                }
+                pid_t child = -1;
+                int infd = pat->pipe_input ? open_pipe_input(inpath, &child)
+                    : open(inpath, O_RDONLY);
+                int outfd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if (infd == -1 || outfd == -1) {
+                    perror("open");
+                    exit(1);
+                }
+                bench_stream in = bench_open(&impls[i], infd,
+                                             O_RDONLY | (pat->nommap
+                                                 ? IO61_NOMMAP : 0),
+                                             bufsizes[b]);
+                bench_stream out = bench_open(&impls[i], outfd, O_WRONLY,
+                                              bufsizes[b]);
+                off_t insize = size;
+                if (!pat->pipe_input) {
+                    struct stat st;
+                    fstat(infd, &st);
+                    insize = st.st_size;
+                }
+
+                double start = now();
+                size_t n = pat->run(&in, &out, insize, bufsizes[b]);
+                io61_counters ic, oc;
+                if (in.f) {
+                    io61_profile_counters(in.f, &ic);
+                    io61_flush(out.f);
+                    io61_profile_counters(out.f, &oc);
+                }
+                bench_close(&out);
+                double elapsed = now() - start;
+                bench_close(&in);
+                if (child > 0) {
+                    waitpid(child, NULL, 0);
+                }
+                if (profile && in.f) {
+                    fprintf(stderr, "%s %s %zu: ", pat->name, impls[i].name,
+                            bufsizes[b]);
+                    io61_profile_end();
+                }
+
+                printf("%-13s %-8s %8zu %9.1f", pat->name, impls[i].name,
+                       bufsizes[b], n / elapsed / (1 << 20));
+                if (in.f) {
+                    printf(" %6llu %8llu %8llu %8llu %8llu %8llu\n",
+                           ic.nmmap + oc.nmmap, ic.nread + oc.nread,
+                           ic.nwrite + oc.nwrite, ic.nlseek + oc.nlseek,
+                           ic.hits, ic.misses);
+                } else {
+                    printf(" %6s %8s %8s %8s %8s %8s\n",
+                           "-", "-", "-", "-", "-", "-");
+                }
+                fflush(stdout);
+            }
+        }
+    }
+    return 0;
+}
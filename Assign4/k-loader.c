@@ -34,13 +34,33 @@ struct ramimage {
     { _binary_obj_p_forkexit_start, _binary_obj_p_forkexit_end }
 };
 
-static int copyseg(proc* p, const elf_program* ph, const uint8_t* src);
+// DEMAND PAGING
+//
+//    program_load maps nothing. Each page of a loadable segment is filled
+//    from the ramimage (or zeroed, past the segment's file data) the first
+//    time the process touches it, when the INT_PAGEFAULT handler calls
+//    program_fault. Read-only pages are shared: a process faulting on one
+//    maps the page of any other process running the same program that has
+//    already loaded it, and takes a reference to it.
+
+#ifndef PTE_COW
+#define PTE_COW 0x200
+#endif
+
+static int proc_program[NPROC];         // program number of each process
+static proc* proc_of[NPROC];            // process of each pid with a program
+
+// in kernel.c
+void* alloc_free_page(int8_t owner);
+void page_addref(int pn, proc* p);
+
+static int loadpage(proc* p, const elf_program* ph, const uint8_t* src,
+                    uintptr_t va);
 
 // program_load(p, program_id)
-//    Load the code corresponding to program `programnumber` into the process
-//    `p` and set `p->p_registers.reg_eip` to its entry point. Calls
-//    `physical_page_alloc` to allocate virtual memory for `p` as required.
-//    Returns 0 on success and -1 on failure (e.g. out-of-memory).
+//    Set up process `p` to run program `program_id`, loading its code
+//    on demand, and set `p->p_registers.reg_eip` to its entry point.
+//    Returns 0 on success and -1 on failure.
 int program_load(proc* p, int program_id) {
     // is this a valid program?
     int nprograms = sizeof(ramimages) / sizeof(ramimages[0]);
@@ -48,12 +68,8 @@ int program_load(proc* p, int program_id) {
     elf_header* eh = (elf_header*) ramimages[program_id].begin;
     assert(eh->e_magic == ELF_MAGIC);
 
-    // load each loadable program segment into memory
-    elf_program* ph = (elf_program*) ((const uint8_t*) eh + eh->e_phoff);
-    for (int i = 0; i < eh->e_phnum; ++i)
-        if (ph[i].p_type == ELF_PTYPE_LOAD)
-            if (copyseg(p, &ph[i], (const uint8_t*) eh + ph[i].p_offset) < 0)
-                return -1;
+    proc_program[p->p_pid] = program_id;
+    proc_of[p->p_pid] = p;
 
     // set the entry point from the ELF header
     p->p_registers.reg_eip = eh->e_entry;
@@ -61,35 +77,82 @@ int program_load(proc* p, int program_id) {
 }
 
 
-// copyseg(p, ph, src)
-//    Load an ELF segment at virtual address `ph->p_va` in process `p`. Copies
-//    `[src, src + ph->p_filesz)` to `dst`, then clears
-//    `[ph->p_va + ph->p_filesz, ph->p_va + ph->p_memsz)` to 0.
-//    Calls `physical_page_alloc` to allocate pages and `virtual_memory_map`
-//    to map them in `p->p_pagetable`. Returns 0 on success and -1 on failure.
-static int copyseg(proc* p, const elf_program* ph, const uint8_t* src) {
-    uintptr_t va = (uintptr_t) ph->p_va;
-    uintptr_t end_file = va + ph->p_filesz, end_mem = va + ph->p_memsz;
-    va &= ~(PAGESIZE - 1);              // round to page boundary
-
-    // allocate memory
-    for (uintptr_t page_va = va; page_va < end_mem; page_va += PAGESIZE) {
-        if (physical_page_alloc(page_va, p->p_pid) < 0)
-            return -1;
-        virtual_memory_map(p->p_pagetable, page_va, page_va,
-                           PAGESIZE, PTE_P|PTE_W|PTE_U);
+// program_fork(child, parent)
+//    Record that `child`, forked from `parent`, runs the same program, so
+//    it can load pages its parent has not touched yet.
+void program_fork(proc* child, proc* parent) {
+    proc_program[child->p_pid] = proc_program[parent->p_pid];
+    proc_of[child->p_pid] = child;
+}
+
+
+// program_fault(p, va)
+//    Handle a fault by `p` on the not-present page at `va`. If `va` lies
+//    in a loadable segment of `p`'s program, map the page, shared if it is
+//    read-only and another process running the program has it, else
+//    loaded from the ramimage. Returns 0 on success and -1 if `va` is not
+//    in a segment or there is no free memory.
+int program_fault(proc* p, uintptr_t va) {
+    if (proc_of[p->p_pid] != p) {
+        return -1;
     }
-    // ensure new memory mappings are active
-    lcr3((uintptr_t) p->p_pagetable);
-
-    memcpy((uint8_t*) va, src, end_file - va);
-    memset((uint8_t*) end_file, 0, end_mem - end_file);
-	// map read-only program segements as read-only for applications
-	for (uintptr_t page_va = va; page_va < end_mem; page_va += PAGESIZE) {
-        if ((ph->p_flags & ELF_PFLAG_WRITE) == 0) {
-        virtual_memory_map(p->p_pagetable, page_va, page_va,
-                           PAGESIZE, PTE_P|PTE_U);
-		}
+    int program_id = proc_program[p->p_pid];
+    elf_header* eh = (elf_header*) ramimages[program_id].begin;
+    elf_program* ph = (elf_program*) ((const uint8_t*) eh + eh->e_phoff);
+    va &= ~(PAGESIZE - 1);
+
+    for (int i = 0; i < eh->e_phnum; ++i) {
+        uintptr_t start = ph[i].p_va & ~(PAGESIZE - 1);
+        if (ph[i].p_type != ELF_PTYPE_LOAD
+            || va < start || va >= ph[i].p_va + ph[i].p_memsz)
+            continue;
+
+        if ((ph[i].p_flags & ELF_PFLAG_WRITE) == 0) {
+            // share the page of another process running this program
+            for (pid_t pid = 1; pid < NPROC; ++pid) {
+                proc* q = proc_of[pid];
+                if (pid == p->p_pid || q == NULL || q->p_state == P_FREE
+                    || proc_program[pid] != program_id)
+                    continue;
+                vamapping vam = virtual_memory_lookup(q->p_pagetable, va);
+                if (vam.pn >= 0 && (vam.perm & (PTE_W | PTE_COW)) == 0) {
+                    virtual_memory_map(p->p_pagetable, va, vam.pa,
+                                       PAGESIZE, PTE_P|PTE_U);
+                    page_addref(vam.pn, p);
+                    return 0;
+                }
+            }
+        }
+        return loadpage(p, &ph[i], (const uint8_t*) eh + ph[i].p_offset, va);
     }
+    return -1;
+}
+
+
+// loadpage(p, ph, src, va)
+//    Load the page at `va` of ELF segment `ph` into process `p`. Copies
+//    the part of `[src, src + ph->p_filesz)` that falls in the page to a
+//    new physical page, clears the rest to 0, and maps it at `va`, which
+//    is read-only for the application unless the segment is writable.
+//    Returns 0 on success and -1 on failure.
+static int loadpage(proc* p, const elf_program* ph, const uint8_t* src,
+                    uintptr_t va) {
+    uint8_t* page = (uint8_t*) alloc_free_page(p->p_pid);
+    if (page == NULL)
+        return -1;
+
+    // page bytes [copy_start, copy_end) come from the file
+    uintptr_t end_file = ph->p_va + ph->p_filesz;
+    uintptr_t copy_start = va < ph->p_va ? ph->p_va : va;
+    uintptr_t copy_end = va + PAGESIZE < end_file ? va + PAGESIZE : end_file;
+    memset(page, 0, PAGESIZE);
+    if (copy_start < copy_end)
+        memcpy(page + (copy_start - va), src + (copy_start - ph->p_va),
+               copy_end - copy_start);
+
+    int perm = PTE_P|PTE_U;
+    if (ph->p_flags & ELF_PFLAG_WRITE)
+        perm |= PTE_W;
+    virtual_memory_map(p->p_pagetable, va, (uintptr_t) page, PAGESIZE, perm);
     return 0;
-}
\ No newline at end of file
+}
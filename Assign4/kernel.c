@@ -32,6 +32,39 @@ void schedule(void);
 void run(proc* p) __attribute__((noreturn));
 
 
+// RUN QUEUE
+//
+//    Runnable processes other than `current` wait in a FIFO run queue,
+//    linked through runq_next[] (0 ends the list, as process 0 is never
+//    used), so schedule() picks the next process in O(1).
+//
+//    Scheduling is weighted round robin. A process runs for
+//    `proc_priority[pid]` timeslices of TIMESLICE_MS each, rounded to
+//    timer ticks, before the timer preempts it, so a process's share of
+//    the CPU grows with its priority and no runnable process starves.
+//    INT_SYS_PRIORITY sets the priority of the calling process.
+
+#define TIMESLICE_MS 10         // length of a timeslice (milliseconds)
+#define TIMESLICE_TICKS \
+    (TIMESLICE_MS * HZ >= 1000 ? TIMESLICE_MS * HZ / 1000 : 1)
+
+#define PRIO_MIN 1              // lowest priority, one timeslice
+#define PRIO_MAX 8              // highest priority
+#define PRIO_DEFAULT PRIO_MIN
+
+#ifndef INT_SYS_PRIORITY
+#define INT_SYS_PRIORITY (INT_SYS + 6)
+#endif
+
+static pid_t runq_head, runq_tail;
+static pid_t runq_next[NPROC];
+static int proc_priority[NPROC];
+static unsigned slice_ticks;    // # ticks left in current's timeslices
+
+static void runq_push(proc* p);
+static proc* runq_pop(void);
+
+
 // PAGEINFO
 //
 //    The pageinfo[] array keeps track of information about each physical page.
@@ -47,14 +80,22 @@ void run(proc* p) __attribute__((noreturn));
 //    pageinfo[pn].owner is a constant indicating who owns the page.
 //      PO_KERNEL means the kernel, PO_RESERVED means reserved memory (such
 //      as the console), and a number >=0 means that process ID.
+//    pageinfo[pn].sharers has bit `pid` set for each process that maps
+//      page `pn`, including the owner. It is the reverse map used to hand
+//      a shared page to another process, without scanning page tables.
 //
 //    pageinfo_init() sets up the initial pageinfo[] state.
 
 typedef struct physical_pageinfo {
     int8_t owner;
     int8_t refcount;
+    uint32_t sharers;
 } physical_pageinfo;
 
+#if NPROC > 32
+#error "pageinfo sharers bitmask holds at most 32 processes"
+#endif
+
 static physical_pageinfo pageinfo[PAGENUMBER(MEMSIZE_PHYSICAL)];
 
 typedef enum pageowner {
@@ -64,22 +105,97 @@ typedef enum pageowner {
 } pageowner_t;
 
 static void pageinfo_init(void);
+void page_addref(int pn, proc* p);
+static void page_decref(int pn, proc* p);
+
+// PTE_COW marks a page shared copy-on-write after fork. It is a software
+// bit ignored by the MMU. Such pages are mapped read-only; the first write
+// faults, and the INT_PAGEFAULT handler gives the writer its own copy.
+#ifndef PTE_COW
+#define PTE_COW 0x200
+#endif
+
+
+// FREE PAGE MAP
+//
+//    free_pagemap[] has one bit per physical page, set when the page's
+//    refcount is 0. free_pagemap_summary[] has one bit per word of
+//    free_pagemap[], set when that word has any free page. So the lowest
+//    free page is found with two count-trailing-zeros, however full memory
+//    is. page_markfree() keeps both levels in sync, and is called wherever
+//    a refcount changes to or from 0.
+
+#define FREEMAP_NWORDS ((NPAGES + 31) / 32)
+#define FREEMAP_NSUMMARY ((FREEMAP_NWORDS + 31) / 32)
+
+static uint32_t free_pagemap[FREEMAP_NWORDS];
+static uint32_t free_pagemap_summary[FREEMAP_NSUMMARY];
+
+static void page_markfree(int pn, int isfree);
+
+
+// DEBUG CHECKS
+//
+//    exception() runs virtual_memory_check() and redraws the memory map
+//    every `debug_interval` timer ticks. DEBUG_ALWAYS runs them on every
+//    exception, and 0 never. The boot command option `debug=always`,
+//    `debug=off` or `debug=N` sets the interval, and DEBUG_INTERVAL sets
+//    its default at build time.
+//
+//    memshow_dirty[] has one bit per physical page whose pageinfo changed
+//    since it was last drawn, so memshow_physical() redraws just those.
+//    memshow_generation counts pageinfo changes, so the virtual map is
+//    redrawn only when it may have changed.
+
+#define DEBUG_ALWAYS -1
+#ifndef DEBUG_INTERVAL
+#define DEBUG_INTERVAL DEBUG_ALWAYS
+#endif
+
+static int debug_interval = DEBUG_INTERVAL;
+static unsigned debug_last_ticks;       // `ticks` at the last check
+static uint32_t memshow_dirty[FREEMAP_NWORDS];
+static unsigned memshow_generation;
+
+static void page_dirty(int pn);
+static const char* command_option(const char* command, const char* name);
+static int command_is(const char* command, const char* name);
+
+
+// PROCESS PAGE MAPS
+//
+//    proc_pagemap[pid] has one bit per physical page process `pid` holds a
+//    reference to: the pages it maps and its page-table pages. It is the
+//    transpose of pageinfo[].sharers, kept by physical_page_alloc,
+//    page_addref and page_decref, so exit visits just those pages.
+
+static uint32_t proc_pagemap[NPROC][FREEMAP_NWORDS];
+
+#define PROC_PAGEMAP_SET(pid, pn) \
+    (proc_pagemap[(pid)][(pn) / 32] |= 1U << ((pn) % 32))
+#define PROC_PAGEMAP_CLEAR(pid, pn) \
+    (proc_pagemap[(pid)][(pn) / 32] &= ~(1U << ((pn) % 32)))
 
 
 // Memory functions
 void virtual_memory_check(void);
 void memshow_physical(void);
+static void memshow_physical_page(int pn);
 void memshow_virtual(x86_pagetable* pagetable, const char* name);
 void memshow_virtual_animate(void);
 
 static void process_setup(pid_t pid, int program_number);
 static pid_t find_free_process_slot(void);
-static void* alloc_free_page(int8_t owner);
+void* alloc_free_page(int8_t owner);
 static void* find_free_physical_page(void);
 static x86_pagetable *copy_pagetable(x86_pagetable* pagetable, int8_t owner);
-static pid_t find_page_owner(int pagenum);
 static void free_current_process(proc *p);
 static int fork_process(void);
+static int copy_on_write(proc* p, uintptr_t va);
+
+// in k-loader.c
+int program_fault(proc* p, uintptr_t va);
+void program_fork(proc* child, proc* parent);
 
 
 // kernel(command)
@@ -104,9 +220,21 @@ void kernel(const char* command) {
     virtual_memory_map(kernel_pagetable,(uintptr_t)console,(uintptr_t)console,
         PAGESIZE, PTE_P|PTE_W|PTE_U);
 
-    if (command && strcmp(command, "fork") == 0) {
+    const char* debug = command_option(command, "debug");
+    if (debug && strcmp(debug, "always") == 0) {
+        debug_interval = DEBUG_ALWAYS;
+    } else if (debug && strcmp(debug, "off") == 0) {
+        debug_interval = 0;
+    } else if (debug) {
+        debug_interval = 0;
+        for (; *debug >= '0' && *debug <= '9'; ++debug) {
+            debug_interval = debug_interval * 10 + *debug - '0';
+        }
+    }
+
+    if (command_is(command, "fork")) {
         process_setup(1, 4);
-    } else if (command && strcmp(command, "forkexit") == 0) {
+    } else if (command_is(command, "forkexit")) {
         process_setup(1, 5);
     } else {
         for (pid_t i = 1; i <= 4; ++i) {
@@ -115,7 +243,40 @@ void kernel(const char* command) {
     }
 
     // Switch to the first process using run()
-    run(&processes[1]);
+    run(runq_pop());
+}
+
+
+// command_is(command, name)
+//    Returns 1 if the first word of the boot command `command` is `name`.
+int command_is(const char* command, const char* name) {
+    size_t len = strlen(name);
+    return command && strncmp(command, name, len) == 0
+        && (command[len] == '\0' || command[len] == ' ');
+}
+
+
+// command_option(command, name)
+//    Returns the value of option `name=VALUE` among the words of the boot
+//    command `command` after the first, or NULL if it is not given. The
+//    value ends at the end of its word.
+const char* command_option(const char* command, const char* name) {
+    static char value[16];
+    size_t len = strlen(name);
+    for (const char* s = command ? strchr(command, ' ') : NULL; s;
+         s = strchr(s, ' ')) {
+        ++s;
+        if (strncmp(s, name, len) == 0 && s[len] == '=') {
+            size_t n = 0;
+            for (s += len + 1; s[n] && s[n] != ' ' && n + 1 < sizeof(value);
+                 ++n) {
+                value[n] = s[n];
+            }
+            value[n] = '\0';
+            return value;
+        }
+    }
+    return NULL;
 }
 
 
@@ -151,18 +312,45 @@ void* alloc_free_page(int8_t owner) {
 
 
 // void* find_free_physical_page(void)
-//    searches for a free physical page, if found it returns the
-//    address. If none available it returns NULL
+//    returns the address of the lowest free physical page, found from
+//    the free page map. If none available it returns NULL
 void* find_free_physical_page(void) {
-    for (int i = 0; i < NPAGES; ++i) {
-        if(pageinfo[i].owner == 0 && pageinfo[i].refcount == 0) {
-            return (void*)PAGEADDRESS(i);
+    for (int s = 0; s < FREEMAP_NSUMMARY; ++s) {
+        if (free_pagemap_summary[s] != 0) {
+            int w = s * 32 + __builtin_ctz(free_pagemap_summary[s]);
+            int pn = w * 32 + __builtin_ctz(free_pagemap[w]);
+            return (void*)PAGEADDRESS(pn);
         }
     }
     return NULL;
 }
 
 
+// page_dirty(pn)
+//    Records that physical page `pn` must be redrawn in the memory map.
+void page_dirty(int pn) {
+    memshow_dirty[pn / 32] |= 1U << (pn % 32);
+    ++memshow_generation;
+}
+
+
+// page_markfree(pn, isfree)
+//    Records in the free page map whether physical page `pn` is free.
+void page_markfree(int pn, int isfree) {
+    uint32_t bit = 1U << (pn % 32);
+    uint32_t word_bit = 1U << ((pn / 32) % 32);
+    if (isfree) {
+        free_pagemap[pn / 32] |= bit;
+        free_pagemap_summary[pn / 1024] |= word_bit;
+    } else {
+        free_pagemap[pn / 32] &= ~bit;
+        if (free_pagemap[pn / 32] == 0) {
+            free_pagemap_summary[pn / 1024] &= ~word_bit;
+        }
+    }
+}
+
+
 // x86_pagetable *copy_pagetable(x86_pagetable* pagetable, int8_t owner)
 //    allocates and returns a new page table, initialized as a copy 
 //    of pagetable.
@@ -177,6 +365,7 @@ x86_pagetable *copy_pagetable(x86_pagetable* pagetable, int8_t owner) {
     // find and allocate page address for new l2table
     void* pgtl2_addr = alloc_free_page(owner);
     if (pgtl2_addr == NULL) {
+        page_decref(PAGENUMBER(pgtl1_addr), &processes[owner]);
         return NULL;
     }
     x86_pagetable *pgtl2 = (x86_pagetable *)pgtl2_addr;
@@ -200,7 +389,7 @@ x86_pagetable *copy_pagetable(x86_pagetable* pagetable, int8_t owner) {
 
 // process_setup(pid, program_number)
 //    Load application program `program_number` as process number `pid`.
-//    This loads the application's code and data into memory, sets its
+//    This sets up the application's code and data to load on demand, sets its
 //    %eip and %esp, gives it a stack page, and marks it as runnable.
 void process_setup(pid_t pid, int program_number) {
     process_init(&processes[pid], 0);
@@ -216,14 +405,16 @@ void process_setup(pid_t pid, int program_number) {
     virtual_memory_map(processes[pid].p_pagetable, processes[pid].p_registers.reg_esp - PAGESIZE,
         stack_page, PAGESIZE, PTE_P|PTE_W|PTE_U);
     
+    proc_priority[pid] = PRIO_DEFAULT;
     processes[pid].p_state = P_RUNNABLE;
+    runq_push(&processes[pid]);
 }
 
 
 // physical_page_alloc(addr, owner)
 //    Allocates the page with physical address `addr` to the given owner.
 //    Fails if physical page `addr` was already allocated. Returns 0 on
-//    success and -1 on failure. Used by the program loader.
+//    success and -1 on failure. Used by alloc_free_page.
 int physical_page_alloc(uintptr_t addr, int8_t owner) {
     if ((addr & 0xFFF) != 0
         || addr >= MEMSIZE_PHYSICAL
@@ -232,79 +423,84 @@ int physical_page_alloc(uintptr_t addr, int8_t owner) {
     else {
         pageinfo[PAGENUMBER(addr)].refcount = 1;
         pageinfo[PAGENUMBER(addr)].owner = owner;
+        pageinfo[PAGENUMBER(addr)].sharers = owner > 0 ? 1U << owner : 0;
+        page_dirty(PAGENUMBER(addr));
+        if (owner > 0) {
+            PROC_PAGEMAP_SET(owner, PAGENUMBER(addr));
+        }
+        page_markfree(PAGENUMBER(addr), 0);
         return 0;
     }
 }
 
 
-// pid_t find_page_owner(void)
-//    looks for references to page, to find an owner
-pid_t find_page_owner(int pagenum) {
-    for (int pid = 1; pid < NPROC; ++pid) {
-        if (processes[pid].p_state == P_RUNNABLE) {
-            proc *p = &processes[pid];
-            // search virtual mappings for a ref to physical page
-            for (int k = 0; k < NPAGES; ++k) {
-                vamapping vam = virtual_memory_lookup(p->p_pagetable,
-                        PAGEADDRESS(k));
-                if (vam.pa == PAGEADDRESS(pagenum)) {
-                    // found another ref to page, set proc as owner
-                    return pid;
-                }
-            }
+// page_addref(pn, p)
+//    adds a reference by process `p` to physical page `pn`, which must
+//    be in use.
+void page_addref(int pn, proc* p) {
+    assert(pageinfo[pn].refcount > 0);
+    ++pageinfo[pn].refcount;
+    page_dirty(pn);
+    pageinfo[pn].sharers |= 1U << p->p_pid;
+    PROC_PAGEMAP_SET(p->p_pid, pn);
+}
+
+
+// page_decref(pn, p)
+//    drops a reference by process `p` to physical page `pn`. Frees the
+//    page if that was the last reference; otherwise, if `p` owned the
+//    page, hands it to another process in its sharers set. Processes
+//    never map one page at two addresses, so `p` no longer shares it.
+void page_decref(int pn, proc* p) {
+    assert(pageinfo[pn].refcount > 0);
+    pageinfo[pn].sharers &= ~(1U << p->p_pid);
+    PROC_PAGEMAP_CLEAR(p->p_pid, pn);
+    page_dirty(pn);
+    if (--pageinfo[pn].refcount == 0) {
+        pageinfo[pn].owner = PO_FREE;
+        pageinfo[pn].sharers = 0;
+        page_markfree(pn, 1);
+    } else if (pageinfo[pn].owner == p->p_pid) {
+        if (pageinfo[pn].sharers != 0) {
+            pageinfo[pn].owner = __builtin_ctz(pageinfo[pn].sharers);
+        } else {
+            // orphan page, refcount is > 0 but nothing maps it
+            // shouldn't really get to here
+            pageinfo[pn].owner = PO_FREE;
+            pageinfo[pn].refcount = 0;
+            page_markfree(pn, 1);
         }
     }
-    // refcount is > 1, but didn't find another owner.
-    // must be an error !
-    return -1;
 }
 
 
-// void exit_and_free(void)
-//    tries to free memory for the current process.
-//    looks through all pages, if mulitple references to page
-//    then searches for another owner.
+// void free_current_process(proc *p)
+//    frees the memory of process `p`. Drops its reference to each page
+//    in its page map, which covers its mappings and its page tables, so
+//    pages shared copy-on-write or read-only with other processes stay
+//    live.
 void free_current_process(proc *p) {
     // block the process while freeing
-    p->p_state=P_BLOCKED;
-    // look for all pages with specified process as owner
-    for (int i = 0; i < PAGENUMBER(MEMSIZE_PHYSICAL); ++i) {
-        if (pageinfo[i].owner == p->p_pid){
-            int refcount = pageinfo[i].refcount;
-            if (refcount > 1) {
-                // multiple owners, decrement refcount by 1
-                --pageinfo[i].refcount;
-                // check which proc owns page after free
-                pid_t new_owner = find_page_owner(i);
-                if (new_owner != -1) {
-                    pageinfo[i].owner = find_page_owner(i);
-                } else {
-                    // orphan page, set ref to 0 ??
-                    // shouldn't really get to here
-                    pageinfo[i].owner = PO_FREE;
-                    pageinfo[i].refcount = 0;
-                }
-            } else if (refcount == 1) {
-                // only owned by specified process, decrement refcnt to 0
-                // and set owner to free
-                --pageinfo[i].refcount;
-                pageinfo[i].owner = PO_FREE;
-            } else {
-                // setting owner to free, refcnt is already 0
-                // shouldn't really get to here
-                pageinfo[i].owner = PO_FREE;
-            }
+    p->p_state = P_BLOCKED;
+    uint32_t* pagemap = proc_pagemap[p->p_pid];
+    for (int w = 0; w < FREEMAP_NWORDS; ++w) {
+        // page_decref clears the page's bit
+        while (pagemap[w] != 0) {
+            page_decref(w * 32 + __builtin_ctz(pagemap[w]), p);
         }
     }
+    p->p_pagetable = NULL;
     p->p_state = P_FREE;
 }
 
 
 // int fork_process(void)
 //    creates child process from the current process by copying the
-//    current process. The parent is returned the childs pid.
-//    The child is returned 0. The caller is returned -1 in case of 
-//    failure.
+//    current process. Pages are shared, not copied: writable pages
+//    become read-only and copy-on-write in both processes, and are
+//    split by copy_on_write() on the first write. The parent is
+//    returned the childs pid. The child is returned 0. The caller is
+//    returned -1 in case of failure.
 int fork_process(void) {
     pid_t chld_pid = find_free_process_slot();
     if (chld_pid != -1) {
@@ -312,9 +508,7 @@ int fork_process(void) {
         x86_pagetable *chld_pgtb = copy_pagetable(current->p_pagetable, chld_pid);
         if (chld_pgtb == NULL) {
             // copy pgtable failed due to not enough free memory,
-            // so need to free the child's memory
-            free_current_process(copy);
-            // return -1 to parent, as we had to free the child memory
+            // return -1 to parent
             return -1; 
         }
         copy->p_pagetable = chld_pgtb;
@@ -322,39 +516,61 @@ int fork_process(void) {
         
         for (uintptr_t va = PROC_START_ADDR; va < MEMSIZE_VIRTUAL; va += PAGESIZE) {
             vamapping vam = virtual_memory_lookup(current->p_pagetable, va);
-            // check is address writable
-            if (vam.perm && (vam.perm & PTE_W)) {
-                // allocate new physical page
-                void* chld_page = alloc_free_page(chld_pid);
-                if (chld_page == NULL) {
-                    // allocation failed due to not enough free memory,
-                    // so need to free the child's memory
-                    free_current_process(copy);
-                    // return -1 to parent, as we had to free the child memory
-                    return -1; 
-                }
-                
-                // copy the data from V into P, using memcpy; 
-                memcpy(chld_page, (void*) vam.pa, PAGESIZE);
-                
-                // map page P at address V in the child process’s page table.
-                virtual_memory_map(copy->p_pagetable, va, (uintptr_t)chld_page,
-                        PAGESIZE, vam.perm);
-            } else {
-                virtual_memory_map(copy->p_pagetable, va, vam.pa, PAGESIZE, vam.perm);
-                ++pageinfo[vam.pn].refcount;
+            if (vam.pn < 0) {
+                continue;
             }
+            int perm = vam.perm;
+            if (perm & (PTE_W | PTE_COW)) {
+                // share writable page copy-on-write, read-only in
+                // the parent as well as the child
+                perm = (perm & ~PTE_W) | PTE_COW;
+                virtual_memory_map(current->p_pagetable, va, vam.pa,
+                        PAGESIZE, perm);
+            }
+            virtual_memory_map(copy->p_pagetable, va, vam.pa, PAGESIZE, perm);
+            page_addref(vam.pn, copy);
         }
 
         copy->p_registers = current->p_registers;
         copy->p_registers.reg_eax = 0;
+        proc_priority[chld_pid] = proc_priority[current->p_pid];
+        program_fork(copy, current);
         copy->p_state = P_RUNNABLE;
+        runq_push(copy);
     }
 
     return chld_pid;
 }
 
 
+// int copy_on_write(proc* p, uintptr_t va)
+//    handles a write by `p` to the copy-on-write page at `va`. Gives `p`
+//    a private writable copy of the page, or, if no other process shares
+//    the page any more, just makes it writable. Returns 0 on success, -1
+//    if `va` is not copy-on-write or no free page is left for the copy.
+int copy_on_write(proc* p, uintptr_t va) {
+    va &= ~(PAGESIZE - 1);
+    vamapping vam = virtual_memory_lookup(p->p_pagetable, va);
+    if (vam.pn < 0 || !(vam.perm & PTE_COW)) {
+        return -1;
+    }
+    int perm = (vam.perm & ~PTE_COW) | PTE_W;
+    if (pageinfo[vam.pn].refcount == 1) {
+        virtual_memory_map(p->p_pagetable, va, vam.pa, PAGESIZE, perm);
+        return 0;
+    }
+
+    void* page = alloc_free_page(p->p_pid);
+    if (page == NULL) {
+        return -1;
+    }
+    memcpy(page, (void*) vam.pa, PAGESIZE);
+    virtual_memory_map(p->p_pagetable, va, (uintptr_t) page, PAGESIZE, perm);
+    page_decref(vam.pn, p);
+    return 0;
+}
+
+
 // exception(reg)
 //    Exception handler (for interrupts, traps, and faults).
 //
@@ -364,12 +580,16 @@ int fork_process(void) {
 //    k-exception.S). That code saves more registers on the kernel's stack,
 //    then calls exception().
 //
-//    Note that hardware interrupts are disabled whenever the kernel is running.
+//    Note that hardware interrupts are disabled whenever the kernel is running,
+//    except in schedule()'s idle loop. An interrupt taken there comes from
+//    kernel mode and has no process registers to save.
 
 void exception(x86_registers* reg) {
     // Copy the saved registers into the `current` process descriptor
     // and always use the kernel's page table.
-    current->p_registers = *reg;
+    if ((reg->reg_cs & 3) != 0) {
+        current->p_registers = *reg;
+    }
     set_pagetable(kernel_pagetable);
 
     // It can be useful to log events using `log_printf`.
@@ -378,9 +598,14 @@ void exception(x86_registers* reg) {
 
     // Show the current cursor location and memory state.
     console_show_cursor(cursorpos);
-    virtual_memory_check();
-    memshow_physical();
-    memshow_virtual_animate();
+    if (debug_interval == DEBUG_ALWAYS
+        || (debug_interval > 0
+            && ticks - debug_last_ticks >= (unsigned) debug_interval)) {
+        debug_last_ticks = ticks;
+        virtual_memory_check();
+        memshow_physical();
+        memshow_virtual_animate();
+    }
 
     // If Control-C was typed, exit the virtual machine.
     check_keyboard();
@@ -402,13 +627,20 @@ void exception(x86_registers* reg) {
 
     case INT_SYS_PAGE_ALLOC: {
         uintptr_t addr = (uintptr_t)current->p_registers.reg_eax;
-        void* p_addr = alloc_free_page(current->p_pid);
-        if (p_addr != NULL 
-            && (addr % PAGESIZE) == 0
+        void* p_addr = NULL;
+        if ((addr % PAGESIZE) == 0
             && addr >= PROC_START_ADDR 
             && addr < MEMSIZE_VIRTUAL) {
+            p_addr = alloc_free_page(current->p_pid);
+        }
+        if (p_addr != NULL) {
+            // drop the page this mapping replaces, if any
+            vamapping old = virtual_memory_lookup(current->p_pagetable, addr);
             virtual_memory_map(current->p_pagetable, addr, (uintptr_t)p_addr,
                     PAGESIZE, PTE_P|PTE_W|PTE_U);
+            if (old.pn >= 0) {
+                page_decref(old.pn, current);
+            }
             current->p_registers.reg_eax = 0;
         } else {
             // if we can't alloc, then return -1
@@ -419,8 +651,25 @@ void exception(x86_registers* reg) {
         break;
     }
 
+    case INT_SYS_PRIORITY: {
+        int priority = current->p_registers.reg_eax;
+        if (priority >= PRIO_MIN && priority <= PRIO_MAX) {
+            // takes effect from the next timeslice
+            proc_priority[current->p_pid] = priority;
+            current->p_registers.reg_eax = 0;
+        } else {
+            current->p_registers.reg_eax = -1;
+        }
+        break;
+    }
+
     case INT_TIMER:
         ++ticks;
+        // keep running the current process until its timeslices are up
+        if ((reg->reg_cs & 3) != 0 && slice_ticks > 1) {
+            --slice_ticks;
+            break;
+        }
         schedule();
         break;                  /* will not be reached */
 
@@ -432,6 +681,17 @@ void exception(x86_registers* reg) {
         const char* problem = reg->reg_err & PFERR_PRESENT
                 ? "protection problem" : "missing page";
 
+        // a missing program page is loaded and the access retried
+        if ((reg->reg_err & (PFERR_USER | PFERR_PRESENT)) == PFERR_USER
+            && program_fault(current, addr) == 0)
+            break;
+
+        // a write to a copy-on-write page gets its own copy and retries
+        if ((reg->reg_err & (PFERR_USER | PFERR_WRITE | PFERR_PRESENT))
+                == (PFERR_USER | PFERR_WRITE | PFERR_PRESENT)
+            && copy_on_write(current, addr) == 0)
+            break;
+
         if (!(reg->reg_err & PFERR_USER))
             panic("Kernel page fault for 0x%08X (%s %s, eip=%p)!\n",
                   addr, operation, problem, reg->reg_eip);
@@ -469,17 +729,61 @@ void exception(x86_registers* reg) {
 
 
 // schedule
-//    Pick the next process to run and then run it.
-//    If there are no runnable processes, spins forever.
+//    Pick the next process to run and then run it. The current process,
+//    if still runnable, goes to the back of the run queue. If there are
+//    no runnable processes, halts until the next interrupt.
 void schedule(void) {
-    pid_t pid = current->p_pid;
-    while (1) {
-        pid = (pid + 1) % NPROC;
-        if (processes[pid].p_state == P_RUNNABLE)
-            run(&processes[pid]);
-        // If Control-C was typed, exit the virtual machine.
-        check_keyboard();
+    if (current->p_state == P_RUNNABLE) {
+        runq_push(current);
+    }
+    proc* p = runq_pop();
+    if (p != NULL) {
+        slice_ticks = proc_priority[p->p_pid] * TIMESLICE_TICKS;
+        run(p);
+    }
+
+    // Nothing to run: wait on a fresh kernel stack with interrupts on.
+    // The interrupt handler calls schedule() again.
+    asm volatile("movl %0, %%esp\n\t"
+                 "sti\n\t"
+                 "1: hlt\n\t"
+                 "jmp 1b"
+                 :
+                 : "i" (KERNEL_STACK_TOP)
+                 : "memory");
+    __builtin_unreachable();
+}
+
+
+// runq_push(p)
+//    Adds runnable process `p` to the back of the run queue.
+void runq_push(proc* p) {
+    assert(p->p_state == P_RUNNABLE);
+    runq_next[p->p_pid] = 0;
+    if (runq_tail != 0) {
+        runq_next[runq_tail] = p->p_pid;
+    } else {
+        runq_head = p->p_pid;
     }
+    runq_tail = p->p_pid;
+}
+
+
+// runq_pop()
+//    Removes and returns the process at the front of the run queue,
+//    skipping any that stopped being runnable. Returns NULL if none.
+proc* runq_pop(void) {
+    while (runq_head != 0) {
+        proc* p = &processes[runq_head];
+        runq_head = runq_next[runq_head];
+        if (runq_head == 0) {
+            runq_tail = 0;
+        }
+        if (p->p_state == P_RUNNABLE) {
+            return p;
+        }
+    }
+    return NULL;
 }
 
 
@@ -523,6 +827,8 @@ void pageinfo_init(void) {
             owner = PO_FREE;
         pageinfo[PAGENUMBER(addr)].owner = owner;
         pageinfo[PAGENUMBER(addr)].refcount = (owner != PO_FREE);
+        page_markfree(PAGENUMBER(addr), owner == PO_FREE);
+        page_dirty(PAGENUMBER(addr));
     }
 }
 
@@ -584,6 +890,35 @@ void virtual_memory_check(void) {
     for (int pn = 0; pn < PAGENUMBER(MEMSIZE_PHYSICAL); ++pn)
         if (pageinfo[pn].refcount > 0 && pageinfo[pn].owner >= 0)
             assert(processes[pageinfo[pn].owner].p_state != P_FREE);
+
+    // Check that the sharers of each page are active processes, and
+    // include its owner
+    for (int pn = 0; pn < PAGENUMBER(MEMSIZE_PHYSICAL); ++pn) {
+        uint32_t sharers = pageinfo[pn].sharers;
+        assert(pageinfo[pn].refcount > 0 || sharers == 0);
+        assert(__builtin_popcount(sharers) <= pageinfo[pn].refcount);
+        if (pageinfo[pn].refcount > 0 && pageinfo[pn].owner > 0)
+            assert(sharers & (1U << pageinfo[pn].owner));
+        for (; sharers != 0; sharers &= sharers - 1)
+            assert(processes[__builtin_ctz(sharers)].p_state != P_FREE);
+        // process page maps are the transpose of the sharers
+        for (int pid = 0; pid < NPROC; ++pid) {
+            int inmap = (proc_pagemap[pid][pn / 32] >> (pn % 32)) & 1;
+            int shares = (pageinfo[pn].sharers >> pid) & 1;
+            assert(inmap == shares);
+        }
+    }
+
+    // Check that the free page map marks exactly the unreferenced pages,
+    // and its summary exactly the words with a free page
+    for (int pn = 0; pn < PAGENUMBER(MEMSIZE_PHYSICAL); ++pn) {
+        int isfree = (free_pagemap[pn / 32] >> (pn % 32)) & 1;
+        assert(isfree == (pageinfo[pn].refcount == 0));
+    }
+    for (int w = 0; w < FREEMAP_NWORDS; ++w) {
+        int anyfree = (free_pagemap_summary[w / 32] >> (w % 32)) & 1;
+        assert(anyfree == (free_pagemap[w] != 0));
+    }
 }
 
 
@@ -598,21 +933,36 @@ static const uint16_t memstate_colors[] = {
 };
 
 void memshow_physical(void) {
-    console_printf(CPOS(0, 32), 0x0F00, "PHYSICAL MEMORY");
-    for (int pn = 0; pn < PAGENUMBER(MEMSIZE_PHYSICAL); ++pn) {
-        if (pn % 64 == 0)
+    static int labeled = 0;
+    if (!labeled) {
+        console_printf(CPOS(0, 32), 0x0F00, "PHYSICAL MEMORY");
+        for (int pn = 0; pn < PAGENUMBER(MEMSIZE_PHYSICAL); pn += 64)
             console_printf(CPOS(1 + pn / 64, 3), 0x0F00, "0x%06X ", pn << 12);
+        labeled = 1;
+    }
 
-        int owner = pageinfo[pn].owner;
-        if (pageinfo[pn].refcount == 0)
-            owner = PO_FREE;
-        uint16_t color = memstate_colors[owner - PO_KERNEL];
-        // darker color for shared pages
-        if (pageinfo[pn].refcount > 1)
-            color &= 0x77FF;
+    // redraw only the pages whose pageinfo changed
+    for (int w = 0; w < FREEMAP_NWORDS; ++w)
+        while (memshow_dirty[w] != 0) {
+            int pn = w * 32 + __builtin_ctz(memshow_dirty[w]);
+            memshow_dirty[w] &= memshow_dirty[w] - 1;
+            memshow_physical_page(pn);
+        }
+}
 
-        console[CPOS(1 + pn / 64, 12 + pn % 64)] = color;
-    }
+
+// memshow_physical_page(pn)
+//    Draw physical page `pn` in the physical memory map.
+void memshow_physical_page(int pn) {
+    int owner = pageinfo[pn].owner;
+    if (pageinfo[pn].refcount == 0)
+        owner = PO_FREE;
+    uint16_t color = memstate_colors[owner - PO_KERNEL];
+    // darker color for shared pages
+    if (pageinfo[pn].refcount > 1)
+        color &= 0x77FF;
+
+    console[CPOS(1 + pn / 64, 12 + pn % 64)] = color;
 }
 
 
@@ -668,9 +1018,16 @@ void memshow_virtual_animate(void) {
         ++showing;
     showing = showing % NPROC;
 
-    if (processes[showing].p_state != P_FREE) {
+    // redraw only if the process shown or any page changed
+    static int last_showing = -1;
+    static unsigned last_generation;
+    if (processes[showing].p_state != P_FREE
+        && (showing != last_showing
+            || memshow_generation != last_generation)) {
         char s[4];
         snprintf(s, 4, "%d ", showing);
         memshow_virtual(processes[showing].p_pagetable, s);
+        last_showing = showing;
+        last_generation = memshow_generation;
     }
 }
\ No newline at end of file
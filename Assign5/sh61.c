@@ -1,9 +1,12 @@
 #include "sh61.h"
 #include <string.h>
 #include <errno.h>
+#include <spawn.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+extern char** environ;
+
 
 // struct command
 //    Data structure describing a command. Add your own stuff.
@@ -11,11 +14,13 @@ typedef struct command command;
 struct command {
     int argc;      // number of arguments
     char** argv;   // arguments, terminated by NULL
+    int argv_cap;  // number of slots in argv
     pid_t pid;     // process ID running this command, -1 if none
     int cond;      // conditional req on prev cmd. -1 no condition.
     int rungrp;    // specifies cmd as a subgrp of the list to run
     int ctrl_blk;  // specifies if cmd is part of ctrl structure
     int pipe_nxt;  // indicates if we should pipe to next cmd
+    int bg;        // cmd is part of a background group, run as a job
     int redir_app_out;     // flag indicating if stdout is redir as appending
     int redir_app_err;     // flag indicating if stderr is redir as appending
     char *redir_in;        // file to redir stdin to
@@ -27,11 +32,102 @@ struct command {
 static struct command *head_cmd;  // head of cmd list
 static struct command *curr_cmd;  // current cmd
 volatile sig_atomic_t si_flag;      // flag indicating sig occurred
+volatile sig_atomic_t sigchld_flag; // flag indicating a child exited
 static int curr_ctrl_state;          // state of ctrl structure
 // state defining where we are in 'if' structure
 enum states {NEUTRAL, WANT_THEN, THEN_BLOCK, ELSE_BLOCK};
 enum redir_to {RDSTDIN, RDSTDOUT, RDSTDERR, RDAPPSTDOUT, RDAPPSTDERR};
 
+// LINE ARENA
+//    The commands, argv arrays and words of the line being evaluated are
+//    bump-allocated from `line_arena`, and all released at once by
+//    arena_reset() when the line is done. The arena keeps its memory
+//    between lines, so a script's lines after the first need no malloc.
+//    Lines kept in the parse cache are allocated from `cache_arena`
+//    instead, which is never reset.
+
+#define ARENA_CHUNK_SZ 4096     // minimum size of an arena chunk
+
+typedef struct arena_chunk arena_chunk;
+struct arena_chunk {
+    arena_chunk* next;     // older chunk, or NULL
+    size_t size;           // bytes in data
+    char data[];
+};
+
+typedef struct arena {
+    arena_chunk* chunk;    // chunk being allocated from, or NULL
+    size_t pos;            // offset of next free byte in chunk->data
+    size_t total;          // bytes in all chunks
+} arena;
+
+static arena line_arena;
+static arena cache_arena;
+static arena* parse_arena = &line_arena;   // arena the parser allocates from
+
+
+// arena_alloc(sz)
+//    Return `sz` bytes of memory from `parse_arena`, aligned for any type.
+static void* arena_alloc(size_t sz) {
+    sz = (sz + 15) & ~(size_t) 15;
+    arena* a = parse_arena;
+    arena_chunk* ch = a->chunk;
+    if (ch == NULL || ch->size - a->pos < sz) {
+        size_t chsz = ARENA_CHUNK_SZ;
+        while (chsz < sz) {
+            chsz *= 2;
+        }
+        arena_chunk* nch = (arena_chunk*) malloc(sizeof(arena_chunk) + chsz);
+        if (nch == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        nch->next = ch;
+        nch->size = chsz;
+        a->chunk = ch = nch;
+        a->pos = 0;
+        a->total += chsz;
+    }
+    void* ptr = &ch->data[a->pos];
+    a->pos += sz;
+    return ptr;
+}
+
+
+// arena_strdup(str)
+//    Return a copy of string `str` in `parse_arena`.
+static char* arena_strdup(const char* str) {
+    size_t len = strlen(str);
+    char* copy = (char*) arena_alloc(len + 1);
+    memcpy(copy, str, len + 1);
+    return copy;
+}
+
+
+// arena_reset()
+//    Release everything allocated from the line arena. If the line needed
+//    several chunks, they are replaced by one chunk big enough for all.
+static void arena_reset(void) {
+    arena_chunk* ch = line_arena.chunk;
+    if (ch != NULL && ch->next != NULL) {
+        size_t total = 0;
+        while (ch != NULL) {
+            arena_chunk* next = ch->next;
+            total += ch->size;
+            free(ch);
+            ch = next;
+        }
+        line_arena.chunk = NULL;
+        line_arena.total = 0;
+        arena* a = parse_arena;
+        parse_arena = &line_arena;
+        arena_alloc(total);
+        parse_arena = a;
+    }
+    line_arena.pos = 0;
+}
+
+
 // sigint_handler(sig)
 //     handler for sigint.
 void sigint_handler(int sig) {
@@ -40,17 +136,27 @@ void sigint_handler(int sig) {
 }
 
 
+// sigchld_handler(sig)
+//     handler for sigchld. Children are reaped by reap_children().
+void sigchld_handler(int sig) {
+    (void) sig;
+    sigchld_flag = 1;
+}
+
+
 // command_alloc()
-//    Allocate and return a new command structure.
+//    Allocate and return a new command structure in `parse_arena`.
 static command* command_alloc(void) {
-    command* c = (command*) malloc(sizeof(command));
+    command* c = (command*) arena_alloc(sizeof(command));
     c->argc = 0;
     c->argv = NULL;
+    c->argv_cap = 0;
     c->pid = -1;
     c->cond = -1;
     c->rungrp = 0;
     c->ctrl_blk = NEUTRAL;
     c->pipe_nxt = 0;
+    c->bg = 0;
     c->redir_app_out = 0;
     c->redir_app_err = 0;
     c->redir_in = NULL;
@@ -78,83 +184,250 @@ static void add_cmd_node(command* c) {
 }
 
 
-// command_free(c)
-//    Free command structure `c`, including all its words.
-static void command_free(command* c) {
-    for (int i = 0; i != c->argc; ++i) {
-        free(c->argv[i]);
+// clear_command_list()
+//    Empty the runlist. Its commands are released with the line arena.
+static void clear_command_list(void) {
+    head_cmd = NULL;
+    curr_cmd = NULL;
+}
+
+
+// command_append_arg(c, word)
+//    Add `word` as an argument to command `c`. This increments `c->argc`
+//    and augments `c->argv`, doubling it in `parse_arena` when full.
+static void command_append_arg(command* c, char* word) {
+    if (c->argc + 2 > c->argv_cap) {
+        int cap = c->argv_cap ? c->argv_cap * 2 : 8;
+        char** argv = (char**) arena_alloc(sizeof(char*) * cap);
+        if (c->argc) {
+            memcpy(argv, c->argv, sizeof(char*) * c->argc);
+        }
+        c->argv = argv;
+        c->argv_cap = cap;
     }
-    free(c->argv);
-    free(c->redir_in);
-    free(c->redir_out);
-    free(c->redir_err);
-    free(c);
+    c->argv[c->argc] = word;
+    c->argv[c->argc + 1] = NULL;
+    ++c->argc;
 }
 
 
-// free_command_list(c)
-//    Free all commands in list starting with structure 'head'.
-static void free_command_list(void) {
-    command *free_node;
-    command *temp_node;
-    free_node = head_cmd;
-    // walk through the list and free each cmd
-    while(free_node != NULL) {
-        temp_node = free_node;
-        free_node = free_node->next;
-        command_free(temp_node);
+// JOB TABLE
+//    Each background group of a line is a job. A group that is a simple
+//    pipeline is spawned directly, and its job tracks the pipeline's
+//    processes; any other group runs in a forked subshell, which is the
+//    job's only process. Each job has its own process group. At most
+//    `max_jobs` jobs run at once; starting another first waits for one
+//    to finish. Finished jobs stay in the table until `jobs`, `wait`,
+//    `fg` or the interactive prompt reports them.
+
+#define JOBS_MAX 64             // max # jobs in the table
+
+typedef struct job job;
+struct job {
+    int id;              // job number, 0 if the slot is free
+    pid_t pgid;          // process group of the job
+    int npids;           // # processes in the job
+    int nlive;           // # processes not yet reaped
+    pid_t* pids;         // the processes, last one gives the status
+    int status;          // wait status of the last process
+    char* cmdline;       // text of the job, for `jobs`
+};
+
+static job jobs[JOBS_MAX];
+static int njobs_running;       // # jobs with live processes
+static int max_jobs;            // max # jobs running at once
+
+
+// job_exited(pid, status)
+//    Records that process `pid` exited with wait status `status`.
+static void job_exited(pid_t pid, int status) {
+    for (int j = 0; j != JOBS_MAX; ++j) {
+        for (int i = 0; jobs[j].id && i != jobs[j].npids; ++i) {
+            if (jobs[j].pids[i] == pid) {
+                jobs[j].pids[i] = -1;
+                if (i == jobs[j].npids - 1) {
+                    jobs[j].status = status;
+                }
+                if (--jobs[j].nlive == 0) {
+                    --njobs_running;
+                }
+                return;
+            }
+        }
     }
-    head_cmd = NULL;
-    curr_cmd = NULL;
 }
 
 
-// free_command_grp
-//    used to free a subgrp of the runlist.
-//    subgrp specified by 'rungrp'
-static void free_command_grp(int frgrp) {
-    command *free_node;
-    command *temp_node;
-    command *prev_grp = NULL;
-    free_node = head_cmd;
-    // walk through the list and free each cmd
-    while(free_node != NULL) {
-        temp_node = free_node;
-        free_node = free_node->next;
-        // only free subgrp
-        if (temp_node->rungrp == frgrp) {
-            command_free(temp_node);
-            prev_grp->next = NULL;
-            curr_cmd = prev_grp;
+// reap_children(block)
+//    Reaps exited children, recording the ones that belong to jobs. If
+//    `block`, first waits for a child to exit. Returns -1 if there were no
+//    children left to reap, 0 otherwise.
+static int reap_children(int block) {
+    int status, nreaped = 0;
+    pid_t pid;
+    sigchld_flag = 0;
+    while ((pid = waitpid(-1, &status, block ? 0 : WNOHANG)) != 0) {
+        if (pid == -1 && errno == EINTR) {
+            continue;
+        } else if (pid == -1) {
+            return nreaped ? 0 : -1;
+        }
+        job_exited(pid, status);
+        ++nreaped;
+        block = 0;
+    }
+    return 0;
+}
+
+
+// job_wait(j)
+//    Waits for all processes of job `j` to exit.
+static void job_wait(job* j) {
+    while (j->nlive > 0) {
+        if (reap_children(1) == -1 && j->nlive > 0) {
+            // processes were reaped elsewhere; the job has finished
+            j->nlive = 0;
+            --njobs_running;
+        }
+    }
+}
+
+
+// job_free(j)
+//    Removes finished job `j` from the table.
+static void job_free(job* j) {
+    assert(j->nlive == 0);
+    free(j->pids);
+    free(j->cmdline);
+    j->id = 0;
+}
+
+
+// job_alloc(c)
+//    Returns a new job for the background group starting at `c`, after
+//    waiting until fewer than `max_jobs` jobs are running. Its id is one
+//    more than the highest id in use.
+static job* job_alloc(command* c) {
+    while (njobs_running >= max_jobs) {
+        job* oldest = NULL;
+        for (int j = 0; j != JOBS_MAX; ++j) {
+            if (jobs[j].id && jobs[j].nlive
+                && (!oldest || jobs[j].id < oldest->id)) {
+                oldest = &jobs[j];
+            }
+        }
+        job_wait(oldest);
+    }
+
+    job* slot = NULL;
+    job* oldest_done = NULL;
+    int id = 1;
+    for (int j = 0; j != JOBS_MAX; ++j) {
+        if (jobs[j].id == 0) {
+            slot = slot ? slot : &jobs[j];
         } else {
-            prev_grp = temp_node;
+            id = jobs[j].id >= id ? jobs[j].id + 1 : id;
+            if (jobs[j].nlive == 0
+                && (!oldest_done || jobs[j].id < oldest_done->id)) {
+                oldest_done = &jobs[j];
+            }
+        }
+    }
+    if (slot == NULL) {
+        // table full of unreported jobs, drop the oldest finished one
+        slot = oldest_done;
+        job_free(slot);
+    }
+
+    // job text: the group's words and operators
+    size_t len = 1;
+    for (command* n = c; n && n->rungrp == c->rungrp; n = n->next) {
+        for (int i = 0; i != n->argc; ++i) {
+            len += strlen(n->argv[i]) + 1;
+        }
+        len += 4;
+    }
+    char* text = (char*) malloc(len);
+    size_t pos = 0;
+    for (command* n = c; n && n->rungrp == c->rungrp; n = n->next) {
+        for (int i = 0; i != n->argc; ++i) {
+            pos += sprintf(&text[pos], "%s%s", i ? " " : "", n->argv[i]);
+        }
+        if (n->next && n->next->rungrp == c->rungrp) {
+            const char* op = n->pipe_nxt ? " | "
+                : (n->next->cond == 0 ? " && " : " || ");
+            pos += sprintf(&text[pos], "%s", op);
         }
     }
-    if (head_cmd->rungrp == frgrp) {
-        head_cmd = NULL;
+    text[pos] = '\0';
+
+    slot->id = id;
+    slot->pgid = 0;
+    slot->npids = slot->nlive = 0;
+    slot->pids = NULL;
+    slot->status = 0;
+    slot->cmdline = text;
+    return slot;
+}
+
+
+// job_find(spec)
+//    Returns the job named by `spec`, `%N` for job N or a process group
+//    id, or the most recent job if `spec` is NULL. Returns NULL if none.
+static job* job_find(const char* spec) {
+    job* found = NULL;
+    for (int j = 0; j != JOBS_MAX; ++j) {
+        if (jobs[j].id == 0) {
+            continue;
+        }
+        if (spec == NULL) {
+            found = (!found || jobs[j].id > found->id) ? &jobs[j] : found;
+        } else if (spec[0] == '%' && atoi(spec + 1) == jobs[j].id) {
+            return &jobs[j];
+        } else if (spec[0] != '%' && atoi(spec) == jobs[j].pgid) {
+            return &jobs[j];
+        }
     }
+    return found;
 }
 
 
-// command_append_arg(c, word)
-//    Add `word` as an argument to command `c`. This increments `c->argc`
-//    and augments `c->argv`.
-static void command_append_arg(command* c, char* word) {
-    c->argv = (char**) realloc(c->argv, sizeof(char*) * (c->argc + 2));
-    c->argv[c->argc] = word;
-    c->argv[c->argc + 1] = NULL;
-    ++c->argc;
+// report_jobs(all)
+//    Prints finished jobs, or all jobs if `all`, and removes the
+//    finished ones from the table.
+static void report_jobs(int all) {
+    for (int j = 0; j != JOBS_MAX; ++j) {
+        if (jobs[j].id && (all || jobs[j].nlive == 0)) {
+            printf("[%d] %s\t%s &\n", jobs[j].id,
+                   jobs[j].nlive ? "Running" : "Done", jobs[j].cmdline);
+            if (jobs[j].nlive == 0) {
+                job_free(&jobs[j]);
+            }
+        }
+    }
+    fflush(stdout);
 }
 
 
-// handle_zombies()
-//    Deals with any zombie processes still around.
-static void handle_zombies(void) {
-    // find any process in zombie state
-    while (waitpid((pid_t)(-1), 0, WNOHANG) > 0) { }
+// job_status(j)
+//    Returns the exit status of finished job `j`, as for a foreground
+//    command.
+static int job_status(job* j) {
+    if (WIFEXITED(j->status)) {
+        return WEXITSTATUS(j->status);
+    }
+    return 128 + WTERMSIG(j->status);
 }
 
 
+// BUILTINS
+//    Builtin cmds run in the shell itself, without a fork and exec; as a
+//    pipeline stage or job they run in a forked child. Each returns the
+//    cmd's exit status.
+
+static int last_status;         // exit status of the previous cmd
+static pid_t shell_pid;         // pid of the shell, not a subshell
+
 // change_dir(dir_str)
 //    change the current directory to the one specified in dir_str.
 //    returns 0 on success, 1 on failure.
@@ -170,48 +443,448 @@ static int change_dir(char *dir_str) {
 }
 
 
+// builtin_wait(c)
+//    `wait [%N|PGID]...` waits for the given jobs, or for all jobs.
+//    returns the exit status of the last job given, or 127 if one
+//    does not exist.
+static int builtin_wait(command* c) {
+    int status = 0;
+    if (c->argc == 1) {
+        for (int j = 0; j != JOBS_MAX; ++j) {
+            if (jobs[j].id) {
+                job_wait(&jobs[j]);
+                job_free(&jobs[j]);
+            }
+        }
+    }
+    for (int i = 1; i < c->argc; ++i) {
+        job* j = job_find(c->argv[i]);
+        if (j == NULL) {
+            fprintf(stderr, "wait: %s: no such job\n", c->argv[i]);
+            status = 127;
+        } else {
+            job_wait(j);
+            status = job_status(j);
+            job_free(j);
+        }
+    }
+    return status;
+}
+
+
+// builtin_fg(c)
+//    `fg [%N|PGID]` puts the given job, or the most recent one, in the
+//    foreground and waits for it. returns its exit status.
+static int builtin_fg(command* c) {
+    const char* spec = c->argc > 1 ? c->argv[1] : NULL;
+    job* j = job_find(spec);
+    if (j == NULL) {
+        fprintf(stderr, "fg: %s: no such job\n", spec ? spec : "current");
+        return 1;
+    }
+    printf("%s\n", j->cmdline);
+    fflush(stdout);
+    if (j->nlive) {
+        set_foreground(j->pgid);
+        kill(-j->pgid, SIGCONT);
+        job_wait(j);
+        set_foreground(0);
+    }
+    int status = job_status(j);
+    job_free(j);
+    return status;
+}
+
+
+// builtin_echo(c)
+//    `echo [-n] [ARG...]` prints its args, separated by spaces.
+static int builtin_echo(command* c) {
+    int i = 1;
+    int newline = 1;
+    if (c->argc > 1 && strcmp(c->argv[1], "-n") == 0) {
+        newline = 0;
+        ++i;
+    }
+    for (int first = i; i < c->argc; ++i) {
+        if (i != first) {
+            fputc(' ', stdout);
+        }
+        fputs(c->argv[i], stdout);
+    }
+    if (newline) {
+        fputc('\n', stdout);
+    }
+    return 0;
+}
+
+
+// test_unary(op, arg)
+//    returns the result of unary `test` operator `op` on `arg`: 0 for
+//    true, 1 for false, or -1 if `op` is not a unary operator.
+static int test_unary(const char* op, const char* arg) {
+    struct stat st;
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') {
+        return -1;
+    }
+    switch (op[1]) {
+    case 'n':
+        return arg[0] == '\0';
+    case 'z':
+        return arg[0] != '\0';
+    case 'e':
+        return stat(arg, &st) != 0;
+    case 'f':
+        return stat(arg, &st) != 0 || !S_ISREG(st.st_mode);
+    case 'd':
+        return stat(arg, &st) != 0 || !S_ISDIR(st.st_mode);
+    case 's':
+        return stat(arg, &st) != 0 || st.st_size == 0;
+    case 'r':
+        return access(arg, R_OK) != 0;
+    case 'w':
+        return access(arg, W_OK) != 0;
+    case 'x':
+        return access(arg, X_OK) != 0;
+    default:
+        return -1;
+    }
+}
+
+
+// test_binary(a, op, b)
+//    returns the result of binary `test` operator `op`: 0 for true, 1
+//    for false, or -1 if `op` is not a binary operator.
+static int test_binary(const char* a, const char* op, const char* b) {
+    static const char* intops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(a, b) != 0;
+    } else if (strcmp(op, "!=") == 0) {
+        return strcmp(a, b) == 0;
+    }
+    for (int i = 0; i != 6; ++i) {
+        if (strcmp(op, intops[i]) == 0) {
+            long x = strtol(a, NULL, 10), y = strtol(b, NULL, 10);
+            int r[6] = {x == y, x != y, x < y, x <= y, x > y, x >= y};
+            return !r[i];
+        }
+    }
+    return -1;
+}
+
+
+// builtin_test(c)
+//    `test EXPR` and `[ EXPR ]` evaluate a one-, two- or three-arg
+//    expression, optionally negated with `!`. returns 0 if it is true,
+//    1 if false, 2 on a syntax error.
+static int builtin_test(command* c) {
+    int argc = c->argc;
+    if (strcmp(c->argv[0], "[") == 0) {
+        if (strcmp(c->argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        --argc;
+    }
+    char** argv = &c->argv[1];
+    int n = argc - 1;
+    int negate = 0;
+    if (n > 1 && strcmp(argv[0], "!") == 0) {
+        negate = 1;
+        ++argv, --n;
+    }
+
+    int r;
+    if (n == 0) {
+        r = 1;
+    } else if (n == 1) {
+        r = argv[0][0] == '\0';
+    } else if (n == 2) {
+        r = test_unary(argv[0], argv[1]);
+    } else if (n == 3) {
+        r = test_binary(argv[0], argv[1], argv[2]);
+    } else {
+        r = -1;
+    }
+    if (r == -1) {
+        fprintf(stderr, "%s: syntax error\n", c->argv[0]);
+        return 2;
+    }
+    return negate ? !r : r;
+}
+
+
+static int builtin_cd(command* c) {
+    return change_dir(c->argv[1]);
+}
+
+static int builtin_jobs(command* c) {
+    (void) c;
+    report_jobs(1);
+    return 0;
+}
+
+static int builtin_true(command* c) {
+    (void) c;
+    return 0;
+}
+
+static int builtin_false(command* c) {
+    (void) c;
+    return 1;
+}
+
+
+// builtin_pwd(c)
+//    `pwd` prints the current directory.
+static int builtin_pwd(command* c) {
+    (void) c;
+    char* cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    free(cwd);
+    return 0;
+}
+
+
+// builtin_exit(c)
+//    `exit [N]` exits the shell with status N, or the previous cmd's.
+//    A forked builtin or subshell uses _exit, like fork_builtin does.
+static int builtin_exit(command* c) {
+    int status = c->argc > 1 ? atoi(c->argv[1]) : last_status;
+    if (getpid() != shell_pid) {
+        fflush(stdout);
+        _exit(status);
+    }
+    exit(status);
+}
+
+
+typedef struct builtin {
+    const char* name;
+    int (*run)(command* c);
+} builtin;
+
+static const builtin builtins[] = {
+    {"cd", builtin_cd}, {"jobs", builtin_jobs}, {"wait", builtin_wait},
+    {"fg", builtin_fg}, {"true", builtin_true}, {"false", builtin_false},
+    {"echo", builtin_echo}, {"test", builtin_test}, {"[", builtin_test},
+    {"pwd", builtin_pwd}, {"exit", builtin_exit}
+};
+
+
+// find_builtin(c)
+//    returns the builtin run for cmd `c`, or NULL if it is not a builtin.
+static const builtin* find_builtin(command* c) {
+    for (size_t i = 0; i != sizeof(builtins) / sizeof(builtin); ++i) {
+        if (strcmp(c->argv[0], builtins[i].name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+
 // do_redir(int redirfd, char *fname, int flags, mode_t mode) 
 //    does redirection of an fd to the specified file opened
-//    with the specified flags
-static void do_redir(int redirfd, char *fname, int flags, mode_t mode) {
+//    with the specified flags. returns 0 on success, -1 on failure.
+static int do_redir(int redirfd, char *fname, int flags, mode_t mode) {
     int fd = 0;
     if ((fd = open(fname, flags, mode)) == -1) {
-        perror("open");
-        exit(1);
+        fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+        return -1;
     }
     if (dup2(fd, redirfd) == -1) {  
         perror(fname);
-        exit(1);
+        close(fd);
+        return -1;
     }
     close(fd);
+    return 0;
 }
 
 
 // cmd_redir(command *c) 
 //    redirects the output of the cmd as specified
-//    by it's 'redir' variables
-static void cmd_redir(command *c) {
-    if (c->redir_in != NULL) {
-        do_redir(STDIN_FILENO, c->redir_in, O_RDONLY, 0666);
+//    by it's 'redir' variables. returns 0 on success, -1 on failure.
+static int cmd_redir(command *c) {
+    if (c->redir_in != NULL
+        && do_redir(STDIN_FILENO, c->redir_in, O_RDONLY, 0666) == -1) {
+        return -1;
     }
     
     if (c->redir_out != NULL) {
-        if (c->redir_app_out == 0) {
-            do_redir(STDOUT_FILENO, c->redir_out, O_WRONLY|O_CREAT|O_TRUNC, 0666);
-        } else {
-            // open stdout as appending
-            do_redir(STDOUT_FILENO, c->redir_out, O_WRONLY|O_CREAT|O_APPEND, 0666);
+        // open stdout as truncating or appending
+        int flags = O_WRONLY|O_CREAT|(c->redir_app_out ? O_APPEND : O_TRUNC);
+        if (do_redir(STDOUT_FILENO, c->redir_out, flags, 0666) == -1) {
+            return -1;
         }
     }
     
     if (c->redir_err != NULL) {
-        if (c->redir_app_err == 0) {
-            do_redir(STDERR_FILENO, c->redir_err, O_WRONLY|O_CREAT|O_TRUNC, 0666);
-        } else {
-            // open stderr as appending
-            do_redir(STDERR_FILENO, c->redir_err, O_WRONLY|O_CREAT|O_APPEND, 0666);
+        // open stderr as truncating or appending
+        int flags = O_WRONLY|O_CREAT|(c->redir_app_err ? O_APPEND : O_TRUNC);
+        if (do_redir(STDERR_FILENO, c->redir_err, flags, 0666) == -1) {
+            return -1;
         }
     }
+    return 0;
+}
+
+
+// run_builtin(b, c)
+//    runs builtin `b` for cmd `c` in the shell, with `c`'s redirections.
+//    The shell's stdin, stdout and stderr are saved first, and put back
+//    after. returns the cmd's exit status.
+static int run_builtin(const builtin* b, command* c) {
+    if (c->redir_in == NULL && c->redir_out == NULL && c->redir_err == NULL) {
+        int status = b->run(c);
+        fflush(stdout);
+        return status;
+    }
+
+    // record fds before redir, then undo after builtin cmd
+    int oldfds[3] = {dup(STDIN_FILENO), dup(STDOUT_FILENO),
+                     dup(STDERR_FILENO)};
+    int status = 1;
+    if (cmd_redir(c) == 0) {
+        status = b->run(c);
+    }
+    fflush(stdout);
+    for (int fd = 0; fd != 3; ++fd) {
+        dup2(oldfds[fd], fd);
+        close(oldfds[fd]);
+    }
+    return status;
+}
+
+
+// spawn_redir(fa, c, fds)
+//    opens the files named by `c`'s 'redir' variables in the shell, so a
+//    bad file is reported as such rather than as a failed exec, and adds
+//    file actions to `fa` that make them the child's stdin, stdout and
+//    stderr. The opened fds are stored in `fds`, -1 where unused, for the
+//    caller to close once the child is spawned. returns 0 on success, -1
+//    on failure.
+static int spawn_redir(posix_spawn_file_actions_t* fa, command* c,
+                       int fds[3]) {
+    const char* fnames[3] = {c->redir_in, c->redir_out, c->redir_err};
+    int flags[3] = {
+        O_RDONLY,
+        O_WRONLY|O_CREAT|(c->redir_app_out ? O_APPEND : O_TRUNC),
+        O_WRONLY|O_CREAT|(c->redir_app_err ? O_APPEND : O_TRUNC)
+    };
+    for (int fd = 0; fd != 3; ++fd) {
+        fds[fd] = -1;
+    }
+    for (int fd = 0; fd != 3; ++fd) {
+        if (fnames[fd] == NULL) {
+            continue;
+        }
+        // close-on-exec, so only the dup2'd copy reaches the child
+        fds[fd] = open(fnames[fd], flags[fd] | O_CLOEXEC, 0666);
+        if (fds[fd] == -1) {
+            fprintf(stderr, "%s: %s\n", fnames[fd], strerror(errno));
+            return -1;
+        }
+        posix_spawn_file_actions_adddup2(fa, fds[fd], fd);
+    }
+    return 0;
+}
+
+
+// fork_builtin(b, c, pgid, infd, outfd, closefd)
+//    Like spawn_command, for builtin `b`: runs `b` for `c` in a forked
+//    child, without an exec. Returns the child's pid, or -1 on failure.
+static pid_t fork_builtin(const builtin* b, command* c, pid_t pgid,
+                          int infd, int outfd, int closefd) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, pgid);
+        handle_signal(SIGINT, SIG_DFL);
+        handle_signal(SIGCHLD, SIG_DFL);
+        if (closefd != -1) {
+            close(closefd);
+        }
+        if (infd != -1) {
+            dup2(infd, STDIN_FILENO);
+            close(infd);
+        }
+        if (outfd != -1) {
+            dup2(outfd, STDOUT_FILENO);
+            close(outfd);
+        }
+        int status = cmd_redir(c) == 0 ? b->run(c) : 1;
+        // _exit so stdio doesn't move the shared script file offset
+        fflush(stdout);
+        _exit(status);
+    } else if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    // set the group here too, in case the parent runs first
+    setpgid(pid, pgid ? pgid : pid);
+    return pid;
+}
+
+
+// spawn_command(c, pgid, infd, outfd, closefd)
+//    Starts command `c` with `posix_spawnp`, in process group `pgid`, or
+//    its own process group if `pgid == 0`. Unless -1, `infd` and `outfd`
+//    become the child's stdin and stdout, and `closefd` is closed in the
+//    child; then `c`'s redirections are done. Unlike fork, spawning does
+//    not copy the shell's page tables. Returns the child's pid, or -1
+//    after printing an error.
+static pid_t spawn_command(command* c, pid_t pgid, int infd, int outfd,
+                           int closefd) {
+    const builtin* b = find_builtin(c);
+    if (b != NULL) {
+        return fork_builtin(b, c, pgid, infd, outfd, closefd);
+    }
+
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawnattr_init(&attr);
+
+    if (closefd != -1) {
+        posix_spawn_file_actions_addclose(&fa, closefd);
+    }
+    if (infd != -1) {
+        posix_spawn_file_actions_adddup2(&fa, infd, STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&fa, infd);
+    }
+    if (outfd != -1) {
+        posix_spawn_file_actions_adddup2(&fa, outfd, STDOUT_FILENO);
+        posix_spawn_file_actions_addclose(&fa, outfd);
+    }
+    int redirfds[3];
+    int r = spawn_redir(&fa, c, redirfds);
+    // the child joins its process group before it execs, so no race
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, pgid);
+
+    pid_t pid;
+    if (r == 0) {
+        r = posix_spawnp(&pid, c->argv[0], &fa, &attr, c->argv, environ);
+    }
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    for (int fd = 0; fd != 3; ++fd) {
+        if (redirfds[fd] != -1) {
+            close(redirfds[fd]);
+        }
+    }
+    if (r == -1) {
+        return -1;
+    } else if (r != 0) {
+        fprintf(stderr, "cannot execute command: %s: %s\n", c->argv[0],
+                strerror(r));
+        return -1;
+    }
+    return pid;
 }
 
 
@@ -219,120 +892,126 @@ static void cmd_redir(command *c) {
 
 // start_command(c, pgid)
 //    Start the single command indicated by `c`. Sets `c->pid` to the child
-//    process running the command, and returns `c->pid`.
+//    process running the command, and returns `c->pid`, or -1 if it could
+//    not be started.
 //
-//    PART 1: Fork a child process and run the command using `execvp`.
-//    PART 5: Set up a pipeline if appropriate. This may require creating a
-//       new pipe (`pipe` system call), and/or replacing the child process's
-//       standard input/output with parts of the pipe (`dup2` and `close`).
-//       Draw pictures!
-//    PART 7: Handle redirections.
-//    PART 8: The child process should be in the process group `pgid`, or
-//       its own process group (if `pgid == 0`). To avoid race conditions,
-//       this will require TWO calls to `setpgid`.
+//    The child is spawned, with its redirections, in the process group
+//    `pgid`, or its own process group (if `pgid == 0`).
 pid_t start_command(command* c, pid_t pgid) {
-    (void) pgid;   
-    int child_pid;
-    if ((child_pid = fork()) == -1) {
-        // Error
-        perror("fork");
-    } else if (child_pid == 0) {
-        // Child
-        // setting group id
-        if (pgid == 0) {
-            setpgid(0, 0);
-        } else {
-            setpgid(0, pgid);
-        }
-        
-        // deal with any redirection of outputs, if specified
-        cmd_redir(c);
-        execvp(c->argv[0], c->argv);
-        perror("cannot execute command");
-        exit(1);
-    }
-    // Parent
-    if (pgid == 0) {
-        setpgid(child_pid, child_pid);
-    } else {
-        setpgid(child_pid, pgid);
-    }
-    return child_pid;
+    c->pid = spawn_command(c, pgid, -1, -1, -1);
+    return c->pid;
 }
 
 
 // begin_piping(command* c)
-//    starts piping all the cmds joined by pipes
+//    starts piping all the cmds joined by pipes. Returns the last cmd
+//    of the pipeline.
 command* begin_piping(command* c, pid_t pgid) {
-    command *exec_node;
-    exec_node = c;
-    int end_pipe = 1;
-    int first_cmd = 0;
+    command *exec_node = c;
+    command *last_node = c;
     int pipefd[2];
-    int prev_pipefd0;
+    int prev_pipefd0 = -1;
     
     // piping loop
-    while (exec_node != NULL && end_pipe == 1) {
+    while (exec_node != NULL) {
+        int outfd = -1;
+        int readfd = -1;
         // create pipe
         if (exec_node->pipe_nxt == 1) {
             int r = pipe(pipefd);
             assert(r >= 0);
+            outfd = pipefd[1];
+            readfd = pipefd[0];
         }
 
-        if ((exec_node->pid = fork()) == 0) {
-            // Child
-            // setting group id
-            if (pgid == 0) {
-                setpgid(0, 0);
-            } else {
-                setpgid(0, pgid);
-            }
-            if (first_cmd != 0) {
-                dup2(prev_pipefd0, STDIN_FILENO);
-                close(prev_pipefd0);
-            }
-
-            if (exec_node->pipe_nxt == 1) {
-                close(pipefd[0]);
-                dup2(pipefd[1], STDOUT_FILENO);
-                close(pipefd[1]);
-            }
-            
-            // do any redirection, if specified
-            cmd_redir(exec_node);
-            execvp(exec_node->argv[0], exec_node->argv);
-            perror("cannot execute command");
-            exit(1);
-        } else if (exec_node->pid < 0) {
-            // Error
-            perror("fork");
-        }
-        
-        // Parent
-        if (pgid == 0) {
+        // child reads the prev pipe and writes this one, and must not
+        // hold this pipe's read end
+        exec_node->pid = spawn_command(exec_node, pgid, prev_pipefd0,
+                                       outfd, readfd);
+        if (pgid == 0 && exec_node->pid > 0) {
             pgid = exec_node->pid;
-            setpgid(exec_node->pid, exec_node->pid);
-        } else {
-            setpgid(exec_node->pid, pgid);
         }
-        if (first_cmd != 0) {
+        if (prev_pipefd0 != -1) {
             // close prev open pipe, (but not on parent)
             close(prev_pipefd0);
-        } else {
-            first_cmd = 1;
+            prev_pipefd0 = -1;
         }
+        last_node = exec_node;
         
         // check for end of pipe
         if (exec_node->pipe_nxt == 0) {
-            end_pipe = 0;
-            return exec_node;
+            break;
+        }
+        close(pipefd[1]);
+        prev_pipefd0 = pipefd[0]; // previous pipe read fd
+        exec_node = exec_node->next;
+    }
+    if (prev_pipefd0 != -1) {
+        // line ended with '|'
+        close(prev_pipefd0);
+    }
+    return last_node;
+}
+
+
+int run_list(command* c, int rungrp);
+
+// start_job(c)
+//    Starts the background group beginning at `c` as a new job, without
+//    waiting for it. A simple pipeline is spawned directly; a group with
+//    conditionals or ctrl structures runs in a subshell.
+//    Returns the last cmd of the group.
+static command* start_job(command* c) {
+    command* last = c;
+    int ncmds = 0;
+    int simple = 1;
+    for (command* n = c; n != NULL && n->rungrp == c->rungrp; n = n->next) {
+        last = n;
+        ++ncmds;
+        if (n->cond != -1 || n->ctrl_blk != NEUTRAL) {
+            simple = 0;
+        }
+    }
+
+    job* j = job_alloc(c);
+    j->pids = (pid_t*) malloc(sizeof(pid_t) * ncmds);
+    if (simple) {
+        if (c->pipe_nxt == 1) {
+            begin_piping(c, 0);
+        } else {
+            start_command(c, 0);
+        }
+        for (command* n = c; n != last->next; n = n->next) {
+            if (n->pid > 0) {
+                j->pids[j->npids++] = n->pid;
+                j->pgid = j->pgid ? j->pgid : n->pid;
+            }
+        }
+    } else {
+        pid_t pid = fork();
+        if (pid == 0) {
+            // subshell runs the group in its own process group; _exit
+            // so stdio doesn't move the shared script file offset
+            setpgid(0, 0);
+            int status = run_list(c, c->rungrp);
+            fflush(stdout);
+            _exit(status);
+        } else if (pid == -1) {
+            perror("fork");
         } else {
-            close(pipefd[1]);
-            prev_pipefd0 = pipefd[0]; // previous pipe read fd
-            exec_node = exec_node->next;
+            setpgid(pid, pid);
+            j->pids[j->npids++] = pid;
+            j->pgid = pid;
         }
     }
-    return exec_node;
+
+    j->nlive = j->npids;
+    if (j->npids > 0) {
+        ++njobs_running;
+    } else {
+        job_free(j);
+    }
+    return last;
 }
 
 
@@ -402,79 +1081,85 @@ int is_control_cmd(char* token) {
 //       - Call `set_foreground(pgid)` before waiting for the pipeline.
 //       - Call `set_foreground(0)` once the pipeline is complete.
 //       - Cancel the list when you detect interruption.
-//    rungrp specifies a sub-group of cmds to run.
-void run_list(command* c, int rungrp) {    
+//    rungrp specifies a sub-group of cmds to run, in a job's subshell;
+//    -1 runs the whole list, starting background groups as jobs.
+//    returns the exit status of the last cmd run.
+int run_list(command* c, int rungrp) {    
     command *exec_node;
     exec_node = c;
     int ctrl_result = -1;
-    int prev_exit_stat = 0;
-    int pgid = 0;
+    // a list that runs no cmd keeps the previous status
+    int prev_exit_stat = last_status;
+    int interrupted = 0;
+    // a job's subshell keeps its cmds in the job's process group
+    pid_t base_pgid = rungrp == -1 ? 0 : getpgrp();
     // walk through passed list and run each command
-    while(exec_node != NULL) {
+    while(exec_node != NULL && !interrupted) {
         pid_t ret_pid = 0;
+        // each cmd or pipeline gets its own process group; an earlier
+        // one's group may be gone, and spawning into it would fail
+        int pgid = base_pgid;
         int prev_ctrl_state = NEUTRAL;
-        int child_status;
+        int child_status = 0;
+        if (rungrp == -1 && exec_node->bg) {
+            // background group, skip to its last cmd
+            exec_node = start_job(exec_node);
+            prev_exit_stat = 0;
+            prev_ctrl_state = exec_node->ctrl_blk;
+        }
         // checks here are for conditional statements like '&&' or '||'
         // or to run a sub-group of the runlist
         // or due to being in an if statement ctrl structure
-        if ((rungrp == -1 || exec_node->rungrp == rungrp)
+        else if ((rungrp == -1 || exec_node->rungrp == rungrp)
             && (exec_node->cond == -1 || exec_node->cond == prev_exit_stat)
             && (ctrl_result == -1 
                 || (exec_node->ctrl_blk == THEN_BLOCK && ctrl_result == 0)
                 || (exec_node->ctrl_blk == ELSE_BLOCK && ctrl_result == 1))) {
             
-            // flag to indicate if the cmd is cd, which we treat differently
-            int is_cd = 0;
-            if (strcmp(exec_node->argv[0], "cd") == 0) {
-                is_cd = 1;
-            }
+            // a lone builtin cmd is run by the shell itself
+            const builtin* b = exec_node->pipe_nxt ? NULL
+                : find_builtin(exec_node);
+            int is_cd = b != NULL;
             // if pipe to next
             if (exec_node->pipe_nxt == 1) {
                 // pass cmd to be piped
                 exec_node = begin_piping(exec_node, pgid);
                 ret_pid = exec_node->pid;
             } else if (is_cd == 1) {
-                // change directory built-in cmd
-                char* dirname = exec_node->argv[1];
-                // record fds before redir, then undo after cd cmd
-                int oldfds[3] = {dup(STDIN_FILENO), 
-                    dup(STDOUT_FILENO),
-                    dup(STDERR_FILENO)};
-                // if redirection specified, do it first
-                cmd_redir(exec_node);
-                if ((prev_exit_stat = change_dir(dirname)) == -1) {
-                    perror("cd");
-                }
-                
-                // set back to oldfds after cd
-                dup2(oldfds[0], STDIN_FILENO);
-                dup2(oldfds[1], STDOUT_FILENO);
-                dup2(oldfds[2], STDERR_FILENO);
+                prev_exit_stat = run_builtin(b, exec_node);
             } else {
                 ret_pid = start_command(exec_node, pgid);
-                exec_node->pid = ret_pid;
-                if (pgid == 0) {
+                if (pgid == 0 && ret_pid > 0) {
                     pgid = ret_pid;
                 }
             }
             
-            if (is_cd == 0) {
+            if (is_cd == 0 && ret_pid <= 0) {
+                // could not start the cmd, and waitpid(-1) would reap
+                // some other child
+                prev_exit_stat = 1;
+            } else if (is_cd == 0) {
                 // foreground command
                 if (rungrp == -1) {        // not bg process
                     set_foreground(pgid);
                     // do check for signal
-                    if (si_flag == 1) {
-                        kill(-10, SIGINT);                
+                    if (si_flag == 1 && pgid > 0) {
+                        kill(-pgid, SIGINT);                
                     }
                 }
-                if (waitpid(ret_pid, &child_status, 0) == -1) {
+                // SIGCHLD from a job interrupts the wait
+                pid_t r;
+                while ((r = waitpid(ret_pid, &child_status, 0)) == -1
+                       && errno == EINTR) {
+                }
+                if (r == -1) {
                     perror("wait");
                 }
                 
                 if (WIFSIGNALED(child_status) != 0 
                     && WTERMSIG(child_status) == SIGINT) {
-                    // on ctrl-c, kill the run_list loop
-                    exec_node->next = NULL;
+                    // on ctrl-c, stop the run_list loop
+                    interrupted = 1;
                 }
                 
                 // mask child return status
@@ -487,6 +1172,8 @@ void run_list(command* c, int rungrp) {
             }
             prev_ctrl_state = exec_node->ctrl_blk;
         }
+        // `exit` with no status uses the status of the cmd before it
+        last_status = prev_exit_stat;
         exec_node = exec_node->next;
         // check for transition from 'if' to 'then', need 'if' result
         if (exec_node != NULL) {
@@ -497,21 +1184,25 @@ void run_list(command* c, int rungrp) {
             }
         }
     }
+    return prev_exit_stat;
 }
 
 
-// eval_line(c)
-//    Parse the command list in `s` and run it via `run_list`.
-void eval_line(const char* s) {
+// parse_line(s)
+//    Parse the command list in `s` into `parse_arena`, and return its
+//    first cmd, or NULL if the line has none.
+static command* parse_line(const char* s) {
     int type;
     char* token;
     int grp = 0;
-    int exgrp = -1;
     int redir_nxt = -1;
-    int is_bg = 0;
     // build the command
     command* c = command_alloc();
     while ((s = parse_shell_token(s, &type, &token)) != NULL) {
+        // move the token into the parse arena
+        char* heap_token = token;
+        token = arena_strdup(heap_token);
+        free(heap_token);
         if (redir_nxt != -1) {
             // we noted the last token was a redirection, this
             // token is then taken as the filename for that redir
@@ -567,27 +1258,15 @@ void eval_line(const char* s) {
             ++grp;              // next runnable grouping
             c = command_alloc();
         } else if (type ==  TOKEN_BACKGROUND) {
-            // When encountered '&' we fork and process and run bg cmds 
-            // in a subshell. 
-            // bg list is taken as everything after the last ';' and before '&'.
+            // found '&', add cmd to list. The group since the last ';'
+            // or '&' is run in the background, as a job.
             add_cmd_node(c);
-            c = command_alloc();
-            int shpid;
-            if ((shpid = fork()) == -1) {  // Error
-                perror("fork");
-            } else if (shpid == 0) {       // Child
-                // break from loop and start executing the current sub-grp
-                is_bg = 1;
-                exgrp = grp;
-                break;
-            } 
-            // Parent
-            // in main shell clear the previous cmds as that are run in bg process
-            if (grp != 0) {
-                free_command_grp(grp);  // frees a sub grp of the runlist
-            } else {
-                free_command_list();    // frees all of the runlist
+            for (command* n = head_cmd; n != NULL; n = n->next) {
+                if (n->rungrp == grp) {
+                    n->bg = 1;
+                }
             }
+            ++grp;              // next runnable grouping
             c = command_alloc();
         } else if (is_control_cmd(token)) {
             // do nothing, just change ctrl state
@@ -599,11 +1278,7 @@ void eval_line(const char* s) {
     }
     
     // add the command to the cmdlist
-    if (c->argc) {
-        add_cmd_node(c);
-    } else {
-        command_free(c); // cmd has no args and is never used, so free it
-    }
+    add_cmd_node(c);
     
     if (curr_ctrl_state != NEUTRAL) {
         // must finish if with 'fi'
@@ -611,17 +1286,114 @@ void eval_line(const char* s) {
         exit(1);
     }
 
+    command* head = head_cmd;
+    clear_command_list();
+    return head;
+}
+
+
+// PARSE CACHE
+//    In batch mode, parsed lines are kept in a hash table keyed by their
+//    text, so a line the script repeats is tokenized only once. Cached
+//    commands are never modified by run_list except for `pid`, which
+//    is set before each use. The cache stops growing at LINE_CACHE_MAX
+//    bytes; later new lines are parsed into the line arena as usual.
+
+#define LINE_CACHE_MAX (32 << 20)   // max bytes of cached commands
+
+typedef struct cached_line cached_line;
+struct cached_line {
+    char* text;            // line text
+    size_t len;            // strlen(text)
+    unsigned hash;         // hash of text
+    command* head;         // parsed cmds, or NULL
+    cached_line* next;     // next line in bucket
+};
+
+static int cache_lines;             // use the parse cache
+static cached_line** line_cache;    // hash buckets
+static size_t line_cache_nbuckets;
+static size_t line_cache_n;         // # cached lines
+
+
+// line_hash(s, len)
+//    Return the FNV-1a hash of the `len` bytes at `s`.
+static unsigned line_hash(const char* s, size_t len) {
+    unsigned h = 2166136261U;
+    for (size_t i = 0; i != len; ++i) {
+        h = (h ^ (unsigned char) s[i]) * 16777619U;
+    }
+    return h;
+}
+
+
+// line_cache_grow()
+//    Double the parse cache's hash buckets.
+static void line_cache_grow(void) {
+    size_t nb = line_cache_nbuckets ? line_cache_nbuckets * 2 : 256;
+    cached_line** b = (cached_line**) calloc(nb, sizeof(cached_line*));
+    for (size_t i = 0; i != line_cache_nbuckets; ++i) {
+        cached_line* l = line_cache[i];
+        while (l != NULL) {
+            cached_line* next = l->next;
+            l->next = b[l->hash & (nb - 1)];
+            b[l->hash & (nb - 1)] = l;
+            l = next;
+        }
+    }
+    free(line_cache);
+    line_cache = b;
+    line_cache_nbuckets = nb;
+}
+
+
+// cached_parse_line(s, len)
+//    Return the parsed cmds of line `s`, `len` bytes long, parsing and
+//    caching it if it is new.
+static command* cached_parse_line(const char* s, size_t len) {
+    unsigned h = line_hash(s, len);
+    if (line_cache_nbuckets) {
+        for (cached_line* l = line_cache[h & (line_cache_nbuckets - 1)];
+             l != NULL; l = l->next) {
+            if (l->hash == h && l->len == len && memcmp(l->text, s, len) == 0) {
+                return l->head;
+            }
+        }
+    }
+    if (cache_arena.total >= LINE_CACHE_MAX) {
+        return parse_line(s);
+    }
+
+    parse_arena = &cache_arena;
+    cached_line* l = (cached_line*) arena_alloc(sizeof(cached_line));
+    l->text = (char*) arena_alloc(len + 1);
+    memcpy(l->text, s, len + 1);
+    l->head = parse_line(s);
+    parse_arena = &line_arena;
+    l->len = len;
+    l->hash = h;
+    if (line_cache_n >= line_cache_nbuckets) {
+        line_cache_grow();
+    }
+    l->next = line_cache[h & (line_cache_nbuckets - 1)];
+    line_cache[h & (line_cache_nbuckets - 1)] = l;
+    ++line_cache_n;
+    return l->head;
+}
+
+
+// eval_line(s, len)
+//    Parse the command list in `s`, `len` bytes long, and run it via
+//    `run_list`.
+void eval_line(const char* s, size_t len) {
+    command* head = cache_lines ? cached_parse_line(s, len) : parse_line(s);
     // execute it
-    if (head_cmd) {
-        run_list(head_cmd, exgrp);    // only runs grp specified
+    if (head) {
+        run_list(head, -1);
     }
     
-    // free all command in list
-    free_command_list();
-    // if bg sub-shell then exit process
-    if (is_bg == 1) {
-        exit(0);
-    }
+    // free all commands in the line arena
+    arena_reset();
 }
 
 
@@ -631,19 +1403,37 @@ int main(int argc, char* argv[]) {
     int quiet = 0;
     curr_ctrl_state = NEUTRAL;
 
-    // Check for '-q' option: be quiet (print no prompts)
-    if (argc > 1 && strcmp(argv[1], "-q") == 0) {
-        quiet = 1;
-        --argc, ++argv;
+    // Check for '-q' option: be quiet (print no prompts), and '-j N'
+    shell_pid = getpid();
+
+    // option: run at most N background jobs at once (default: # CPUs)
+    max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    while (argc > 1) {
+        if (strcmp(argv[1], "-q") == 0) {
+            quiet = 1;
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+            max_jobs = atoi(argv[2]);
+            argc -= 2, argv += 2;
+        } else {
+            break;
+        }
+    }
+    if (max_jobs < 1) {
+        max_jobs = 1;
+    } else if (max_jobs > JOBS_MAX) {
+        max_jobs = JOBS_MAX;
     }
 
-    // Check for filename option: read commands from file
+    // Check for filename option: read commands from file. A quiet
+    // script caches its parsed lines.
     if (argc > 1) {
         command_file = fopen(argv[1], "rb");
         if (!command_file) {
             perror(argv[1]);
             exit(1);
         }
+        cache_lines = quiet;
     }
 
     // - Put the shell into the foreground
@@ -653,9 +1443,17 @@ int main(int argc, char* argv[]) {
     handle_signal(SIGTTOU, SIG_IGN);
     // handle ctrl-c
     handle_signal(SIGINT, sigint_handler);
+    // reap jobs as they finish; SA_RESTART so a job finishing doesn't
+    // interrupt reading a command line
+    struct sigaction sa;
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
 
-    char buf[BUFSIZ];
-    int bufpos = 0;
+    // lines are read whole, with no length limit
+    char* buf = NULL;
+    size_t bufcap = 0;
     int needprompt = 1;
 
     while (!feof(command_file)) {
@@ -666,12 +1464,13 @@ int main(int argc, char* argv[]) {
             needprompt = 0;
         }
 
-        // Read a string, checking for error or EOF
-        if (fgets(&buf[bufpos], BUFSIZ - bufpos, command_file) == NULL) {
+        // Read a line, checking for error or EOF
+        ssize_t len = getline(&buf, &bufcap, command_file);
+        if (len == -1 || ferror(command_file)) {
+            // a line cut short by an error is never run
             if (ferror(command_file) && errno == EINTR) {
-                // ignore EINTR errors
+                // ignore EINTR errors, dropping any partial line
                 clearerr(command_file);
-                buf[bufpos] = 0;
                 if (si_flag == 1) {    // for SIGINT
                     si_flag = 0;
                     printf("\n");      // newline and prompt
@@ -682,19 +1481,21 @@ int main(int argc, char* argv[]) {
                     perror("sh61");
                 break;
             }
-        }
-
-        // If a complete command line has been provided, run it
-        bufpos = strlen(buf);
-        if (bufpos == BUFSIZ - 1 || (bufpos > 0 && buf[bufpos - 1] == '\n')) {
-            eval_line(buf);
-            bufpos = 0;
+        } else {
+            // run the complete command line
+            eval_line(buf, len);
             needprompt = 1;
         }
 
-        // Handle zombie processes and/or interrupt requests
-        handle_zombies();
+        // Handle zombie processes, and report finished jobs at the prompt
+        if (sigchld_flag) {
+            reap_children(0);
+        }
+        if (needprompt && !quiet) {
+            report_jobs(0);
+        }
     }
 
+    free(buf);
     return 0;
 }
\ No newline at end of file
@@ -2,21 +2,37 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
 #include <netdb.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <errno.h>
 #include <signal.h>
 #include <assert.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include "serverinfo.h"
 
 #define MINDELAY 0.01    // min delay before reconnection attempt
 #define MAXDELAY 128     // max delay for reconnection attempt
-#define MAXTHREADS 30    // max number of threads
+#define MAXTHREADS 30    // # worker threads
 #define MAXCONNECT 30    // max number of connections
-#define BIGBUFSIZ 25000  // bigger buffer size for phase 5
+#define HTTP_BUFSIZ 512  // initial response buffer size
+#define HTTP_MINREAD 256 // min buffer space for a read
+#define HTTP_MAXBUF (1 << 20) // max response buffer size
+#define EV_MAXEVENTS 64  // max events per epoll_wait in event mode
+#define EV_MAXIOV 64     // max requests per writev in event mode
+#define PIPEDEPTH 1      // default max requests pipelined per connection
+#define MOVEQ_SIZE 64    // move queue capacity (a power of 2)
+
+// every worker must be able to hold a connection while it waits its turn
+#if MAXTHREADS > MAXCONNECT
+#error "MAXTHREADS must not exceed MAXCONNECT"
+#endif
 
 static const char* pong_host = PONG_HOST;
 static const char* pong_port = PONG_PORT;
@@ -24,15 +40,13 @@ static const char* pong_user = PONG_USER;
 static struct addrinfo* pong_addr;
 
 int fadetime = -1;           // fade time (-1, doesn't pass fadetime)
-int threadcnt = 0;           // count of concurrent open threads
-struct timespec stopdelay;   // congestion delay time
 
-pthread_mutex_t mutex;
-pthread_mutex_t thrdcntmut;  // thread count mutex
-pthread_mutex_t connpoolmut; // connection pool mutex
-pthread_mutex_t stpdlymut;   // stop delay mutex
-pthread_cond_t condvar;
-pthread_cond_t stpdlycond;   // condition var for stop delay
+pthread_mutex_t connpoolmut; // connection pool wait mutex
+pthread_cond_t poolcond;     // signaled when a pool slot is returned
+pthread_mutex_t moveqmut;    // move queue wait mutex
+pthread_cond_t moveqcond;    // signaled when a move is queued
+pthread_mutex_t ordermut;    // send order mutex
+pthread_cond_t ordercond;    // signaled when the send order advances
 
 
 // ** FUN-MODE vars **
@@ -91,33 +105,292 @@ double elapsed(void) {
     return timestamp() - elapsed_base;
 }
 
-// set_stop_delay
-//   setting the delay time when 'stop' signal is recieved
-//   to allievate congestions.
-void set_stop_delay(int delay_msec) {
-    struct timespec newdelay;
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    int delay_usec = delay_msec * 1000;
-    int tot_usec = now.tv_usec + delay_usec;
-    
-    // convert to sec and nano-sec
-    newdelay.tv_sec = now.tv_sec + (tot_usec/1000000);
-    newdelay.tv_nsec = (tot_usec%1000000)*1000;
-    fprintf(stderr, "delay until %ld.%06ldsec\n",newdelay.tv_sec,newdelay.tv_nsec);
-        
-    // only set delay if longer than current delay
-    pthread_mutex_lock(&stpdlymut);
-    stopdelay.tv_sec = newdelay.tv_sec;
-    stopdelay.tv_nsec = newdelay.tv_nsec;
-    pthread_mutex_unlock(&stpdlymut);
+// ** STATISTICS **
+//    Request phase latencies are recorded in log-linear histograms of
+//    microseconds: values below STAT_SUB have their own buckets, and each
+//    further power of two is split into STAT_SUB/2 buckets, so a bucket
+//    is within 1/16 of its values. Recording is one relaxed atomic add,
+//    so threads never contend on a lock for it.
+
+#define STAT_SUBBITS 5
+#define STAT_SUB (1 << STAT_SUBBITS)
+#define STAT_NBUCKETS (STAT_SUB / 2 * 40)
+
+typedef struct stat_hist {
+    const char* name;
+    atomic_ullong count[STAT_NBUCKETS];
+} stat_hist;
+
+static stat_hist stat_connect = {"connect", {0}};  // connect to established
+static stat_hist stat_send = {"send", {0}};        // queued to written
+static stat_hist stat_header = {"header", {0}};    // queued to headers
+static stat_hist stat_body = {"body", {0}};        // queued to body done
+
+static atomic_ullong stat_done;      // # responses completed
+static atomic_ullong stat_retries;   // # requests retried
+static atomic_ullong stat_stalls;    // # times the congestion window
+                                     //   held back a new request
+static atomic_ullong stat_reuses;    // # requests on an open connection
+static atomic_ullong stat_connects;  // # new connections
+
+static FILE* stat_file;              // periodic stats output, or NULL
+static double stat_interval;         // seconds between stats reports
+
+// stat_bucket(usec)
+//   return the histogram bucket for `usec`
+static int stat_bucket(unsigned long long usec) {
+    if (usec < STAT_SUB) {
+        return (int) usec;
+    }
+    int shift = 63 - __builtin_clzll(usec) - STAT_SUBBITS + 1;
+    int b = shift * STAT_SUB / 2 + (int) (usec >> shift);
+    return b < STAT_NBUCKETS ? b : STAT_NBUCKETS - 1;
+}
+
+// stat_bucket_value(b)
+//   return the smallest value in histogram bucket `b`
+static unsigned long long stat_bucket_value(int b) {
+    if (b < STAT_SUB) {
+        return b;
+    }
+    int shift = b / (STAT_SUB / 2) - 1;
+    return (unsigned long long) (b - shift * STAT_SUB / 2) << shift;
+}
+
+// stat_record(h, sec)
+//   record a latency of `sec` seconds in `h`
+static void stat_record(stat_hist* h, double sec) {
+    unsigned long long usec = sec > 0 ? (unsigned long long) (sec * 1e6) : 0;
+    atomic_fetch_add_explicit(&h->count[stat_bucket(usec)], 1,
+                              memory_order_relaxed);
+}
+
+// stat_count(c)
+//   increment counter `c`
+static inline void stat_count(atomic_ullong* c) {
+    atomic_fetch_add_explicit(c, 1, memory_order_relaxed);
+}
+
+// stat_print_hist(h)
+//   print the count and p50/p99/p999 latencies of `h`. Counts are read
+//   without stopping writers, so they may be off by a few in-flight
+//   records.
+static void stat_print_hist(stat_hist* h) {
+    unsigned long long count[STAT_NBUCKETS], total = 0;
+    for (int b = 0; b < STAT_NBUCKETS; ++b) {
+        count[b] = atomic_load_explicit(&h->count[b], memory_order_relaxed);
+        total += count[b];
+    }
+    static const double qs[] = {0.5, 0.99, 0.999};
+    double ms[3] = {0, 0, 0};
+    unsigned long long seen = 0;
+    int b = 0;
+    for (int i = 0; i < 3 && total > 0; ++i) {
+        // the smallest bucket with at least q of the values at or below it
+        unsigned long long want = (unsigned long long) (qs[i] * total);
+        if (want == 0) {
+            want = 1;
+        }
+        while (seen + count[b] < want) {
+            seen += count[b];
+            ++b;
+        }
+        // report the middle of the bucket
+        ms[i] = (stat_bucket_value(b) + stat_bucket_value(b + 1)) / 2000.0;
+    }
+    fprintf(stat_file, "%.3f sec: stats: %-7s %6llu  p50 %9.3f  "
+            "p99 %9.3f  p999 %9.3f ms\n",
+            elapsed(), h->name, total, ms[0], ms[1], ms[2]);
+}
+
+// stat_thread(arg)
+//   print stats to `stat_file` every `stat_interval` seconds
+static void* stat_thread(void* arg) {
+    (void) arg;
+    unsigned long long last_done = 0;
+    double last = elapsed();
+    while (1) {
+        usleep((long) (stat_interval * 1000000));
+        double now = elapsed();
+        unsigned long long done = atomic_load(&stat_done);
+        fprintf(stat_file, "%.3f sec: stats: %llu done, %.1f req/s "
+                "(%.1f overall), %llu retries, %llu stalls, "
+                "%llu reuses, %llu connects\n", now, done,
+                (done - last_done) / (now - last), done / now,
+                (unsigned long long) atomic_load(&stat_retries),
+                (unsigned long long) atomic_load(&stat_stalls),
+                (unsigned long long) atomic_load(&stat_reuses),
+                (unsigned long long) atomic_load(&stat_connects));
+        stat_print_hist(&stat_connect);
+        stat_print_hist(&stat_send);
+        stat_print_hist(&stat_header);
+        stat_print_hist(&stat_body);
+        fflush(stat_file);
+        last_done = done;
+        last = now;
+    }
+    return NULL;
 }
 
-// reset_stop_delay
-//   helper method to reset the stop delay back to 0
-void reset_stop_delay(void) {
-    stopdelay.tv_sec = 0;
-    stopdelay.tv_nsec = 0;
+
+// ** CONGESTION CONTROL **
+//    The number of requests in flight (sent, and body not yet read) is
+//    limited by an AIMD window. It starts at CC_INITWINDOW and grows by
+//    one per clean response up to `ssthresh` (slow start), then by one
+//    per window. It is halved, at most once per smoothed latency, on a
+//    congestion signal: a stop delay in a response body, a broken
+//    connection, or response-header latency over CC_VEGAS times the
+//    lowest seen (and at least CC_MINQUEUE more). A stop delay also
+//    pauses new requests until it passes.
+
+#define CC_INITWINDOW 4  // initial window
+#define CC_VEGAS 3.0     // header latency / base latency for congestion
+#define CC_MINQUEUE 0.05 // min seconds of queueing for congestion
+#define CC_MINCUT 0.1    // min seconds between window decreases
+
+typedef struct cc_control {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // signaled when the window opens
+    double window;          // # requests allowed in flight
+    double ssthresh;        // slow start threshold
+    double maxwindow;       // upper bound on `window`
+    int inflight;           // # requests in flight
+    double base_rtt;        // lowest header latency seen, or 0
+    double srtt;            // smoothed header latency
+    double pause_until;     // no new requests before this time
+    double last_cut;        // time of the last window decrease
+    int stalled;            // 1 while a new request is held back
+} cc_control;
+
+static cc_control cc;
+
+// cc_init(maxwindow)
+//   initialize congestion control, allowing at most `maxwindow`
+//   requests in flight
+static void cc_init(double maxwindow) {
+    pthread_mutex_init(&cc.lock, NULL);
+    pthread_cond_init(&cc.cond, NULL);
+    cc.window = CC_INITWINDOW < maxwindow ? CC_INITWINDOW : maxwindow;
+    cc.ssthresh = cc.maxwindow = maxwindow;
+    cc.last_cut = -1;
+}
+
+// cc_cut(now)
+//   multiplicative decrease; cc.lock must be held
+static void cc_cut(double now) {
+    double mincut = cc.srtt > CC_MINCUT ? cc.srtt : CC_MINCUT;
+    if (now - cc.last_cut >= mincut) {
+        cc.ssthresh = cc.window / 2 > 1 ? cc.window / 2 : 1;
+        cc.window = cc.ssthresh;
+        cc.last_cut = now;
+    }
+}
+
+// cc_try_acquire(now)
+//   claim a place in the window for a new request. Returns 1 on
+//   success, 0 if the window is full or new requests are paused.
+static int cc_try_acquire(double now) {
+    pthread_mutex_lock(&cc.lock);
+    int ok = now >= cc.pause_until && cc.inflight < (int) cc.window;
+    if (ok) {
+        ++cc.inflight;
+        cc.stalled = 0;
+    } else if (!cc.stalled) {
+        cc.stalled = 1;
+        stat_count(&stat_stalls);
+    }
+    pthread_mutex_unlock(&cc.lock);
+    return ok;
+}
+
+// cc_acquire
+//   claim a place in the window for a new request, waiting until there
+//   is room and any stop delay has passed
+static void cc_acquire(void) {
+    pthread_mutex_lock(&cc.lock);
+    int stalled = 0;
+    while (1) {
+        double now = elapsed();
+        if (!stalled && (now < cc.pause_until
+                         || cc.inflight >= (int) cc.window)) {
+            stalled = 1;
+            stat_count(&stat_stalls);
+        }
+        if (now < cc.pause_until) {
+            double until = elapsed_base + cc.pause_until;
+            struct timespec ts;
+            ts.tv_sec = (time_t) until;
+            ts.tv_nsec = (long) ((until - ts.tv_sec) * 1e9);
+            pthread_cond_timedwait(&cc.cond, &cc.lock, &ts);
+        } else if (cc.inflight >= (int) cc.window) {
+            pthread_cond_wait(&cc.cond, &cc.lock);
+        } else {
+            break;
+        }
+    }
+    ++cc.inflight;
+    pthread_mutex_unlock(&cc.lock);
+}
+
+// cc_latency(latency)
+//   record the header latency of a request; a latency far above the
+//   lowest seen means the server is queueing requests
+static void cc_latency(double latency) {
+    pthread_mutex_lock(&cc.lock);
+    if (cc.base_rtt == 0 || latency < cc.base_rtt) {
+        cc.base_rtt = latency;
+    }
+    cc.srtt = cc.srtt == 0 ? latency : 0.875 * cc.srtt + 0.125 * latency;
+    if (latency > CC_VEGAS * cc.base_rtt
+        && latency > cc.base_rtt + CC_MINQUEUE) {
+        cc_cut(elapsed());
+    }
+    pthread_mutex_unlock(&cc.lock);
+}
+
+// cc_congestion
+//   a request's connection broke
+static void cc_congestion(void) {
+    pthread_mutex_lock(&cc.lock);
+    cc_cut(elapsed());
+    pthread_mutex_unlock(&cc.lock);
+}
+
+// cc_release(stop_msec)
+//   a request in flight is done, and its response asked for a stop delay
+//   of `stop_msec` milliseconds (0 if none). A negative `stop_msec`
+//   means the request ended without a response, and gives no signal.
+static void cc_release(double stop_msec) {
+    pthread_mutex_lock(&cc.lock);
+    --cc.inflight;
+    double now = elapsed();
+    if (stop_msec > 0) {
+        // congestion occuring, so set stop delay
+        if (now + stop_msec / 1000 > cc.pause_until) {
+            cc.pause_until = now + stop_msec / 1000;
+        }
+        fprintf(stderr, "delay until %.3f sec\n", cc.pause_until);
+        cc_cut(now);
+    } else if (stop_msec == 0) {
+        cc.window += cc.window < cc.ssthresh ? 1 : 1 / cc.window;
+        if (cc.window > cc.maxwindow) {
+            cc.window = cc.maxwindow;
+        }
+    }
+    pthread_cond_broadcast(&cc.cond);
+    pthread_mutex_unlock(&cc.lock);
+}
+
+// cc_backoff(delay, seed)
+//   double retry delay `*delay`, up to MAXDELAY, and return a jittered
+//   wait in [*delay/2, *delay], so that retries spread out
+static double cc_backoff(double* delay, unsigned* seed) {
+    if (*delay >= MAXDELAY) {
+        *delay = MAXDELAY;
+    } else {
+        *delay = 2 * *delay;
+    }
+    return *delay / 2 + *delay / 2 * rand_r(seed) / RAND_MAX;
 }
 
 
@@ -135,8 +408,13 @@ struct http_connection {
     int has_content_length; // 1 iff Content-Length was provided
     int eof;                // 1 iff connection EOF has been reached
 
-    char buf[BIGBUFSIZ];    // Response buffer
-    size_t len;             // Length of response buffer
+    char* mem;              // Response buffer, grown on demand
+    size_t cap;             // Size of `mem`
+    char* buf;              // Unparsed response data, in `mem`
+    size_t len;             // Length of unparsed response data
+    size_t scan;            // # bytes of `buf` searched for a line end
+
+    int pool_slot;          // Index in `connectionpool`, or -1
 };
 
 http_connection *connectionpool[MAXCONNECT]; // connection table
@@ -158,6 +436,24 @@ static int http_check_response_body(http_connection* conn);
 static void usage(void);
 
 
+// http_connection_init(fd)
+//    Return a new `http_connection` object for connected socket `fd`.
+static http_connection* http_connection_init(int fd) {
+    http_connection* conn =
+        (http_connection*) malloc(sizeof(http_connection));
+    conn->fd = fd;
+    conn->state = HTTP_REQUEST;
+    conn->eof = 0;
+    conn->mem = (char*) malloc(HTTP_BUFSIZ);
+    conn->cap = HTTP_BUFSIZ;
+    conn->buf = conn->mem;
+    conn->len = 0;
+    conn->scan = 0;
+    conn->pool_slot = -1;
+    return conn;
+}
+
+
 // http_connect(ai)
 //    Open a new connection to the server described by `ai`. Returns a new
 //    `http_connection` object for that server connection. Exits with an
@@ -180,12 +476,38 @@ http_connection* http_connect(const struct addrinfo* ai) {
     }
 
     // construct an http_connection object for this connection
-    http_connection* conn =
-        (http_connection*) malloc(sizeof(http_connection));
-    conn->fd = fd;
-    conn->state = HTTP_REQUEST;
-    conn->eof = 0;
-    return conn;
+    return http_connection_init(fd);
+}
+
+
+// http_connect_async(ai, connecting)
+//    Like http_connect, but the connection's socket is non-blocking, and
+//    the connect may still be in progress on return; if so, sets
+//    `*connecting` to 1, and the socket becomes writable once it
+//    completes. Returns NULL if the connection fails at once.
+http_connection* http_connect_async(const struct addrinfo* ai,
+                                    int* connecting) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    int yes = 1;
+    (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    *connecting = 0;
+    int r = connect(fd, ai->ai_addr, ai->ai_addrlen);
+    if (r < 0 && errno == EINPROGRESS) {
+        *connecting = 1;
+    } else if (r < 0) {
+        perror("connect");
+        close(fd);
+        return NULL;
+    }
+
+    return http_connection_init(fd);
 }
 
 
@@ -193,40 +515,192 @@ http_connection* http_connect(const struct addrinfo* ai) {
 //    Close the HTTP connection `conn` and free its resources.
 void http_close(http_connection* conn) {
     close(conn->fd);
+    free(conn->mem);
     free(conn);
 }
 
+
+// http_read(conn)
+//    Read more response data from `conn` after its unparsed data. When
+//    too little space is left at the end of the buffer, the unparsed data
+//    is first moved to the front, and the buffer doubled if that is not
+//    enough. One byte is always kept free to null-terminate the data.
+//    Returns the `read` result, and sets `conn->eof` at EOF; returns -1
+//    with `errno` ENOBUFS if the response outgrows HTTP_MAXBUF.
+ssize_t http_read(http_connection* conn) {
+    size_t used = (conn->buf - conn->mem) + conn->len;
+    if (conn->cap - used < HTTP_MINREAD + 1) {
+        if (conn->cap - conn->len < HTTP_MINREAD + 1) {
+            size_t cap = conn->cap * 2;
+            if (cap > HTTP_MAXBUF) {
+                errno = ENOBUFS;
+                return -1;
+            }
+            char* mem = (char*) malloc(cap);
+            memcpy(mem, conn->buf, conn->len);
+            free(conn->mem);
+            conn->mem = mem;
+            conn->cap = cap;
+        } else {
+            memmove(conn->mem, conn->buf, conn->len);
+        }
+        conn->buf = conn->mem;
+        used = conn->len;
+    }
+
+    ssize_t nr = read(conn->fd, &conn->mem[used], conn->cap - used - 1);
+    if (nr == 0) {
+        conn->eof = 1;
+    } else if (nr > 0) {
+        conn->len += nr;
+    }
+    return nr;
+}
+
+// ** CONNECTION POOL **
+//    Slots of `connectionpool` are handed out through two lock-free
+//    stacks: `pool_idle` holds the slots of open connections that are
+//    done and free for reuse, and `pool_empty` the unused slots. Popping
+//    a slot claims it, so no two threads get the same connection.
+//    Threads that find both stacks empty wait on `poolcond` until a slot
+//    is returned.
+
+// pool_stack
+//    A lock-free stack of connection pool slots. `head` holds the top
+//    slot + 1 (0 if empty) in its low 32 bits, and a modification count
+//    above, so a slot popped and pushed back meanwhile can't fool a pop.
+typedef struct pool_stack {
+    _Atomic unsigned long long head;
+    atomic_int next[MAXCONNECT];    // slot below each slot + 1
+} pool_stack;
+
+static pool_stack pool_idle;
+static pool_stack pool_empty;
+static atomic_int pool_waiters;     // # threads waiting for a slot
+
+// pool_push(st, slot)
+//   push `slot` onto stack `st`
+static void pool_push(pool_stack* st, int slot) {
+    unsigned long long head = atomic_load(&st->head);
+    unsigned long long newhead;
+    do {
+        atomic_store_explicit(&st->next[slot], (int) (head & 0xFFFFFFFF),
+                              memory_order_relaxed);
+        newhead = (((head >> 32) + 1) << 32) | (unsigned) (slot + 1);
+    } while (!atomic_compare_exchange_weak(&st->head, &head, newhead));
+}
+
+// pool_pop(st)
+//   pop and return the top slot of stack `st`, or -1 if it is empty
+static int pool_pop(pool_stack* st) {
+    unsigned long long head = atomic_load(&st->head);
+    unsigned long long newhead;
+    do {
+        int top = (int) (head & 0xFFFFFFFF);
+        if (top == 0) {
+            return -1;
+        }
+        int next = atomic_load_explicit(&st->next[top - 1],
+                                        memory_order_relaxed);
+        newhead = (((head >> 32) + 1) << 32) | (unsigned) next;
+    } while (!atomic_compare_exchange_weak(&st->head, &head, newhead));
+    return (int) (head & 0xFFFFFFFF) - 1;
+}
+
+// pool_claim
+//   claim an idle connection's slot, or else an unused slot. Returns -1
+//   if every slot is in use.
+static int pool_claim(void) {
+    int slot = pool_pop(&pool_idle);
+    return slot >= 0 ? slot : pool_pop(&pool_empty);
+}
+
 // get_connection
-//   Looks in the connectino table for existing threads it can use.
-//   If no reusable threads are found then a new one is initialized by
-//   calling http_connect(). If no connections are free then NULL is 
-//   returned to the caller.
+//   Claims a reusable connection from the pool, or opens a new one with
+//   http_connect() in an unused slot. If every slot is in use, waits
+//   for one to be returned by put_connection().
 http_connection* get_connection(const struct addrinfo* ai) {
-    int free_slot = -1;
-    pthread_mutex_lock(&connpoolmut);
-    // look for existing connection, that can be used
-    for (int i=0; i < MAXCONNECT; i++) {
-        // connection can be reused if it's not null and has finished,
-        // indicated by the HTTP_DONE state.
-        if (connectionpool[i] != NULL && connectionpool[i]->state == HTTP_DONE) {
-            pthread_mutex_unlock(&connpoolmut);
-            return connectionpool[i];
-        } else if (connectionpool[i] == NULL && free_slot == -1) {
-            // An uninitialized connection is identified as a NULL slot.
-            // note place of first free slot
-            free_slot = i;
+    int slot = pool_claim();
+    if (slot < 0) {
+        pthread_mutex_lock(&connpoolmut);
+        atomic_fetch_add(&pool_waiters, 1);
+        while ((slot = pool_claim()) < 0) {
+            pthread_cond_wait(&poolcond, &connpoolmut);
         }
+        atomic_fetch_sub(&pool_waiters, 1);
+        pthread_mutex_unlock(&connpoolmut);
     }
-    
-    // if no existing is found then init another, in an unused slot !!!
-    if (free_slot != -1) {
-        connectionpool[free_slot] = http_connect(ai);
+
+    if (connectionpool[slot] == NULL) {
+        double start = elapsed();
+        connectionpool[slot] = http_connect(ai);
+        connectionpool[slot]->pool_slot = slot;
+        stat_record(&stat_connect, elapsed() - start);
+        stat_count(&stat_connects);
+    } else {
+        stat_count(&stat_reuses);
+    }
+    return connectionpool[slot];
+}
+
+// put_connection(conn)
+//   Returns claimed connection `conn` to the pool: for reuse if it is
+//   done, else it is closed and its slot freed. Wakes a waiting thread.
+void put_connection(http_connection* conn) {
+    int slot = conn->pool_slot;
+    if (conn->state == HTTP_DONE) {
+        pool_push(&pool_idle, slot);
+    } else {
+        http_close(conn);
+        connectionpool[slot] = NULL;
+        pool_push(&pool_empty, slot);
+    }
+    // a waiter counts itself before it checks the pool, so either it
+    // sees this slot or we see it
+    if (atomic_load(&pool_waiters) > 0) {
+        pthread_mutex_lock(&connpoolmut);
+        pthread_cond_signal(&poolcond);
         pthread_mutex_unlock(&connpoolmut);
-        return connectionpool[free_slot];
     }
-    pthread_mutex_unlock(&connpoolmut);
-    // if no connection currently available, then return NULL
-    return NULL;
+}
+
+
+// http_format_request(buf, sz, uri, pipelined)
+//    Write an HTTP POST request for `uri` into `buf`, which is `sz` bytes
+//    long, and return its length. A `pipelined` request is HTTP/1.1, so
+//    that more requests may be queued behind it on the connection;
+//    otherwise it is HTTP/1.0 with keep-alive.
+size_t http_format_request(char* buf, size_t sz, const char* uri,
+                           int pipelined) {
+    int n;
+    if (pipelined) {
+        n = snprintf(buf, sz,
+                     "POST /%s/%s HTTP/1.1\r\n"
+                     "Host: %s\r\n"
+                     "Content-Length: 0\r\n"
+                     "\r\n",
+                     pong_user, uri, pong_host);
+    } else {
+        n = snprintf(buf, sz,
+                     "POST /%s/%s HTTP/1.0\r\n"
+                     "Host: %s\r\n"
+                     "Connection: keep-alive\r\n"
+                     "\r\n",
+                     pong_user, uri, pong_host);
+    }
+    assert(n > 0 && (size_t) n < sz);
+    return n;
+}
+
+
+// http_response_reset(conn)
+//    Clear response information, to parse the next response on `conn`.
+void http_response_reset(http_connection* conn) {
+    conn->state = HTTP_INITIAL;
+    conn->status_code = -1;
+    conn->content_length = 0;
+    conn->has_content_length = 0;
+    conn->scan = 0;
 }
 
 
@@ -238,18 +712,18 @@ void http_send_request(http_connection* conn, const char* uri) {
 
     // prepare and write the request
     char reqbuf[BUFSIZ];
-    size_t reqsz = sprintf(reqbuf,
-                           "POST /%s/%s HTTP/1.0\r\n"
-                           "Host: %s\r\n"
-                           "Connection: keep-alive\r\n"
-                           "\r\n",
-                           pong_user, uri, pong_host);
+    size_t reqsz = http_format_request(reqbuf, sizeof(reqbuf), uri, 0);
     size_t pos = 0;
     while (pos < reqsz) {
         ssize_t nw = write(conn->fd, &reqbuf[pos], reqsz - pos);
         if (nw == 0)
             break;
-        else if (nw == -1 && errno != EINTR && errno != EAGAIN) {
+        else if (nw == -1 && (errno == EPIPE || errno == ECONNRESET)) {
+            // the server dropped a reused connection; the caller retries
+            http_response_reset(conn);
+            conn->state = HTTP_BROKEN;
+            return;
+        } else if (nw == -1 && errno != EINTR && errno != EAGAIN) {
             perror("write");
             exit(1);
         } else if (nw != -1)
@@ -263,10 +737,8 @@ void http_send_request(http_connection* conn, const char* uri) {
     }
 
     // clear response information
-    conn->state = HTTP_INITIAL;
-    conn->status_code = -1;
-    conn->content_length = 0;
-    conn->has_content_length = 0;
+    http_response_reset(conn);
+    conn->buf = conn->mem;
     conn->len = 0;
 }
 
@@ -283,14 +755,14 @@ void http_receive_response_headers(http_connection* conn) {
     // read & parse data until told `http_process_response_headers`
     // tells us to stop
     while (http_process_response_headers(conn)) {
-        ssize_t nr = read(conn->fd, &conn->buf[conn->len], BIGBUFSIZ);
-        if (nr == 0)
+        ssize_t nr = http_read(conn);
+        if (nr == -1 && errno == ECONNRESET) {
+            // a reset connection is treated like EOF, and retried
             conn->eof = 1;
-        else if (nr == -1 && errno != EINTR && errno != EAGAIN) {
+        } else if (nr == -1 && errno != EINTR && errno != EAGAIN) {
             perror("read");
             exit(1);
-        } else if (nr != -1)
-            conn->len += nr;
+        }
     }
 
     // Status codes >= 500 mean we are overloading the server
@@ -315,14 +787,14 @@ void http_receive_response_body(http_connection* conn) {
 
     // read response body (http_check_response_body tells us when to stop)
     while (http_check_response_body(conn)) {
-        ssize_t nr = read(conn->fd, &conn->buf[conn->len], BIGBUFSIZ);
-        if (nr == 0)
+        ssize_t nr = http_read(conn);
+        if (nr == -1 && errno == ECONNRESET) {
+            // a reset connection is treated like EOF, and retried
             conn->eof = 1;
-        else if (nr == -1 && errno != EINTR && errno != EAGAIN) {
+        } else if (nr == -1 && errno != EINTR && errno != EAGAIN) {
             perror("read");
             exit(1);
-        } else if (nr != -1)
-            conn->len += nr;
+        }
     }
 
     // null-terminate body
@@ -334,6 +806,7 @@ void http_receive_response_body(http_connection* conn) {
 //    Truncate the `conn` response text to a manageable length and return
 //    that truncated text. Useful for error messages.
 char* http_truncate_response(http_connection* conn) {
+    conn->buf[conn->len] = 0;
     char *eol = strchr(conn->buf, '\n');
     if (eol)
         *eol = 0;
@@ -345,90 +818,781 @@ char* http_truncate_response(http_connection* conn) {
 
 // ** MAIN PROGRAM **
 
-typedef struct pong_args {
+// pong_move
+//    A ball position to send. Moves are numbered in board order by `seq`.
+typedef struct pong_move {
     int x;
     int y;
-} pong_args;
+    unsigned long long seq;
+} pong_move;
+
+
+// pong_board
+//    The ball's position on the board. In fun-mode (nocheck), the
+//    position steps through the dots of the clock display instead.
+typedef struct pong_board {
+    int width;
+    int height;
+    int nocheck;
+    int x, y, dx, dy;
+    // fun-mode vars
+    int f_indx;
+    int digcnt;
+    int xoffset;
+    int yoffset;
+    int clock_updated;      // 1 once the whole clock has been drawn
+} pong_board;
+
+// board_init(b, width, height, nocheck)
+//   start the ball at the top-left corner of a `width`x`height` board
+static void board_init(pong_board* b, int width, int height, int nocheck) {
+    memset(b, 0, sizeof(*b));
+    b->width = width;
+    b->height = height;
+    b->nocheck = nocheck;
+    b->dx = b->dy = 1;
+    b->xoffset = width/3;
+    b->yoffset = 1;
+}
 
+// board_reset_clock(b)
+//   fun-mode: move back to the first digit, and show the new time
+static void board_reset_clock(pong_board* b) {
+    b->digcnt = 0;
+    b->xoffset = b->width/3;
+    b->yoffset = 1;
+    b->clock_updated = 0;
+    update_clock_time();
+}
 
-// pong_thread(threadarg)
-//    Connect to the server at the position indicated by `threadarg`
-//    (which is a pointer to a `pong_args` structure).
-void* pong_thread(void* threadarg) {
-    pthread_detach(pthread_self());
+// board_dot(b)
+//   pick the position of the next dot in (b->x, b->y). Returns 1 if a
+//   dot should be sent there, 0 if it is a blank part of the clock.
+static int board_dot(pong_board* b) {
+    if (b->nocheck == 0) {
+        return 1;
+    }
+    // fun-mode - (clock functionality)
+    // displays current time,
+    // waits a few seconds
+    // then updates and display new time
+    int do_send_dot = 0;
+    if (digit[currtime[b->digcnt]][b->f_indx] == 1) {
+        b->x = digpos[b->f_indx][0] + b->xoffset;
+        b->y = digpos[b->f_indx][1] + b->yoffset;
+        do_send_dot = 1;
+    }
 
-    // Copy thread arguments onto our stack.
-    pong_args pa = *((pong_args*) threadarg);
+    if (b->f_indx < 14) {
+        ++b->f_indx;
+    } else {
+        b->f_indx = 0;
+        if (b->digcnt < 5) {
+            ++b->digcnt;
+            if (b->digcnt == 2 || b->digcnt == 4) {
+                // end of hrs, and mins
+                b->xoffset = b->width/3;
+                b->yoffset +=6;
+            } else if (b->xoffset < (b->width - 8)) {
+                b->xoffset += 4;
+            } else {
+                b->xoffset = 0; // reset if we hit edge
+            }
+        } else {
+            b->clock_updated = 1;
+        }
+    }
+    return do_send_dot;
+}
 
-    char url[256];
+// board_move(b)
+//   move the ball one step, bouncing off the edges
+static void board_move(pong_board* b) {
+    if (b->nocheck == 0) {
+        b->x += b->dx;
+        b->y += b->dy;
+        if (b->x < 0 || b->x >= b->width) {
+            b->dx = -b->dx;
+            b->x += 2 * b->dx;
+        }
+        if (b->y < 0 || b->y >= b->height) {
+            b->dy = -b->dy;
+            b->y += 2 * b->dy;
+        }
+    }
+}
+
+// pong_url(url, sz, x, y)
+//   write the move RPC for position (x, y) into `url`, `sz` bytes long
+static void pong_url(char* url, size_t sz, int x, int y) {
     if (fadetime == -1) {
-        snprintf(url, sizeof(url), "move?x=%d&y=%d&style=on",
-             pa.x, pa.y);
+        snprintf(url, sz, "move?x=%d&y=%d&style=on", x, y);
     } else {
-        snprintf(url, sizeof(url), "move?x=%d&y=%d&style=on&fade=%d",
-             pa.x, pa.y, fadetime);
+        snprintf(url, sz, "move?x=%d&y=%d&style=on&fade=%d",
+             x, y, fadetime);
+    }
+}
+
+
+// ** MOVE QUEUE **
+//    The main loop queues moves for the worker threads in a bounded
+//    lock-free queue. Each cell's `turn` says whose it is: a cell is free
+//    for the push at position `pos` when `turn == pos`, and holds that
+//    move for the pop at `pos` when `turn == pos + 1`. A worker that
+//    finds the queue empty sleeps on `moveqcond`.
+//
+//    Moves may be sent only in board order: each worker waits until
+//    `order_next` reaches its move's `seq`, and advances it once the
+//    server has accepted the move (returned 200 headers).
+
+typedef struct move_cell {
+    atomic_ullong turn;
+    pong_move move;
+} move_cell;
+
+static struct {
+    move_cell cell[MOVEQ_SIZE];
+    atomic_ullong head;         // position of the next pop
+    atomic_ullong tail;         // position of the next push
+    atomic_int waiters;         // # workers waiting on `moveqcond`
+} moveq;
+
+static unsigned long long order_next; // seq of the next move to send,
+                                      //   protected by `ordermut`
+
+// moveq_init
+//   make the move queue empty
+static void moveq_init(void) {
+    for (int i = 0; i < MOVEQ_SIZE; ++i) {
+        atomic_init(&moveq.cell[i].turn, i);
+    }
+}
+
+// moveq_push(m)
+//   add move `m` to the queue. Returns 0 if the queue is full, else 1.
+static int moveq_push(const pong_move* m) {
+    unsigned long long pos = atomic_load(&moveq.tail);
+    move_cell* c;
+    while (1) {
+        c = &moveq.cell[pos % MOVEQ_SIZE];
+        long long diff = (long long) (atomic_load(&c->turn) - pos);
+        if (diff == 0
+            && atomic_compare_exchange_weak(&moveq.tail, &pos, pos + 1)) {
+            break;
+        } else if (diff < 0) {
+            return 0;
+        } else if (diff > 0) {
+            pos = atomic_load(&moveq.tail);
+        }
+    }
+    c->move = *m;
+    atomic_store(&c->turn, pos + 1);
+
+    // a waiter counts itself before it checks the queue, so either it
+    // sees this move or we see it
+    if (atomic_load(&moveq.waiters) > 0) {
+        pthread_mutex_lock(&moveqmut);
+        pthread_cond_signal(&moveqcond);
+        pthread_mutex_unlock(&moveqmut);
+    }
+    return 1;
+}
+
+// moveq_pop(m)
+//   remove the oldest move into `*m`. Returns 0 if the queue is empty,
+//   else 1.
+static int moveq_pop(pong_move* m) {
+    unsigned long long pos = atomic_load(&moveq.head);
+    move_cell* c;
+    while (1) {
+        c = &moveq.cell[pos % MOVEQ_SIZE];
+        long long diff = (long long) (atomic_load(&c->turn) - (pos + 1));
+        if (diff == 0
+            && atomic_compare_exchange_weak(&moveq.head, &pos, pos + 1)) {
+            break;
+        } else if (diff < 0) {
+            return 0;
+        } else if (diff > 0) {
+            pos = atomic_load(&moveq.head);
+        }
+    }
+    *m = c->move;
+    atomic_store(&c->turn, pos + MOVEQ_SIZE);
+    return 1;
+}
+
+// moveq_take(m)
+//   remove the oldest move into `*m`, waiting for one if the queue is
+//   empty
+static void moveq_take(pong_move* m) {
+    if (!moveq_pop(m)) {
+        pthread_mutex_lock(&moveqmut);
+        atomic_fetch_add(&moveq.waiters, 1);
+        while (!moveq_pop(m)) {
+            pthread_cond_wait(&moveqcond, &moveqmut);
+        }
+        atomic_fetch_sub(&moveq.waiters, 1);
+        pthread_mutex_unlock(&moveqmut);
+    }
+}
+
+// order_wait(seq)
+//   wait until move `seq` may be sent
+static void order_wait(unsigned long long seq) {
+    pthread_mutex_lock(&ordermut);
+    while (order_next != seq) {
+        pthread_cond_wait(&ordercond, &ordermut);
     }
+    pthread_mutex_unlock(&ordermut);
+}
+
+// order_advance(seq)
+//   move `seq` was accepted, so let the next move be sent
+static void order_advance(unsigned long long seq) {
+    pthread_mutex_lock(&ordermut);
+    order_next = seq + 1;
+    pthread_cond_broadcast(&ordercond);
+    pthread_mutex_unlock(&ordermut);
+}
+
+
+// pong_move_send(m)
+//    Send move `m` to the server once it is `m`'s turn, retrying until
+//    the server accepts it, and read the response.
+static void pong_move_send(const pong_move* m) {
+    char url[256];
+    pong_url(url, sizeof(url), m->x, m->y);
              
     int connstat = -1;    	      // connection status loop check !!!
     double delay = MINDELAY/2;    // just start min_delay as half, cause it is doubled
+    unsigned seed = (unsigned) pthread_self() ^ (m->x << 16) ^ m->y;
     http_connection* conn;
+    double sent;                  // time the last try was sent
     while (connstat != 200) {
-        while ((conn = get_connection(pong_addr)) == NULL) {
-            // if no connection available, sleep for a bit and try again
-            usleep(100000);
-        };
+        conn = get_connection(pong_addr);
+        order_wait(m->seq);
+        sent = elapsed();
         http_send_request(conn, url);
+        stat_record(&stat_send, elapsed() - sent);
         http_receive_response_headers(conn);
         connstat = conn->status_code;
         
-        if (conn->status_code == -1) {
-            // close conn and retry with exponential back-off !!!
-            pthread_mutex_lock(&connpoolmut);
-            // if connection errors out, then shut it down !!!
-            for (int i = 0; i < MAXCONNECT; i++) {
-                if (connectionpool[i] == conn) {
-                    connectionpool[i] = NULL;
-                    http_close(conn);
-                }
-            }
-            pthread_mutex_unlock(&connpoolmut);
+        if (conn->status_code != 200) {
+            // close conn and retry with jittered exponential back-off !!!
+            // (its response is unfinished, so it won't be reused)
+            put_connection(conn);
+            cc_congestion();
+            stat_count(&stat_retries);
         
-            if (delay >= MAXDELAY) {
-                delay = MAXDELAY;
-            } else {
-                delay = 2*delay;
-            }
+            double wait = cc_backoff(&delay, &seed);
             fprintf(stderr, "%.3f sec: warning: %d,%d: "
                     "server returned status %d (expected 200), retrying in %.2f sec\n",
-                    elapsed(), pa.x, pa.y, connstat, delay);
-            usleep((long) (delay * 1000000));
+                    elapsed(), m->x, m->y, connstat, wait);
+            usleep((long) (wait * 1000000));
+        } else {
+            stat_record(&stat_header, elapsed() - sent);
+            cc_latency(elapsed() - sent);
         }
     }
-    // allowing main thread to continue after recieving header
-    pthread_cond_signal(&condvar);
+    // the server has the move, so the next one may be sent
+    order_advance(m->seq);
     http_receive_response_body(conn);
+    if (conn->state != HTTP_DONE && conn->state != HTTP_CLOSED) {
+        // broke mid-body: the move stands, but it is no clean response
+        put_connection(conn);
+        cc_congestion();
+        cc_release(-1);
+        return;
+    }
+    stat_record(&stat_body, elapsed() - sent);
+    stat_count(&stat_done);
     double result = strtod(conn->buf, NULL);
     if (result < 0) {
         fprintf(stderr, "%.3f sec: server returned error: %s\n",
                 elapsed(), http_truncate_response(conn));
         exit(1);
-    } else if (result > 0) {
-        // congestion occuring, so set stop delay
-        set_stop_delay(result);
     }
+    put_connection(conn);
+    cc_release(result);
+}
 
-    // thread exiting, so decrement thread count
-    pthread_mutex_lock(&thrdcntmut);
-    --threadcnt;
-    pthread_mutex_unlock(&thrdcntmut);
-    pthread_exit(NULL);
+// pong_worker(arg)
+//    Send queued moves, forever.
+static void* pong_worker(void* arg) {
+    (void) arg;
+    pthread_detach(pthread_self());
+    while (1) {
+        pong_move m;
+        moveq_take(&m);
+        pong_move_send(&m);
+    }
+    return NULL;
+}
+
+
+// ** EVENT-DRIVEN ENGINE **
+//    With `-e`, one thread drives every request through the
+//    `http_connection` states with epoll over non-blocking sockets,
+//    instead of a thread per ball position. As in the threaded engine,
+//    the next position is sent only once the previous one's response
+//    headers have arrived, and after any stop delay; response bodies
+//    complete in any order.
+//
+//    Requests are HTTP/1.1 and pipelined: up to `ev.depth` of them may be
+//    queued on one connection, and its responses arrive in order. A new
+//    request takes an idle connection, else a new one, else the open
+//    connection with the fewest requests. The requests queued in one pass
+//    of the loop are sent with one `writev` per connection.
+
+typedef struct ev_conn ev_conn;
+typedef struct ev_request ev_request;
+
+// ev_request
+//    A ball position in flight.
+struct ev_request {
+    int x;
+    int y;
+    double delay;           // retry back-off delay
+    double start_at;        // time to retry, or -1 to start when a
+                            // connection is free
+    int accepted;           // 1 once the server returned 200 headers
+    double sent_at;         // time the request was last queued to send
+    char text[512];         // request text
+    size_t len;             // length of request text
+    ev_request* next;       // next request waiting, or on its connection
+};
+
+// ev_conn
+//    An open connection, and the requests pipelined on it.
+struct ev_conn {
+    http_connection* conn;
+    int connecting;         // 1 while the connect is in progress
+    int events;             // epoll events watched
+    ev_request* head;       // requests on conn, oldest first; the
+    ev_request* tail;       //   response being read is head's
+    int depth;              // # requests on conn
+    ev_request* unsent;     // oldest request not fully written, or NULL
+    size_t unsent_off;      // # bytes of `unsent` already written
+    int index;              // index in `ev.conns`
+    double opened_at;       // time the connect started
+};
+
+static struct {
+    int epfd;
+    int maxconn;            // max # open connections
+    int depth;              // max # requests pipelined on a connection
+    ev_conn** conns;        // open connections
+    int nconn;
+    ev_request* waitq;      // requests waiting to start, oldest first
+    ev_request* blocker;    // latest position, until headers arrive
+    double next_send;       // earliest time to send the next position,
+                            //   set while fun-mode shows the clock
+    unsigned seed;          // retry jitter random seed
+} ev;
+
+
+// ev_queue(req, start_at)
+//   add `req` to the wait queue, to start at `start_at`
+static void ev_queue(ev_request* req, double start_at) {
+    req->start_at = start_at;
+    req->next = NULL;
+    ev_request** pp = &ev.waitq;
+    while (*pp) {
+        pp = &(*pp)->next;
+    }
+    *pp = req;
+}
+
+// ev_retry(req, status)
+//   retry `req`, whose connection broke, with jittered exponential
+//   back-off; it keeps its place in the congestion window
+static void ev_retry(ev_request* req, int status) {
+    double wait = cc_backoff(&req->delay, &ev.seed);
+    stat_count(&stat_retries);
+    fprintf(stderr, "%.3f sec: warning: %d,%d: "
+            "server returned status %d (expected 200), retrying in %.2f sec\n",
+            elapsed(), req->x, req->y, status, wait);
+    ev_queue(req, elapsed() + wait);
+}
+
+// ev_watch(ec, events)
+//   watch `ec`'s socket for `events`
+static void ev_watch(ev_conn* ec, int events) {
+    if (ec->events != events) {
+        struct epoll_event e;
+        e.events = events;
+        e.data.ptr = ec;
+        epoll_ctl(ev.epfd, EPOLL_CTL_MOD, ec->conn->fd, &e);
+        ec->events = events;
+    }
+}
+
+// ev_open()
+//   open a new connection, or return NULL if the connect fails
+static ev_conn* ev_open(void) {
+    int connecting;
+    http_connection* conn = http_connect_async(pong_addr, &connecting);
+    if (conn == NULL) {
+        return NULL;
+    }
+    ev_conn* ec = (ev_conn*) calloc(1, sizeof(ev_conn));
+    ec->conn = conn;
+    ec->connecting = connecting;
+    ec->opened_at = elapsed();
+    stat_count(&stat_connects);
+    if (!connecting) {
+        stat_record(&stat_connect, 0);
+    }
+    // the socket is writable once the connect completes
+    ec->events = connecting ? EPOLLOUT : EPOLLIN;
+    struct epoll_event e;
+    e.events = ec->events;
+    e.data.ptr = ec;
+    epoll_ctl(ev.epfd, EPOLL_CTL_ADD, conn->fd, &e);
+    ec->index = ev.nconn;
+    ev.conns[ev.nconn++] = ec;
+    return ec;
+}
+
+// ev_close(ec)
+//   close connection `ec`, which has no requests left
+static void ev_close(ev_conn* ec) {
+    assert(ec->head == NULL);
+    http_close(ec->conn);
+    ev.conns[ec->index] = ev.conns[--ev.nconn];
+    ev.conns[ec->index]->index = ec->index;
+    free(ec);
+}
+
+// ev_conn_fail(ec)
+//   connection `ec` broke: retry its requests, except one the server
+//   already accepted, and close it
+static void ev_conn_fail(ev_conn* ec) {
+    int status = ec->conn->status_code;
+    cc_congestion();
+    while (ec->head != NULL) {
+        ev_request* req = ec->head;
+        ec->head = req->next;
+        if (req->accepted) {
+            cc_release(-1);
+            free(req);
+        } else {
+            ev_retry(req, status);
+        }
+        status = -1;
+    }
+    ec->tail = NULL;
+    ev_close(ec);
+}
+
+// ev_enqueue(ec, req)
+//   queue `req` on connection `ec`, to be sent by ev_flush()
+static void ev_enqueue(ev_conn* ec, ev_request* req) {
+    if (ec->depth == 0) {
+        http_response_reset(ec->conn);
+        ec->conn->buf = ec->conn->mem;
+        ec->conn->len = 0;
+    }
+    req->next = NULL;
+    if (ec->tail != NULL) {
+        ec->tail->next = req;
+    } else {
+        ec->head = req;
+    }
+    ec->tail = req;
+    ++ec->depth;
+    req->sent_at = elapsed();
+    if (ec->unsent == NULL) {
+        ec->unsent = req;
+        ec->unsent_off = 0;
+    }
+}
+
+// ev_start(req)
+//   queue `req` on a connection, or on the wait queue until one of the
+//   `ev.maxconn` connections has room
+static void ev_start(ev_request* req) {
+    ev_conn* best = NULL;
+    for (int i = 0; i < ev.nconn; ++i) {
+        ev_conn* ec = ev.conns[i];
+        if (ec->depth < ev.depth && (best == NULL || ec->depth < best->depth)) {
+            best = ec;
+        }
+    }
+    if ((best == NULL || best->depth > 0) && ev.nconn < ev.maxconn) {
+        ev_conn* ec = ev_open();
+        if (ec == NULL) {
+            ev_queue(req, elapsed() + MINDELAY);
+            return;
+        }
+        best = ec;
+    } else if (best != NULL) {
+        stat_count(&stat_reuses);
+    }
+    if (best == NULL) {
+        ev_queue(req, -1);
+        return;
+    }
+    ev_enqueue(best, req);
+}
+
+// ev_flush(ec)
+//   write `ec`'s unsent requests, as far as the socket allows. Returns
+//   -1 if the connection broke and was closed, else 0.
+static int ev_flush(ev_conn* ec) {
+    while (ec->unsent != NULL && !ec->connecting) {
+        struct iovec iov[EV_MAXIOV];
+        int niov = 0;
+        for (ev_request* req = ec->unsent; req != NULL && niov < EV_MAXIOV;
+             req = req->next, ++niov) {
+            size_t off = niov == 0 ? ec->unsent_off : 0;
+            iov[niov].iov_base = &req->text[off];
+            iov[niov].iov_len = req->len - off;
+        }
+        ssize_t nw = writev(ec->conn->fd, iov, niov);
+        if (nw == -1 && errno == EINTR) {
+            continue;
+        } else if (nw == -1 && errno == EAGAIN) {
+            break;
+        } else if (nw == -1) {
+            ev_conn_fail(ec);
+            return -1;
+        }
+        // advance past the written requests
+        size_t n = nw;
+        while (ec->unsent != NULL && n >= ec->unsent->len - ec->unsent_off) {
+            n -= ec->unsent->len - ec->unsent_off;
+            stat_record(&stat_send, elapsed() - ec->unsent->sent_at);
+            ec->unsent = ec->unsent->next;
+            ec->unsent_off = 0;
+        }
+        ec->unsent_off += n;
+    }
+    if (!ec->connecting) {
+        ev_watch(ec, EPOLLIN | (ec->unsent != NULL ? EPOLLOUT : 0));
+    }
+    return 0;
+}
+
+// ev_connected(ec)
+//   `ec`'s connect has completed, or failed
+static void ev_connected(ev_conn* ec) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(ec->conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    ec->connecting = 0;
+    if (err != 0) {
+        ec->conn->status_code = -1;
+        ev_conn_fail(ec);
+    } else {
+        stat_record(&stat_connect, elapsed() - ec->opened_at);
+        ev_flush(ec);
+    }
+}
+
+// ev_response_done(ec)
+//   the head request's response on `ec` is complete, and its body is the
+//   first `conn->content_length` bytes of `conn->buf`: act on it, and
+//   consume it; the bytes after it belong to the next response
+static void ev_response_done(ev_conn* ec) {
+    http_connection* conn = ec->conn;
+    size_t bodylen = conn->has_content_length ? conn->content_length
+        : conn->len;
+    char saved = conn->buf[bodylen];
+    conn->buf[bodylen] = 0;
+    double result = strtod(conn->buf, NULL);
+    if (result < 0) {
+        fprintf(stderr, "%.3f sec: server returned error: %s\n",
+                elapsed(), http_truncate_response(conn));
+        exit(1);
+    }
+    cc_release(result);
+    stat_record(&stat_body, elapsed() - ec->head->sent_at);
+    stat_count(&stat_done);
+    conn->buf[bodylen] = saved;
+    conn->buf += bodylen;
+    conn->len -= bodylen;
+
+    ev_request* req = ec->head;
+    ec->head = req->next;
+    if (ec->head == NULL) {
+        ec->tail = NULL;
+    }
+    --ec->depth;
+    free(req);
+}
+
+// ev_readable(ec)
+//   read what has arrived on `ec`, and match it to its requests'
+//   responses; one read may complete several responses
+static void ev_readable(ev_conn* ec) {
+    http_connection* conn = ec->conn;
+    ssize_t nr = http_read(conn);
+    if (nr == -1 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+    } else if (nr == -1) {
+        // a reset connection is treated like EOF, and retried
+        conn->eof = 1;
+    }
+
+    while (ec->head != NULL) {
+        if (conn->state == HTTP_INITIAL || conn->state == HTTP_HEADERS) {
+            if (http_process_response_headers(conn)) {
+                return;
+            }
+            // Status codes >= 500 mean we are overloading the server
+            // and should exit.
+            if (conn->status_code >= 500) {
+                fprintf(stderr, "%.3f sec: exiting because of "
+                        "server status %d (%s)\n", elapsed(),
+                        conn->status_code, http_truncate_response(conn));
+                exit(1);
+            } else if (conn->status_code != 200) {
+                ev_conn_fail(ec);
+                return;
+            }
+            // the server has the position, so the next one may be sent
+            ec->head->accepted = 1;
+            stat_record(&stat_header, elapsed() - ec->head->sent_at);
+            cc_latency(elapsed() - ec->head->sent_at);
+            if (ev.blocker == ec->head) {
+                ev.blocker = NULL;
+            }
+        }
+
+        if (http_check_response_body(conn)) {
+            return;
+        } else if (conn->state == HTTP_BROKEN) {
+            ev_conn_fail(ec);
+            return;
+        }
+        ev_response_done(ec);
+        if (conn->state == HTTP_CLOSED) {
+            // the server closed the connection; retry any requests
+            // still on it
+            ev_conn_fail(ec);
+            return;
+        }
+        if (ec->head != NULL) {
+            http_response_reset(conn);
+        }
+    }
+    if (conn->eof) {
+        ev_close(ec);
+    }
+}
+
+// pong_event_loop(b, maxconn, depth)
+//   play the game on board `b` with the event-driven engine, using at
+//   most `maxconn` connections, with up to `depth` requests on each.
+//   A position is sent as soon as the previous one's headers arrive, if
+//   the congestion window has room.
+static void pong_event_loop(pong_board* b, int maxconn, int depth) {
+    ev.epfd = epoll_create1(0);
+    if (ev.epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    ev.maxconn = maxconn;
+    ev.depth = depth;
+    ev.conns = (ev_conn**) malloc(sizeof(ev_conn*) * maxconn);
+    ev.next_send = elapsed();
+    ev.seed = (unsigned) getpid();
+
+    struct epoll_event events[EV_MAXEVENTS];
+    while (1) {
+        double now = elapsed();
+        // send the next position, if the congestion window has room
+        if (ev.blocker == NULL && now >= ev.next_send && cc_try_acquire(now)) {
+            if (b->clock_updated == 1) {
+                // fun-mode: leave the clock up for a few seconds
+                cc_release(-1);
+                board_reset_clock(b);
+                ev.next_send = now + 5;
+                continue;
+            }
+            if (board_dot(b)) {
+                ev_request* req = (ev_request*) calloc(1, sizeof(ev_request));
+                req->x = b->x;
+                req->y = b->y;
+                // just start min_delay as half, cause it is doubled
+                req->delay = MINDELAY/2;
+                char url[256];
+                pong_url(url, sizeof(url), req->x, req->y);
+                req->len = http_format_request(req->text, sizeof(req->text),
+                                               url, 1);
+                ev.blocker = req;
+                ev_start(req);
+            } else {
+                cc_release(-1);
+            }
+            board_move(b);
+        }
+
+        // start waiting requests that are due; they may queue again
+        ev_request* waitq = ev.waitq;
+        ev.waitq = NULL;
+        while (waitq != NULL) {
+            ev_request* req = waitq;
+            waitq = req->next;
+            if (req->start_at <= now) {
+                ev_start(req);
+            } else {
+                ev_queue(req, req->start_at);
+            }
+        }
+
+        // send this pass's requests, batched per connection
+        for (int i = 0; i < ev.nconn; ) {
+            ev_conn* ec = ev.conns[i];
+            if (ec->unsent != NULL && ev_flush(ec) < 0) {
+                continue;       // closed; another connection took slot i
+            }
+            ++i;
+        }
+
+        // sleep until the next send or retry, or an event; a full
+        // window opens on an event
+        double wake = -1;
+        if (ev.blocker == NULL && cc.inflight < (int) cc.window) {
+            wake = ev.next_send > cc.pause_until ? ev.next_send
+                : cc.pause_until;
+        }
+        for (ev_request* req = ev.waitq; req != NULL; req = req->next) {
+            if (req->start_at >= 0 && (wake < 0 || req->start_at < wake)) {
+                wake = req->start_at;
+            }
+        }
+        int timeout = -1;
+        if (wake >= 0) {
+            timeout = wake <= now ? 0 : (int) ((wake - now) * 1000) + 1;
+        }
+        int n = epoll_wait(ev.epfd, events, EV_MAXEVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; ++i) {
+            ev_conn* ec = (ev_conn*) events[i].data.ptr;
+            if (ec->connecting) {
+                ev_connected(ec);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && ev_flush(ec) < 0) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ev_readable(ec);
+            }
+        }
+    }
 }
 
 
 // usage()
 //    Explain how pong61 should be run.
 static void usage(void) {
-    fprintf(stderr, "Usage: ./pong61 [-h HOST] [-p PORT] [USER]\n");
+    fprintf(stderr, "Usage: ./pong61 [-n] [-e [-c MAXCONN] [-d DEPTH]] [-s SECS [-o STATSFILE]] [-h HOST] [-p PORT] [USER]\n");
     exit(1);
 }
 
@@ -437,8 +1601,9 @@ static void usage(void) {
 //    The main loop.
 int main(int argc, char** argv) {
     // parse arguments
-    int ch, nocheck = 0;
-    while ((ch = getopt(argc, argv, "nh:p:u:")) != -1) {
+    int ch, nocheck = 0, evmode = 0, maxconn = MAXCONNECT, depth = PIPEDEPTH;
+    const char* statpath = NULL;
+    while ((ch = getopt(argc, argv, "nec:d:s:o:h:p:u:")) != -1) {
         if (ch == 'h')
             pong_host = optarg;
         else if (ch == 'p')
@@ -447,6 +1612,16 @@ int main(int argc, char** argv) {
             pong_user = optarg;
         else if (ch == 'n')
             nocheck = 1;
+        else if (ch == 'e')
+            evmode = 1;
+        else if (ch == 'c' && (maxconn = atoi(optarg)) > 0)
+            ;
+        else if (ch == 'd' && (depth = atoi(optarg)) > 0)
+            ;
+        else if (ch == 's' && (stat_interval = strtod(optarg, NULL)) > 0)
+            ;
+        else if (ch == 'o')
+            statpath = optarg;
         else
             usage();
     }
@@ -455,6 +1630,9 @@ int main(int argc, char** argv) {
     else if (optind != argc)
         usage();
 
+    // a write to a reset connection fails with EPIPE, and is retried
+    signal(SIGPIPE, SIG_IGN);
+
     // look up network address of pong server
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
@@ -493,178 +1671,136 @@ int main(int argc, char** argv) {
            nocheck ? " (NOCHECK mode)" : "");
 
     // initialize global synchronization objects
-    pthread_mutex_init(&mutex, NULL);
-    pthread_mutex_init(&thrdcntmut, NULL);
+    pthread_mutex_init(&moveqmut, NULL);
+    pthread_mutex_init(&ordermut, NULL);
     pthread_mutex_init(&connpoolmut, NULL);
-    pthread_mutex_init(&stpdlymut, NULL);
-    pthread_cond_init(&condvar, NULL);
-    pthread_cond_init(&stpdlycond, NULL);
+    pthread_cond_init(&moveqcond, NULL);
+    pthread_cond_init(&ordercond, NULL);
+    pthread_cond_init(&poolcond, NULL);
+
+    // report stats every `stat_interval` seconds
+    if (stat_interval > 0) {
+        stat_file = statpath ? fopen(statpath, "a") : stderr;
+        if (stat_file == NULL) {
+            fprintf(stderr, "%s: %s\n", statpath, strerror(errno));
+            exit(1);
+        }
+        pthread_t pt;
+        r = pthread_create(&pt, NULL, stat_thread, NULL);
+        if (r != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(r));
+            exit(1);
+        }
+    }
     
-    // init connection table to NULL (IS THIS NECESSARY ???, prob not)
-    pthread_mutex_lock(&connpoolmut);
-    for (int i=0; i < MAXCONNECT; i++) {
+    // every connection table slot starts unused
+    for (int i = MAXCONNECT - 1; i >= 0; i--) {
         connectionpool[i] = NULL;
+        pool_push(&pool_empty, i);
     }
-    pthread_mutex_unlock(&connpoolmut);   
 
     // play game
-    int x = 0, y = 0, dx = 1, dy = 1;
-    char url[BUFSIZ];
-    int threadcntvar;
-    
-    // fun-mode vars, and init
-    int f_indx = 0;
-    int digcnt = 0;
-    int xoffset = width/3;
-    int yoffset = 1;
-    int clock_updated = 0;
-    int do_send_dot = 1;
+    pong_board board;
+    board_init(&board, width, height, nocheck);
     if (nocheck == 1) {
         fadetime = 25000;
         update_clock_time();
     }    
-    
+
+    if (evmode == 1) {
+        cc_init(maxconn * depth);
+        pong_event_loop(&board, maxconn, depth);
+    } else {
+        cc_init(MAXTHREADS);
+    }
+
+    // start the workers
+    moveq_init();
+    for (int i = 0; i < MAXTHREADS; ++i) {
+        pthread_t pt;
+        r = pthread_create(&pt, NULL, pong_worker, NULL);
+        if (r != 0) {
+            fprintf(stderr, "%.3f sec: pthread_create: %s\n",
+                    elapsed(), strerror(r));
+            exit(1);
+        }
+    }
+
+    // queue moves as fast as the congestion window allows
+    unsigned long long seq = 0;
     while (1) {
-        pthread_mutex_lock(&thrdcntmut);
-        threadcntvar = threadcnt;
-        pthread_mutex_unlock(&thrdcntmut);
-        // don't create too many threads !!
-        if (threadcntvar < MAXTHREADS) {
-            if (nocheck == 1) {
-                // fun-mode - (clock functionality)
-                // displays current time,
-                // waits a few seconds
-                // then updates and display new time
-                if (clock_updated == 1) {
-                    // set next time and 
-                    // position in grid
-                    usleep(5000000);
-                    digcnt = 0;
-                    xoffset = width/3;
-                    yoffset = 1;
-                    clock_updated = 0;
-                    update_clock_time();
-                }
-                
-                if (digit[currtime[digcnt]][f_indx] == 1) {
-                    x = digpos[f_indx][0] + xoffset;
-                    y = digpos[f_indx][1] + yoffset;
-                    do_send_dot = 1;
-                } else {
-                    do_send_dot = 0;
-                }
-                
-                if (f_indx < 14) {
-                    ++f_indx;
-                } else {
-                    f_indx = 0;
-                    if (digcnt < 5) {
-                        ++digcnt;
-                        if (digcnt == 2 || digcnt == 4) {
-                            // end of hrs, and mins
-                            xoffset = width/3;
-                            yoffset +=6;
-                        } else if (xoffset < (width - 8)) {
-                            xoffset += 4;
-                        } else {
-                            xoffset = 0; // reset if we hit edge
-                        }
-                    } else {
-                        clock_updated = 1;
-                    }
-                }
-            }
-        
-            if (do_send_dot == 1) {
-                // create a new thread to handle the next position
-                pong_args pa;
-                pa.x = x;
-                pa.y = y;
-                pthread_t pt;
-                
-                pthread_mutex_lock(&thrdcntmut);
-                // about to create new thread so increment cnt
-                ++threadcnt;    
-                pthread_mutex_unlock(&thrdcntmut);
-
-                pthread_mutex_lock(&stpdlymut);
-                int rc = pthread_cond_timedwait(&stpdlycond, &stpdlymut, &stopdelay);
-                if(rc == EINVAL || rc == EPERM || rc != ETIMEDOUT){
-                    perror("Error - Request did not wait.");
-                }
-                reset_stop_delay();
-                pthread_mutex_unlock(&stpdlymut);
-                
-                r = pthread_create(&pt, NULL, pong_thread, &pa);
-                if (r != 0) {
-                    fprintf(stderr, "%.3f sec: pthread_create: %s\n",
-                            elapsed(), strerror(r));
-                    exit(1);
-                }
-
-                // wait until that thread signals us to continue
-                pthread_mutex_lock(&mutex);
-                pthread_cond_wait(&condvar, &mutex);
-                pthread_mutex_unlock(&mutex);
-            }
-            // update position
-            if (nocheck == 0) {
-                x += dx;
-                y += dy;
-                if (x < 0 || x >= width) {
-                    dx = -dx;
-                    x += 2 * dx;
-                }
-                if (y < 0 || y >= height) {
-                    dy = -dy;
-                    y += 2 * dy;
-                }
+        if (board.clock_updated == 1) {
+            // fun-mode: set next time and 
+            // position in grid
+            usleep(5000000);
+            board_reset_clock(&board);
+        }
+
+        if (board_dot(&board) == 1) {
+            // wait for room in the congestion window
+            cc_acquire();
+
+            pong_move m;
+            m.x = board.x;
+            m.y = board.y;
+            m.seq = seq++;
+            // the window is at most MAXTHREADS < MOVEQ_SIZE, so the
+            // queue has room unless workers are slow to take moves
+            while (!moveq_push(&m)) {
+                usleep(1000);
             }
         }
-        // wait 0.1sec
-        usleep(100000);
+        // update position
+        board_move(&board);
     }
     
     // cleanup - close any open connections
-    pthread_mutex_lock(&connpoolmut);
     for (int i=0; i < MAXCONNECT; i++) {
-        http_close(connectionpool[i]);
+        if (connectionpool[i] != NULL) {
+            http_close(connectionpool[i]);
+        }
     }
-    pthread_mutex_unlock(&connpoolmut);  
 }
 
 
 // ** HTTP PARSING **
 
 // http_process_response_headers(conn)
-//    Parse the response represented by `conn->buf`. Returns 1
-//    if more header data remains to be read, 0 if all headers
-//    have been consumed.
+//    Parse the response headers at `conn->buf`. Each complete header
+//    line is consumed by advancing `conn->buf` past it; `conn->scan`
+//    remembers how much of a partial line was already searched, so no
+//    byte is scanned twice. Returns 1 if more header data remains to be
+//    read, 0 if all headers have been consumed.
 static int http_process_response_headers(http_connection* conn) {
-    size_t i = 0;
-    while ((conn->state == HTTP_INITIAL || conn->state == HTTP_HEADERS)
-           && i + 2 <= conn->len) {
-        if (conn->buf[i] == '\r' && conn->buf[i+1] == '\n') {
-            conn->buf[i] = 0;
-            if (conn->state == HTTP_INITIAL) {
-                int minor;
-                if (sscanf(conn->buf, "HTTP/1.%d %d", &minor, &conn->status_code) == 2) {
-                    conn->state = HTTP_HEADERS;
-                } else {
-                    conn->state = HTTP_BROKEN;
-                }
-            } else if (i == 0) {
-                conn->state = HTTP_BODY;
-            } else if (strncmp(conn->buf, "Content-Length: ", 16) == 0) {
-                conn->content_length = strtoul(conn->buf + 16, NULL, 0);
-                conn->has_content_length = 1;
+    while (conn->state == HTTP_INITIAL || conn->state == HTTP_HEADERS) {
+        char* line = conn->buf;
+        char* nl = (char*) memchr(line + conn->scan, '\n',
+                                  conn->len - conn->scan);
+        if (nl == NULL) {
+            conn->scan = conn->len;
+            break;
+        }
+        // the line is [line, end), without its CRLF
+        char* end = nl > line && nl[-1] == '\r' ? nl - 1 : nl;
+        if (conn->state == HTTP_INITIAL) {
+            // "HTTP/1.x NNN ..."
+            if (end - line >= 12 && memcmp(line, "HTTP/1.", 7) == 0
+                && line[8] == ' ') {
+                conn->status_code = strtol(line + 9, NULL, 10);
+                conn->state = HTTP_HEADERS;
+            } else {
+                conn->state = HTTP_BROKEN;
             }
-            memmove(conn->buf, conn->buf + i + 2, conn->len - (i + 2));
-            conn->len -= i + 2;
-            i = 0;
-        } else {
-            ++i;
+        } else if (end == line) {
+            conn->state = HTTP_BODY;
+        } else if (end - line > 15
+                   && strncasecmp(line, "Content-Length:", 15) == 0) {
+            conn->content_length = strtoul(line + 15, NULL, 10);
+            conn->has_content_length = 1;
         }
+        conn->buf = nl + 1;
+        conn->len -= nl + 1 - line;
+        conn->scan = 0;
     }
 
     if (conn->eof) {